@@ -0,0 +1,920 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "irq.h"
+#include "node.h"
+#include "fabric.h"
+#include "varint.h"
+#include "delayed_sendto.h"
+#include "fec.h"
+#include "hdr.h"
+#include "l1_phys.h"
+#include "iothread.h"
+#include "l2_link.h"
+#include "l3_net.h"
+#include "l4_trans.h"
+#include "l5_app.h"
+
+/*
+ * Microbenchmarks of the fast paths of the protocol stack. Every case
+ * calls one function of one layer in a loop and reports the time and
+ * the number of allocations per call. The layers below and above are
+ * replaced by stubs when the program is linked (see BENCH_WRAP in the
+ * Makefile): -Wl,--wrap=f sends the calls of f from the other object
+ * files to __wrap_f below, and __real_f is the original.
+ *
+ * With a threshold file, every case is compared to its line
+ *   <case> <max ns/op> <max allocs/op>
+ * and the program exits with 1 if a case is slower or allocates more.
+ */
+
+#define MAX_CASES     32
+#define FRAME_BATCH   16       /* frames per l2 round, less than RX_BUFFER */
+#define DELAY_BATCH   64       /* frames per delayed queue round */
+#define STUB_FRAMES   256
+#define STUB_FRAME_SZ 2048
+#define WAKEUP_GAP    50       /* us between the frames of the wakeup cases, on average */
+#define STRESS_TIME   3000     /* ms of the I/O thread stress case */
+#define STRESS_BURST  16       /* frames sent back to back */
+#define STRESS_TICK   10       /* ms between its checks */
+#define STRESS_STALL  1000     /* ms without a frame that end it */
+
+/* The first types of the L1 header, see l1_phys.c. */
+#define L1_UP    1
+#define L1_HELLO 4
+
+/*
+ * Allocation counter: every malloc, calloc, realloc and strdup of
+ * the stack.
+ */
+static unsigned long allocs = 0;
+
+void* __real_malloc( size_t size );
+void* __real_calloc( size_t n, size_t size );
+void* __real_realloc( void* p, size_t size );
+char* __real_strdup( const char* s );
+
+void* __wrap_malloc( size_t size )             { allocs++; return __real_malloc( size ); }
+void* __wrap_calloc( size_t n, size_t size )   { allocs++; return __real_calloc( n, size ); }
+void* __wrap_realloc( void* p, size_t size )   { allocs++; return __real_realloc( p, size ); }
+char* __wrap_strdup( const char* s )           { allocs++; return __real_strdup( s ); }
+
+/*
+ * The stub below layer 2 keeps the frames that are sent, with the
+ * node that sent them, so that they can be handed to the other node.
+ */
+struct StubFrame
+{
+    int  node;
+    int  length;
+    char data[STUB_FRAME_SZ];
+};
+static struct StubFrame stub_frames[STUB_FRAMES];
+static int              num_stub_frames = 0;
+
+int __wrap_l1_sendv( int device, const char* hdr, int hlen, const char* buf, int length )
+{
+    struct StubFrame* f;
+
+    if( num_stub_frames == STUB_FRAMES || hlen + length > STUB_FRAME_SZ )
+    {
+        return hlen + length;    /* lost on the cable */
+    }
+    f = &stub_frames[num_stub_frames++];
+    f->node   = this_node->id;
+    f->length = hlen + length;
+    memcpy( f->data, hdr, hlen );
+    memcpy( f->data + hlen, buf, length );
+    return hlen + length;
+}
+
+int __wrap_l1_ready( int device )
+{
+    return 1;
+}
+
+/* above layer 2: everything is delivered */
+int __wrap_l3_recv( int mac_address, const char* buf, int length )
+{
+    return length;
+}
+
+/* below layer 3: everything is sent */
+int __real_l2_send_prio( int mac_address, const char* buf, int length, int prio );
+int __wrap_l2_send_prio( int mac_address, const char* buf, int length, int prio )
+{
+    return length;
+}
+
+/* below layer 1 and the delayed queue */
+static unsigned long wire_frames = 0;
+
+ssize_t __wrap_fabric_sendto( int s, const void* msg, size_t len, int flags,
+                              const struct sockaddr* to, socklen_t tolen )
+{
+    wire_frames++;
+    return len;
+}
+
+/* layer 1 from the event loop: count the frames it handles */
+static unsigned long handled_frames = 0;
+
+int __real_l1_handle_event( );
+int __wrap_l1_handle_event( )
+{
+    int r = __real_l1_handle_event( );
+    if( r ) handled_frames++;
+    return r;
+}
+
+/* the next frame that layer 1 receives */
+static const char*        rx_frame;
+static int                rx_length;
+static struct sockaddr_in rx_from;
+
+ssize_t __wrap_fabric_recvfrom( int s, void* buf, size_t len, int flags,
+                                struct sockaddr* from, socklen_t* fromlen )
+{
+    memcpy( buf, rx_frame, rx_length );
+    memcpy( from, &rx_from, sizeof(rx_from) );
+    *fromlen = sizeof(rx_from);
+    return rx_length;
+}
+
+/*
+ * Timing.
+ */
+struct BenchResult
+{
+    char   name[40];
+    double ns_per_op;
+    double allocs_per_op;
+};
+static struct BenchResult results[MAX_CASES];
+static int                num_results = 0;
+
+static long long now_ns( )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report( const char* name, long long ns, unsigned long alloc_count, long ops )
+{
+    struct BenchResult* r = &results[num_results++];
+
+    snprintf( r->name, sizeof(r->name), "%s", name );
+    r->ns_per_op     = (double)ns / ops;
+    r->allocs_per_op = (double)alloc_count / ops;
+}
+
+static node_t* boot_node( int id )
+{
+    node_t* node = node_create( id );
+    l1_init( 30000+id, id );
+    l2_init( id, 0 );
+    l3_init( id );
+    l4_init( );
+    l5_init( );
+    l5_set_quiet( 1 );
+    return node;
+}
+
+/*
+ * A packet as layer 3 passes it to layer 2: L3 and L4 headers and
+ * payload.
+ */
+static int make_packet( char* buf, int src, int dst, int length )
+{
+    unsigned char* p = (unsigned char*)buf;
+    int            n = 0;
+
+    memset( buf, 'x', length );
+    n += varint_put( p+n, src );
+    n += varint_put( p+n, dst );
+    put16( p+n, 100 );   /* ports */
+    put16( p+n+2, 100 );
+    p[n+4] = 1;          /* DATA */
+    put16( p+n+5, 0 );
+    return length;
+}
+
+/*
+ * register_timeout_cb and remove_timeout with many pending timers.
+ * One op is one register and one remove at a random time.
+ */
+static void never( void* param )
+{
+}
+
+static void bench_timers( const char* name, int pending, long ops )
+{
+    int*           ids = (int*)malloc( pending * sizeof(int) );
+    struct timeval base, tv;
+    long long      t0, t;
+    unsigned long  a0;
+    long           i;
+
+    irq_get_time( &base );
+    base.tv_sec += 100000;
+    srand( 1 );
+    for( i=0; i<pending; i++ )
+    {
+        tv = base;
+        tv.tv_sec += rand( ) % 1000;
+        ids[i] = register_timeout_cb( tv, &never, NULL );
+    }
+
+    a0 = allocs;
+    t0 = now_ns( );
+    for( i=0; i<ops; i++ )
+    {
+        int id;
+        tv = base;
+        tv.tv_sec += rand( ) % 1000;
+        id = register_timeout_cb( tv, &never, NULL );
+        remove_timeout( id );
+    }
+    t = now_ns( ) - t0;
+    report( name, t, allocs - a0, ops );
+
+    for( i=0; i<pending; i++ )
+    {
+        remove_timeout( ids[i] );
+    }
+    free( ids );
+}
+
+/*
+ * Hand the frames that one node has sent to the other, until no
+ * more are sent. Untimed, this returns the credit to the sender.
+ */
+static void pump( node_t* a, node_t* b )
+{
+    struct StubFrame frames[FRAME_BATCH*2];
+    int              n, i;
+
+    while( num_stub_frames > 0 )
+    {
+        n = num_stub_frames < FRAME_BATCH*2 ? num_stub_frames : FRAME_BATCH*2;
+        memcpy( frames, stub_frames, n * sizeof(struct StubFrame) );
+        memmove( stub_frames, stub_frames+n, (num_stub_frames-n) * sizeof(struct StubFrame) );
+        num_stub_frames -= n;
+        for( i=0; i<n; i++ )
+        {
+            this_node = frames[i].node == a->id ? b : a;
+            l2_recv( 0, frames[i].data, frames[i].length );
+        }
+    }
+}
+
+/*
+ * l2_send and l2_recv between two nodes that are connected by the
+ * stub. A sends a batch of frames, timed for l2_send, then B receives
+ * them, timed for l2_recv, and the answers go back untimed.
+ */
+static void bench_l2( node_t* a, node_t* b, int length, long rounds )
+{
+    char             packet[STUB_FRAME_SZ];
+    struct StubFrame batch[FRAME_BATCH];
+    long long        t_send = 0, t_recv = 0, t0;
+    unsigned long    a_send = 0, a_recv = 0, a0;
+    long             ops = 0;
+    long             r;
+    int              i, n;
+
+    make_packet( packet, a->id, b->id, length );
+
+    for( r=0; r<rounds; r++ )
+    {
+        this_node = a;
+        a0 = allocs;
+        t0 = now_ns( );
+        for( i=0; i<FRAME_BATCH; i++ )
+        {
+            l2_send( b->id, packet, length );
+        }
+        t_send += now_ns( ) - t0;
+        a_send += allocs - a0;
+
+        n = 0;
+        for( i=0; i<num_stub_frames; i++ )
+        {
+            if( stub_frames[i].node == a->id && n < FRAME_BATCH )
+            {
+                batch[n++] = stub_frames[i];
+            }
+        }
+        num_stub_frames = 0;
+
+        this_node = b;
+        a0 = allocs;
+        t0 = now_ns( );
+        for( i=0; i<n; i++ )
+        {
+            l2_recv( 0, batch[i].data, batch[i].length );
+        }
+        t_recv += now_ns( ) - t0;
+        a_recv += allocs - a0;
+        ops    += n;
+
+        pump( a, b );
+    }
+
+    report( "l2_send", t_send, a_send, rounds*FRAME_BATCH );
+    report( "l2_recv", t_recv, a_recv, ops > 0 ? ops : 1 );
+}
+
+static void bench_l3_send( node_t* a, int dest, int length, long ops )
+{
+    char          packet[STUB_FRAME_SZ];
+    long long     t0;
+    unsigned long a0;
+    long          i;
+
+    memset( packet, 'x', length );
+    this_node = a;
+    a0 = allocs;
+    t0 = now_ns( );
+    for( i=0; i<ops; i++ )
+    {
+        l3_send( dest, packet, length );
+    }
+    report( "l3_send", now_ns( ) - t0, allocs - a0, ops );
+}
+
+/*
+ * l3_send_group from a node with fanout neighbours. One op is one
+ * packet to all of them. The links are brought down and up between
+ * rounds, untimed, so that the neighbours never run out of credit.
+ */
+static void bench_l3_group( node_t* a, int fanout, long rounds )
+{
+    char          packet[STUB_FRAME_SZ];
+    char          name[40];
+    long long     t = 0, t0;
+    unsigned long a_sum = 0, a0;
+    long          r;
+    int           i;
+
+    memset( packet, 'x', 100 );
+    this_node = a;
+    for( r=0; r<rounds; r++ )
+    {
+        for( i=1; i<=fanout; i++ )
+        {
+            l2_linkup( i, "127.0.0.1", 31000+i, 100+i );
+        }
+
+        a0 = allocs;
+        t0 = now_ns( );
+        for( i=0; i<FRAME_BATCH; i++ )
+        {
+            l3_send_group( L3_GROUP_ALL, packet, 7, packet+7, 93 );
+        }
+        t     += now_ns( ) - t0;
+        a_sum += allocs - a0;
+
+        for( i=1; i<=fanout; i++ )
+        {
+            l2_linkdown( i );
+        }
+        num_stub_frames = 0;
+    }
+
+    snprintf( name, sizeof(name), "l3_send_group_%d", fanout );
+    report( name, t, a_sum, rounds*FRAME_BATCH );
+}
+
+/*
+ * l4_getport for any port and l4_putport, while in_use ports are
+ * taken. Free ports are searched from the top.
+ */
+static void bench_ports( node_t* a, int in_use, long ops )
+{
+    char          name[40];
+    long long     t0;
+    unsigned long a0;
+    long          i;
+    int           port;
+
+    this_node = a;
+    for( i=0; i<in_use; i++ )
+    {
+        l4_getport( 1, -1 );
+    }
+
+    a0 = allocs;
+    t0 = now_ns( );
+    for( i=0; i<ops; i++ )
+    {
+        port = l4_getport( 2, -1 );
+        l4_putport( port );
+    }
+    snprintf( name, sizeof(name), "l4_port_churn_%d", in_use );
+    report( name, now_ns( ) - t0, allocs - a0, ops );
+
+    for( i=0; i<in_use; i++ )
+    {
+        l4_putport( 1023-i );
+    }
+}
+
+/*
+ * The lookup of the connection of a received frame (get_phys_conn),
+ * measured through l1_handle_event with HELLO frames from the last
+ * of fill connections.
+ */
+static void l1_inject( int type, int port, int mac )
+{
+    int frame[2];
+
+    frame[0] = htonl(type);
+    frame[1] = htonl(mac);
+    rx_frame  = (const char*)frame;
+    rx_length = sizeof(frame);
+    memset( &rx_from, 0, sizeof(rx_from) );
+    rx_from.sin_family      = AF_INET;
+    rx_from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    rx_from.sin_port        = htons(port);
+    l1_handle_event( );
+}
+
+static void bench_phys_conn( node_t* n, int* filled, int fill, long ops )
+{
+    char          name[40];
+    long long     t0;
+    unsigned long a0;
+    long          i;
+
+    this_node = n;
+    for( ; *filled < fill; (*filled)++ )
+    {
+        l1_inject( L1_UP, 40000 + *filled, 10 + *filled );
+    }
+
+    a0 = allocs;
+    t0 = now_ns( );
+    for( i=0; i<ops; i++ )
+    {
+        l1_inject( L1_HELLO, 40000 + fill-1, 0 );
+    }
+    snprintf( name, sizeof(name), "get_phys_conn_%d", fill );
+    report( name, now_ns( ) - t0, allocs - a0, ops );
+}
+
+/*
+ * delayed_sendto: enqueue a batch, then let the timers drain it.
+ * One op is one frame enqueued and sent.
+ */
+static void bench_delayed( node_t* n, long rounds )
+{
+    char               frame[100];
+    struct sockaddr_in to;
+    unsigned long      target;
+    long long          t0;
+    unsigned long      a0;
+    long               r;
+    int                i;
+
+    memset( frame, 'x', sizeof(frame) );
+    memset( &to, 0, sizeof(to) );
+    to.sin_family = AF_INET;
+
+    this_node = n;
+    a0 = allocs;
+    t0 = now_ns( );
+    for( r=0; r<rounds; r++ )
+    {
+        for( i=0; i<DELAY_BATCH; i++ )
+        {
+            delayed_sendto( n->udp_socket, frame, sizeof(frame), 0,
+                            (struct sockaddr*)&to, sizeof(to) );
+        }
+        target = wire_frames + DELAY_BATCH;
+        while( wire_frames < target && irq_run_next_timeout( ) )
+            ;
+    }
+    report( "delayed_queue", now_ns( ) - t0, allocs - a0, rounds*DELAY_BATCH );
+}
+
+/*
+ * The GF(2^8) multiply-add of FEC, on 1 KB.
+ */
+static void bench_gf( long ops )
+{
+    unsigned char dst[1024];
+    unsigned char src[1024];
+    char          name[40];
+    long long     t0;
+    unsigned long a0;
+    long          i;
+
+    fec_init( );
+    for( i=0; i<sizeof(src); i++ )
+    {
+        src[i] = i * 7;
+        dst[i] = i;
+    }
+
+    a0 = allocs;
+    t0 = now_ns( );
+    for( i=0; i<ops; i++ )
+    {
+        gf_mul_add( dst, src, 0x53, sizeof(dst) );
+    }
+    snprintf( name, sizeof(name), "gf_mul_add_1k_%s", fec_kernel( ) );
+    report( name, now_ns( ) - t0, allocs - a0, ops );
+}
+
+/*
+ * The wakeup cases send frames over loopback from a second thread,
+ * WAKEUP_GAP us apart on average, so that the receiver is idle
+ * before each one. The receiver either sleeps in select(), as
+ * handle_events() does, or spins on non-blocking receives, as it
+ * does with irq_set_busy_poll(). The result is the 99th percentile
+ * of the time from sendto() to the frame in user space, not a time
+ * per op. Spinning takes a CPU, so the cases need two.
+ */
+struct Wakeup
+{
+    int                s;
+    struct sockaddr_in to;
+    long               samples;
+};
+
+static double wakeup_p99[2];
+
+static void* wakeup_sender( void* param )
+{
+    struct Wakeup*  w = (struct Wakeup*)param;
+    struct timespec gap;
+    long long       t;
+    long            i;
+
+    for( i=0; i<w->samples; i++ )
+    {
+        gap.tv_sec  = 0;
+        gap.tv_nsec = (WAKEUP_GAP/2 + rand( ) % WAKEUP_GAP) * 1000;
+        nanosleep( &gap, NULL );
+        t = now_ns( );
+        sendto( w->s, &t, sizeof(t), 0, (struct sockaddr*)&w->to, sizeof(w->to) );
+    }
+    return NULL;
+}
+
+static void bench_wakeup( const char* name, int busy, long samples )
+{
+    static hdr_t       h;
+    struct Wakeup      w;
+    struct sockaddr_in addr;
+    socklen_t          addrlen = sizeof(addr);
+    pthread_t          sender;
+    fd_set             read_set;
+    struct timeval     tv;
+    long long          t;
+    long               i;
+    int                r;
+
+    if( sysconf( _SC_NPROCESSORS_ONLN ) < 2 )
+    {
+        fprintf( stderr, "%s needs two CPUs, skipped\n", name );
+        return;
+    }
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    r = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    w.s = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if( r < 0 || w.s < 0
+        || bind( r, (struct sockaddr*)&addr, sizeof(addr) ) < 0
+        || getsockname( r, (struct sockaddr*)&w.to, &addrlen ) < 0 )
+    {
+        perror( name );
+        exit( -1 );
+    }
+    w.samples = samples;
+
+    hdr_reset( &h );
+    pthread_create( &sender, NULL, wakeup_sender, &w );
+    for( i=0; i<samples; i++ )
+    {
+        if( !busy )
+        {
+            /* a lost frame ends the case instead of hanging */
+            FD_ZERO( &read_set );
+            FD_SET( r, &read_set );
+            tv.tv_sec  = 1;
+            tv.tv_usec = 0;
+            if( select( r+1, &read_set, 0, 0, &tv ) <= 0 )
+            {
+                break;
+            }
+        }
+        t = 0;
+        while( recv( r, &t, sizeof(t), MSG_DONTWAIT ) < 0 && busy )
+            ;
+        if( t > 0 )
+        {
+            hdr_record( &h, now_ns( ) - t );
+        }
+    }
+    pthread_join( sender, NULL );
+    close( r );
+    close( w.s );
+
+    wakeup_p99[busy] = hdr_percentile( &h, 99.0 );
+    report( name, wakeup_p99[busy], 0, 1 );
+}
+
+/*
+ * The I/O thread under sustained load with a budget of 1, so that
+ * handle_events() leaves frames in the rx ring after every round and
+ * falls back to select() often. A second thread sends HELLO frames
+ * over loopback as fast as it can, like a PERF, and the real event
+ * loop takes them. A wakeup that gets lost stops the loop for good
+ * while the ring is full. handle_events() does not return, so the
+ * case runs in a child process, which a timer ends. The result is
+ * the longest time without a frame, not a time per op.
+ */
+struct Stress
+{
+    int                s;
+    struct sockaddr_in to;
+    volatile int       stop;
+    pthread_t          sender;
+    long long          start;
+    long long          progress;     /* the last time that a frame was handled */
+    long long          max_gap;
+    unsigned long      frames;       /* at the last check */
+    int                pipe;
+};
+
+static double stress_gap;
+static double stress_rate;
+
+static void* stress_sender( void* param )
+{
+    struct Stress* st = (struct Stress*)param;
+    char           frame[64];
+    int            type = htonl( L1_HELLO );
+    int            i;
+
+    memset( frame, 0, sizeof(frame) );
+    memcpy( frame, &type, sizeof(type) );
+    while( !st->stop )
+    {
+        for( i=0; i<STRESS_BURST; i++ )
+        {
+            sendto( st->s, frame, sizeof(frame), 0, (struct sockaddr*)&st->to, sizeof(st->to) );
+        }
+        sched_yield( );
+    }
+    return NULL;
+}
+
+static void stress_tick( void* param )
+{
+    struct Stress* st  = (struct Stress*)param;
+    long long      now = now_ns( );
+    long long      result[2];
+    struct timeval tv;
+    struct timeval tick = { 0, STRESS_TICK * 1000 };
+
+    if( handled_frames != st->frames )
+    {
+        st->frames   = handled_frames;
+        st->progress = now;
+    }
+    if( now - st->progress > st->max_gap )
+    {
+        st->max_gap = now - st->progress;
+    }
+
+    if( now - st->start < STRESS_TIME * 1000000LL && st->max_gap < STRESS_STALL * 1000000LL )
+    {
+        irq_get_time( &tv );
+        timeradd( &tv, &tick, &tv );
+        register_timeout_cb( tv, &stress_tick, st );
+        return;
+    }
+
+    st->stop = 1;
+    pthread_join( st->sender, NULL );
+    result[0] = st->max_gap;
+    result[1] = st->frames * 1000000000LL / (now - st->start);
+    if( write( st->pipe, result, sizeof(result) ) != sizeof(result) )
+    {
+        _exit( 1 );
+    }
+    _exit( 0 );
+}
+
+static void stress_child( int fd )
+{
+    static struct Stress st;
+    socklen_t            addrlen = sizeof(st.to);
+    struct timeval       tv;
+
+    node_create( 9 );
+    l1_set_io_thread( 1 );
+    l1_set_liveness( 0, 3 );
+    irq_set_budget( 1 );
+    irq_enable_keyboard( 0 );
+    l1_init( 0, 9 );
+    if( !iothread_running( )
+        || getsockname( this_node->udp_socket, (struct sockaddr*)&st.to, &addrlen ) < 0 )
+    {
+        _exit( 1 );
+    }
+    st.to.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    st.s    = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    st.pipe = fd;
+    if( st.s < 0 )
+    {
+        _exit( 1 );
+    }
+
+    st.start    = now_ns( );
+    st.progress = st.start;
+    pthread_create( &st.sender, NULL, stress_sender, &st );
+    irq_get_time( &tv );
+    register_timeout_cb( tv, &stress_tick, &st );
+    handle_events( );
+}
+
+static void bench_stress( const char* name )
+{
+    long long result[2];
+    int       fds[2];
+    int       status;
+    pid_t     pid;
+
+    if( pipe( fds ) < 0 || (pid = fork( )) < 0 )
+    {
+        perror( name );
+        exit( -1 );
+    }
+    if( pid == 0 )
+    {
+        close( fds[0] );
+        stress_child( fds[1] );
+    }
+    close( fds[1] );
+
+    if( read( fds[0], result, sizeof(result) ) != sizeof(result) )
+    {
+        /* no result is a failure as well */
+        result[0] = STRESS_TIME * 1000000LL;
+        result[1] = 0;
+    }
+    close( fds[0] );
+    waitpid( pid, &status, 0 );
+
+    stress_gap  = result[0];
+    stress_rate = result[1];
+    report( name, stress_gap, 0, 1 );
+}
+
+/*
+ * Compare the results to the threshold file. Returns the number of
+ * cases that are over their threshold.
+ */
+static int check_thresholds( const char* filename )
+{
+    FILE*  f;
+    char   line[200];
+    char   name[40];
+    double max_ns, max_allocs;
+    int    checked[MAX_CASES];
+    int    failed = 0;
+    int    i;
+
+    f = fopen( filename, "r" );
+    if( f == NULL )
+    {
+        perror( filename );
+        return 1;
+    }
+
+    memset( checked, 0, sizeof(checked) );
+    while( fgets( line, sizeof(line), f ) )
+    {
+        if( line[0] == '#' || sscanf( line, "%39s %lf %lf", name, &max_ns, &max_allocs ) != 3 )
+        {
+            continue;
+        }
+        for( i=0; i<num_results; i++ )
+        {
+            if( strcmp( results[i].name, name ) )
+            {
+                continue;
+            }
+            checked[i] = 1;
+            if( results[i].ns_per_op > max_ns || results[i].allocs_per_op > max_allocs )
+            {
+                fprintf( stderr, "REGRESSION %s: %.1f ns/op (max %.1f), %.2f allocs/op (max %.2f)\n",
+                                 name, results[i].ns_per_op, max_ns,
+                                 results[i].allocs_per_op, max_allocs );
+                failed++;
+            }
+        }
+    }
+    fclose( f );
+
+    for( i=0; i<num_results; i++ )
+    {
+        if( !checked[i] )
+        {
+            fprintf( stderr, "no threshold for %s\n", results[i].name );
+        }
+    }
+    return failed;
+}
+
+int main( int argc, char* argv[] )
+{
+    node_t* a;
+    node_t* b;
+    node_t* c;
+    int     filled = 0;
+    int     i;
+
+    if( argc > 2 )
+    {
+        fprintf( stderr, "Usage: %s [<threshold file>]\n", argv[0] );
+        exit( -1 );
+    }
+
+    /* before the clock and the sockets are simulated */
+    bench_stress( "iothread_budget_1_gap" );
+
+    irq_set_virtual_time( 1 );
+    fabric_enable( );
+    l1_set_liveness( 0, 3 );
+
+    a = boot_node( 1 );
+    b = boot_node( 2 );
+    c = boot_node( 3 );
+
+    bench_timers( "timers_10k", 10000, 200000 );
+    bench_timers( "timers_100k", 100000, 200000 );
+
+    bench_delayed( c, 2000 );
+
+    this_node = a;
+    l2_linkup( 0, "127.0.0.1", 30002, b->id );
+    this_node = b;
+    l2_linkup( 0, "127.0.0.1", 30001, a->id );
+    bench_l2( a, b, 100, 20000 );
+
+    bench_l3_send( a, b->id, 100, 200000 );
+    bench_l3_group( a, 8, 2000 );
+
+    bench_ports( a, 0, 200000 );
+    bench_ports( a, 1000, 20000 );
+
+    bench_phys_conn( c, &filled, 16, 200000 );
+    bench_phys_conn( c, &filled, 256, 200000 );
+    bench_phys_conn( c, &filled, 1000, 100000 );
+
+    bench_gf( 200000 );
+
+    bench_wakeup( "wakeup_select_p99", 0, 5000 );
+    bench_wakeup( "wakeup_busy_p99", 1, 5000 );
+
+    printf( "%-24s %12s %12s\n", "case", "ns/op", "allocs/op" );
+    for( i=0; i<num_results; i++ )
+    {
+        printf( "%-24s %12.1f %12.2f\n", results[i].name, results[i].ns_per_op, results[i].allocs_per_op );
+    }
+    if( wakeup_p99[0] > 0 && wakeup_p99[1] > 0 )
+    {
+        printf( "busy polling: p99 wakeup %.1f us instead of %.1f us\n",
+                wakeup_p99[1] / 1000.0, wakeup_p99[0] / 1000.0 );
+    }
+    if( stress_rate > 0 )
+    {
+        printf( "I/O thread with a budget of 1: %.0f frames/s, at most %.1f ms without one\n",
+                stress_rate, stress_gap / 1000000.0 );
+    }
+
+    if( argc == 2 && check_thresholds( argv[1] ) > 0 )
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "node.h"
+#include "checkpoint.h"
+#include "logger.h"
+
+/*
+ * Warm restart. The links of a node and what the neighbours have
+ * told its routing are kept in a file that is mapped into memory.
+ * The layers write to it when their state changes, a few bytes at a
+ * time, and the kernel writes the pages back. Nothing is lost when
+ * the program dies, only when the machine does.
+ *
+ * At the start, l1_init, l2_init and l3_init take the links that
+ * were up from the file. The node can forward at once. Layer 1 sends
+ * an UP on every restored link, so that the other side starts over
+ * too, and liveness detection declares the links down whose other
+ * side is gone.
+ *
+ * The file has a header and one slot per device. A slot is written
+ * before it is marked as valid and marked as invalid before it is
+ * reused, so a half written slot is never restored. A file whose
+ * header does not match this version, port or address is cleared.
+ */
+#define CKPT_MAGIC "OBLIGCKP"
+
+struct CheckpointHeader
+{
+    char         magic[8];
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int link_size;
+    unsigned int links;
+    int          port;
+    int          mac;
+};
+
+struct CheckpointFile
+{
+    struct CheckpointHeader hdr;
+    ckpt_link_t             link[CKPT_LINKS];
+};
+
+/*
+ * The checkpoint of one node.
+ */
+struct CheckpointState
+{
+    struct CheckpointFile* file;
+    int                    restored;   /* links found at the start */
+};
+
+static const char* filename = NULL;
+
+/*
+ * Keep the state of the node in this file. Call before l1_init.
+ */
+void checkpoint_set_file( const char* path )
+{
+    filename = path;
+}
+
+static int header_matches( const struct CheckpointHeader* h, int port, int mac )
+{
+    return memcmp( h->magic, CKPT_MAGIC, sizeof(h->magic) ) == 0
+        && h->version     == CKPT_VERSION
+        && h->header_size == sizeof(struct CheckpointHeader)
+        && h->link_size   == sizeof(ckpt_link_t)
+        && h->links       == CKPT_LINKS
+        && h->port        == port
+        && h->mac         == mac;
+}
+
+/*
+ * Map the file, from l1_init. Without a file, all the other
+ * functions do nothing.
+ */
+void checkpoint_open( int port, int mac )
+{
+    struct CheckpointState* c;
+    struct CheckpointFile*  f;
+    int                     fd;
+    int                     i;
+
+    if( filename == NULL )
+    {
+        return;
+    }
+
+    fd = open( filename, O_RDWR | O_CREAT, 0644 );
+    if( fd < 0 || ftruncate( fd, sizeof(struct CheckpointFile) ) < 0 )
+    {
+        logmsg( LL_ERROR, "Could not open checkpoint %s: %s\n", filename, strerror( errno ) );
+        if( fd >= 0 ) close( fd );
+        return;
+    }
+    f = (struct CheckpointFile*)mmap( NULL, sizeof(struct CheckpointFile),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( f == MAP_FAILED )
+    {
+        logmsg( LL_ERROR, "Could not map checkpoint %s: %s\n", filename, strerror( errno ) );
+        return;
+    }
+
+    c = (struct CheckpointState*)calloc( 1, sizeof(struct CheckpointState) );
+    if( c == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in checkpoint_open\n" );
+        munmap( f, sizeof(struct CheckpointFile) );
+        return;
+    }
+    c->file = f;
+    this_node->checkpoint = c;
+
+    if( !header_matches( &f->hdr, port, mac ) )
+    {
+        memset( f, 0, sizeof(struct CheckpointFile) );
+        memcpy( f->hdr.magic, CKPT_MAGIC, sizeof(f->hdr.magic) );
+        f->hdr.version     = CKPT_VERSION;
+        f->hdr.header_size = sizeof(struct CheckpointHeader);
+        f->hdr.link_size   = sizeof(ckpt_link_t);
+        f->hdr.links       = CKPT_LINKS;
+        f->hdr.port        = port;
+        f->hdr.mac         = mac;
+        for( i=0; i<CKPT_LINKS; i++ )
+        {
+            f->link[i].local_mac  = -1;
+            f->link[i].remote_mac = -1;
+        }
+        return;
+    }
+
+    for( i=0; i<CKPT_LINKS; i++ )
+    {
+        ckpt_link_t* l = &f->link[i];
+        if( l->state != CKPT_UP )
+        {
+            continue;
+        }
+        if( l->device != i
+         || l->local_mac  < 0 || l->local_mac  >= CKPT_ADDRESSES
+         || l->remote_mac < 0 || l->remote_mac >= CKPT_ADDRESSES )
+        {
+            l->state      = 0;
+            l->remote_mac = -1;
+            continue;
+        }
+        l->hostname[CKPT_HOSTNAME-1] = 0;
+        c->restored++;
+    }
+    if( c->restored > 0 )
+    {
+        logmsg( LL_INFO, "Restored %d links from %s\n", c->restored, filename );
+    }
+}
+
+/*
+ * The number of links that have been restored.
+ */
+int checkpoint_restored( )
+{
+    return this_node->checkpoint ? this_node->checkpoint->restored : 0;
+}
+
+/*
+ * The slot of an established link, or NULL.
+ */
+ckpt_link_t* checkpoint_link( int device )
+{
+    ckpt_link_t* l;
+
+    if( this_node->checkpoint == NULL || device < 0 || device >= CKPT_LINKS )
+    {
+        return NULL;
+    }
+    l = &this_node->checkpoint->file->link[device];
+    return l->state == CKPT_UP ? l : NULL;
+}
+
+/*
+ * The slot of the established link to the MAC address, or NULL.
+ */
+ckpt_link_t* checkpoint_neighbour( int mac )
+{
+    ckpt_link_t* l;
+    int          i;
+
+    if( this_node->checkpoint == NULL )
+    {
+        return NULL;
+    }
+    for( i=0; i<CKPT_LINKS; i++ )
+    {
+        l = &this_node->checkpoint->file->link[i];
+        if( l->state == CKPT_UP && l->remote_mac == mac )
+        {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Layer 1: a link is established. This completes the slot, after
+ * layer 2 and routing have written their part of it.
+ */
+void checkpoint_link_up( int device, const char* hostname, int port,
+                         unsigned int addr, unsigned int peer_epoch )
+{
+    ckpt_link_t* l;
+
+    if( this_node->checkpoint == NULL || device < 0 || device >= CKPT_LINKS )
+    {
+        return;
+    }
+    l = &this_node->checkpoint->file->link[device];
+    l->device = device;
+    strncpy( l->hostname, hostname, CKPT_HOSTNAME-1 );
+    l->hostname[CKPT_HOSTNAME-1] = 0;
+    l->port             = port;
+    l->addr             = addr;
+    l->peer_epoch = peer_epoch;
+    __atomic_store_n( &l->state, CKPT_UP, __ATOMIC_RELEASE );
+}
+
+/*
+ * Layer 2: the MAC addresses at both ends of a device.
+ */
+void checkpoint_link_mac( int device, int local_mac, int remote_mac )
+{
+    ckpt_link_t* l;
+
+    if( this_node->checkpoint == NULL || device < 0 || device >= CKPT_LINKS )
+    {
+        return;
+    }
+    l = &this_node->checkpoint->file->link[device];
+    l->local_mac  = local_mac;
+    l->remote_mac = remote_mac;
+}
+
+void checkpoint_link_down( int device )
+{
+    ckpt_link_t* l;
+
+    if( this_node->checkpoint == NULL || device < 0 || device >= CKPT_LINKS )
+    {
+        return;
+    }
+    l = &this_node->checkpoint->file->link[device];
+    __atomic_store_n( &l->state, 0, __ATOMIC_RELEASE );
+    l->remote_mac = -1;
+}
+
+/*
+ * Routing: the distances that the neighbour mac has advertised.
+ * Layer 2 has written the MAC address into the slot before.
+ * Only the pages that change are written.
+ */
+void checkpoint_route( int mac, const unsigned char* dist )
+{
+    struct CheckpointFile* f;
+    int                    i;
+
+    if( this_node->checkpoint == NULL )
+    {
+        return;
+    }
+    f = this_node->checkpoint->file;
+    for( i=0; i<CKPT_LINKS; i++ )
+    {
+        if( f->link[i].remote_mac == mac )
+        {
+            if( memcmp( f->link[i].dist, dist, CKPT_ADDRESSES ) != 0 )
+            {
+                memcpy( f->link[i].dist, dist, CKPT_ADDRESSES );
+            }
+            return;
+        }
+    }
+}
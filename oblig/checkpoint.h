@@ -0,0 +1,49 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/* see comments in the c file */
+
+#define CKPT_VERSION   1
+#define CKPT_LINKS     1024     /* the devices of layer 1 */
+#define CKPT_ADDRESSES 1024     /* the addresses of layers 2 and 3 */
+#define CKPT_HOSTNAME  64
+
+/*
+ * One established link. The slot of a device is valid when its state
+ * is CKPT_UP.
+ */
+struct CheckpointLink
+{
+    unsigned int  state;
+    int           device;
+
+    /* layer 1 */
+    char          hostname[CKPT_HOSTNAME];
+    int           port;
+    unsigned int  addr;                  /* IPv4, network byte order */
+    unsigned int  peer_epoch;
+
+    /* layer 2 */
+    int           local_mac;
+    int           remote_mac;
+
+    /* routing: the last advert of the neighbour */
+    unsigned char dist[CKPT_ADDRESSES];
+};
+typedef struct CheckpointLink ckpt_link_t;
+
+#define CKPT_UP 0x55500001
+
+void         checkpoint_set_file( const char* path );
+void         checkpoint_open( int port, int mac );
+int          checkpoint_restored( );
+ckpt_link_t* checkpoint_link( int device );
+ckpt_link_t* checkpoint_neighbour( int mac );
+
+void         checkpoint_link_up( int device, const char* hostname, int port,
+                                 unsigned int addr, unsigned int peer_epoch );
+void         checkpoint_link_mac( int device, int local_mac, int remote_mac );
+void         checkpoint_link_down( int device );
+void         checkpoint_route( int mac, const unsigned char* dist );
+
+#endif /* CHECKPOINT_H */
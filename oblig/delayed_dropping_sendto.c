@@ -6,6 +6,7 @@
 
 #include "delayed_dropping_sendto.h"
 #include "irq.h"
+#include "fabric.h"
 
 /* Delay all messages for this time. */
 static struct timeval msg_delay = { 3, 0 };  /* 10 seconds delay */
@@ -50,7 +51,6 @@ static qe_t* tail = NULL;
 ssize_t delayed_dropping_sendto(int s, const void *msg, size_t len, int flags,
                                 const struct sockaddr *to, socklen_t tolen)
 {
-    int            error;
     struct timeval tnow;
     struct queue_entry* ptr;
 
@@ -63,8 +63,7 @@ ssize_t delayed_dropping_sendto(int s, const void *msg, size_t len, int flags,
     ptr = (struct queue_entry*)malloc(sizeof (struct queue_entry));
     assert(ptr);
 
-    error = gettimeofday( &tnow, NULL );
-    assert( error >= 0 );
+    irq_get_time( &tnow );
     timeradd( &tnow, &msg_delay, &ptr->sendtime );
 
     ptr->my_sock = s;
@@ -102,18 +101,13 @@ void send_dropping_delayed( )
     struct timeval tnow;
     qe_t*          ptr;
     int            error;
-    error = gettimeofday( &tnow, NULL );
-    if( error < 0 )
-    {
-        perror( "error getting time" );
-        return;
-    }
+    irq_get_time( &tnow );
     while( head && timercmp( &head->sendtime, &tnow, <= ) )
     {
-        error = sendto( head->my_sock,
-                        head->data, head->data_len,
-                        0,
-                        head->to, head->to_len );
+        error = fabric_sendto( head->my_sock,
+                               head->data, head->data_len,
+                               0,
+                               head->to, head->to_len );
         if( error < 0 )
         {
             perror( "Error sending delayed data" );
@@ -132,3 +126,11 @@ void send_dropping_delayed( )
     }
 }
 
+/*
+ * The time that every frame spends on the cable, so that the layer
+ * above knows how long the other side takes to answer.
+ */
+void delayed_dropping_sendto_delay( struct timeval* delay )
+{
+    *delay = msg_delay;
+}
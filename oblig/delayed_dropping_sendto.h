@@ -3,6 +3,7 @@
 
 #include <netdb.h>
 #include <sys/types.h>
+#include <sys/time.h>
 
 /* for comments see .c file */
 
@@ -10,4 +11,6 @@ extern ssize_t delayed_dropping_sendto(int s, const void *msg, size_t len,
                                        int flags,
                                        const struct sockaddr *to, socklen_t tolen);
 
+extern void delayed_dropping_sendto_delay( struct timeval* delay );
+
 #endif /* DELAYED_SENDTO_H */
@@ -0,0 +1,268 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fabric.h"
+#include "logger.h"
+
+#define MAX_PORTS 65536
+
+/*
+ * A frame in flight on the fabric. The data follows the struct.
+ */
+struct FabricFrame
+{
+    unsigned short      src_port;
+    size_t              len;
+    struct FabricFrame* next;
+    char                data[];
+};
+typedef struct FabricFrame frame_t;
+
+/*
+ * One in-memory socket. Frames that are sent to its port wait in
+ * the queue until they are received.
+ */
+struct FabricSocket
+{
+    unsigned short port;
+    frame_t*       head;
+    frame_t*       tail;
+    int            on_ready_list;
+    int            next_ready;
+};
+typedef struct FabricSocket fsock_t;
+
+static int      enabled = 0;
+
+static fsock_t* sockets     = NULL;
+static int      num_sockets = 0;
+static int      max_sockets = 0;
+
+/* maps a port to its socket + 1, so that 0 means unbound */
+static int*     port_to_socket = NULL;
+
+/*
+ * The sockets that have frames waiting, in the order in which they
+ * became non-empty. The simulator visits only these sockets instead
+ * of polling all of them.
+ */
+static int      ready_head = -1;
+static int      ready_tail = -1;
+
+/*
+ * Switch to the in-memory fabric. This must be done before the first
+ * socket is created.
+ */
+void fabric_enable( )
+{
+    assert( num_sockets == 0 );
+
+    enabled = 1;
+    port_to_socket = (int*)calloc( MAX_PORTS, sizeof(int) );
+    if( port_to_socket == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in fabric_enable\n" );
+        exit( -1 );
+    }
+}
+
+int fabric_enabled( )
+{
+    return enabled;
+}
+
+int fabric_socket( int domain, int type, int protocol )
+{
+    if( !enabled )
+    {
+        return socket( domain, type, protocol );
+    }
+
+    if( num_sockets == max_sockets )
+    {
+        max_sockets = max_sockets ? 2*max_sockets : 64;
+        sockets = (fsock_t*)realloc( sockets, max_sockets*sizeof(fsock_t) );
+        if( sockets == 0 )
+        {
+            logmsg( LL_ERROR, "Not enough memory in fabric_socket\n" );
+            exit( -1 );
+        }
+    }
+
+    memset( &sockets[num_sockets], 0, sizeof(fsock_t) );
+    return num_sockets++;
+}
+
+int fabric_bind( int s, const struct sockaddr* addr, socklen_t addrlen )
+{
+    unsigned short port;
+
+    if( !enabled )
+    {
+        return bind( s, addr, addrlen );
+    }
+
+    port = ntohs( ((const struct sockaddr_in*)addr)->sin_port );
+    if( port_to_socket[port] != 0 )
+    {
+        return -1;
+    }
+    sockets[s].port = port;
+    port_to_socket[port] = s + 1;
+    return 0;
+}
+
+/*
+ * Hand a frame to the socket that is bound to the destination port.
+ * Frames to unbound ports are lost, as they would be with UDP.
+ */
+ssize_t fabric_sendto( int s, const void* msg, size_t len, int flags,
+                       const struct sockaddr* to, socklen_t tolen )
+{
+    fsock_t* dst;
+    frame_t* f;
+    int      d;
+
+    if( !enabled )
+    {
+        return sendto( s, msg, len, flags, to, tolen );
+    }
+
+    d = port_to_socket[ ntohs( ((const struct sockaddr_in*)to)->sin_port ) ] - 1;
+    if( d < 0 )
+    {
+        return len;
+    }
+
+    f = (frame_t*)malloc( sizeof(frame_t) + len );
+    if( f == 0 )
+    {
+        logmsg_limited( LL_ERROR, "Not enough memory in fabric_sendto\n" );
+        return -1;
+    }
+    f->src_port = sockets[s].port;
+    f->len      = len;
+    f->next     = NULL;
+    memcpy( f->data, msg, len );
+
+    dst = &sockets[d];
+    if( dst->tail )
+    {
+        dst->tail->next = f;
+        dst->tail = f;
+    }
+    else
+    {
+        dst->head = dst->tail = f;
+    }
+
+    if( !dst->on_ready_list )
+    {
+        dst->on_ready_list = 1;
+        dst->next_ready    = -1;
+        if( ready_tail >= 0 ) sockets[ready_tail].next_ready = d;
+        else                  ready_head = d;
+        ready_tail = d;
+    }
+    return len;
+}
+
+/*
+ * Take the oldest frame from the socket. Like a non-blocking UDP
+ * socket, a frame that is larger than the buffer is truncated, and
+ * -1 is returned if nothing is waiting.
+ */
+ssize_t fabric_recvfrom( int s, void* buf, size_t len, int flags,
+                         struct sockaddr* from, socklen_t* fromlen )
+{
+    fsock_t*           sock;
+    frame_t*           f;
+    struct sockaddr_in addr;
+
+    if( !enabled )
+    {
+        return recvfrom( s, buf, len, flags, from, fromlen );
+    }
+
+    sock = &sockets[s];
+    f = sock->head;
+    if( f == 0 )
+    {
+        return -1;
+    }
+    sock->head = f->next;
+    if( sock->head == NULL ) sock->tail = NULL;
+
+    if( len > f->len ) len = f->len;
+    memcpy( buf, f->data, len );
+
+    if( from )
+    {
+        memset( &addr, 0, sizeof(addr) );
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        addr.sin_port        = htons( f->src_port );
+        if( *fromlen > sizeof(addr) ) *fromlen = sizeof(addr);
+        memcpy( from, &addr, *fromlen );
+    }
+
+    free( f );
+    return len;
+}
+
+/*
+ * Like fabric_recvfrom, into the first buffer of msg. The fabric
+ * has no control messages and no error queue.
+ */
+ssize_t fabric_recvmsg( int s, struct msghdr* msg, int flags )
+{
+    socklen_t namelen = msg->msg_namelen;
+    ssize_t   len;
+
+    if( !enabled )
+    {
+        return recvmsg( s, msg, flags );
+    }
+
+    msg->msg_controllen = 0;
+    msg->msg_flags      = 0;
+    if( flags & MSG_ERRQUEUE )
+    {
+        return -1;
+    }
+    len = fabric_recvfrom( s, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags,
+                           (struct sockaddr*)msg->msg_name, &namelen );
+    msg->msg_namelen = namelen;
+    return len;
+}
+
+/*
+ * Returns 1 if a frame is waiting on the socket.
+ */
+int fabric_pending( int s )
+{
+    return sockets[s].head != NULL;
+}
+
+/*
+ * Returns the next socket that has received frames since it was
+ * last returned, or -1 if there is none. The caller should receive
+ * all waiting frames, otherwise the socket will not be returned again
+ * until another frame arrives.
+ */
+int fabric_next_ready( )
+{
+    int s = ready_head;
+    if( s < 0 )
+    {
+        return -1;
+    }
+    ready_head = sockets[s].next_ready;
+    if( ready_head < 0 ) ready_tail = -1;
+    sockets[s].on_ready_list = 0;
+    return s;
+}
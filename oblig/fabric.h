@@ -0,0 +1,31 @@
+#ifndef FABRIC_H
+#define FABRIC_H
+
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Replacements for socket(), bind(), sendto(), recvfrom() and recvmsg().
+ * Normally they simply call the system functions. After
+ * fabric_enable(), sockets are handles into an in-memory link fabric
+ * instead: sendto() appends the frame to the queue of the socket that
+ * is bound to the destination port, and recvfrom() takes it out again.
+ * The IP address in a destination is ignored, only the port counts.
+ */
+
+void    fabric_enable( );
+int     fabric_enabled( );
+
+int     fabric_socket( int domain, int type, int protocol );
+int     fabric_bind( int s, const struct sockaddr* addr, socklen_t addrlen );
+ssize_t fabric_sendto( int s, const void* msg, size_t len, int flags,
+                       const struct sockaddr* to, socklen_t tolen );
+ssize_t fabric_recvfrom( int s, void* buf, size_t len, int flags,
+                         struct sockaddr* from, socklen_t* fromlen );
+ssize_t fabric_recvmsg( int s, struct msghdr* msg, int flags );
+
+int     fabric_pending( int s );
+int     fabric_next_ready( );
+
+#endif /* FABRIC_H */
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86 1
+#endif
+
+#include "fec.h"
+
+/*
+ * Erasure codes for forward error correction. A block has n data
+ * symbols and up to FEC_MAX_PARITY parity symbols of the same length.
+ * Parity j is the sum over i of coef(j,i) * data_i in GF(2^8).
+ * The coefficients are a Cauchy matrix, 1/(x_j + y_i), so every
+ * square submatrix can be inverted and any n of the n+k symbols
+ * recover the block (Reed-Solomon). Its columns are scaled so that
+ * the first parity row is all ones: a block with one parity symbol
+ * is a plain XOR of the data.
+ *
+ * Multiplying a buffer by a constant c is done with two 16 entry
+ * tables, c times the low nibble and c times the high nibble of
+ * each byte. That is one pshufb per nibble with SSSE3 and AVX2,
+ * which fec_init picks when the CPU has them.
+ */
+#define GF_POLY 0x11d
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char coef[FEC_MAX_PARITY][FEC_MAX_DATA];
+
+typedef int (*mul_add_func)( unsigned char* dst, const unsigned char* src,
+                             const unsigned char* lo, const unsigned char* hi, int length );
+
+static int          initialized = 0;
+static mul_add_func kernel      = NULL;
+static const char*  kernel_name = "scalar";
+
+unsigned char gf_mul( unsigned char a, unsigned char b )
+{
+    if( a == 0 || b == 0 )
+    {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+unsigned char gf_inv( unsigned char a )
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+#ifdef FEC_X86
+__attribute__((target("ssse3")))
+static int mul_add_ssse3( unsigned char* dst, const unsigned char* src,
+                          const unsigned char* lo, const unsigned char* hi, int length )
+{
+    __m128i tlo  = _mm_loadu_si128( (const __m128i*)lo );
+    __m128i thi  = _mm_loadu_si128( (const __m128i*)hi );
+    __m128i mask = _mm_set1_epi8( 0x0f );
+    __m128i s, l, h, d;
+    int     i;
+
+    for( i=0; i+16<=length; i+=16 )
+    {
+        s = _mm_loadu_si128( (const __m128i*)(src+i) );
+        l = _mm_shuffle_epi8( tlo, _mm_and_si128( s, mask ) );
+        h = _mm_shuffle_epi8( thi, _mm_and_si128( _mm_srli_epi64( s, 4 ), mask ) );
+        d = _mm_loadu_si128( (const __m128i*)(dst+i) );
+        _mm_storeu_si128( (__m128i*)(dst+i), _mm_xor_si128( d, _mm_xor_si128( l, h ) ) );
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int mul_add_avx2( unsigned char* dst, const unsigned char* src,
+                         const unsigned char* lo, const unsigned char* hi, int length )
+{
+    __m256i tlo  = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i*)lo ) );
+    __m256i thi  = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i*)hi ) );
+    __m256i mask = _mm256_set1_epi8( 0x0f );
+    __m256i s, l, h, d;
+    int     i;
+
+    for( i=0; i+32<=length; i+=32 )
+    {
+        s = _mm256_loadu_si256( (const __m256i*)(src+i) );
+        l = _mm256_shuffle_epi8( tlo, _mm256_and_si256( s, mask ) );
+        h = _mm256_shuffle_epi8( thi, _mm256_and_si256( _mm256_srli_epi64( s, 4 ), mask ) );
+        d = _mm256_loadu_si256( (const __m256i*)(dst+i) );
+        _mm256_storeu_si256( (__m256i*)(dst+i), _mm256_xor_si256( d, _mm256_xor_si256( l, h ) ) );
+    }
+    return i;
+}
+#endif
+
+/*
+ * dst += c * src, for length bytes.
+ */
+void gf_mul_add( unsigned char* dst, const unsigned char* src, unsigned char c, int length )
+{
+    unsigned char lo[16];
+    unsigned char hi[16];
+    unsigned long a, b;
+    int           i = 0;
+
+    if( c == 0 )
+    {
+        return;
+    }
+
+    if( c == 1 )
+    {
+        for( ; i+(int)sizeof(a)<=length; i+=sizeof(a) )
+        {
+            memcpy( &a, dst+i, sizeof(a) );
+            memcpy( &b, src+i, sizeof(b) );
+            a ^= b;
+            memcpy( dst+i, &a, sizeof(a) );
+        }
+        for( ; i<length; i++ )
+        {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+
+    for( i=0; i<16; i++ )
+    {
+        lo[i] = gf_mul( c, i );
+        hi[i] = gf_mul( c, i << 4 );
+    }
+    i = kernel ? kernel( dst, src, lo, hi, length ) : 0;
+    for( ; i<length; i++ )
+    {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+/*
+ * Build the tables and pick the fastest kernel. Can be called more
+ * than once.
+ */
+void fec_init( )
+{
+    int x = 1;
+    int i, j;
+
+    if( initialized )
+    {
+        return;
+    }
+    initialized = 1;
+
+    for( i=0; i<255; i++ )
+    {
+        gf_exp[i]       = x;
+        gf_exp[i + 255] = x;
+        gf_log[x]       = i;
+        x <<= 1;
+        if( x & 0x100 ) x ^= GF_POLY;
+    }
+
+    for( j=0; j<FEC_MAX_PARITY; j++ )
+    {
+        for( i=0; i<FEC_MAX_DATA; i++ )
+        {
+            coef[j][i] = gf_inv( (FEC_MAX_DATA + j) ^ i );
+        }
+    }
+    for( i=0; i<FEC_MAX_DATA; i++ )
+    {
+        unsigned char scale = gf_inv( coef[0][i] );
+        for( j=0; j<FEC_MAX_PARITY; j++ )
+        {
+            coef[j][i] = gf_mul( coef[j][i], scale );
+        }
+    }
+
+#ifdef FEC_X86
+    __builtin_cpu_init( );
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        kernel      = &mul_add_avx2;
+        kernel_name = "avx2";
+    }
+    else if( __builtin_cpu_supports( "ssse3" ) )
+    {
+        kernel      = &mul_add_ssse3;
+        kernel_name = "ssse3";
+    }
+#endif
+}
+
+const char* fec_kernel( )
+{
+    return kernel_name;
+}
+
+unsigned char fec_coef( int parity, int data )
+{
+    return coef[parity][data];
+}
+
+/*
+ * Recover the data symbols of a block that are not in present (bit
+ * i for data[i]) from np parity symbols, parity[r] with the index
+ * index[r]. All data buffers must have length bytes, the missing
+ * ones are overwritten. Returns 0 on success, -1 if there are not
+ * enough parity symbols.
+ */
+int fec_decode( unsigned char** data, unsigned present, int n,
+                unsigned char** parity, const int* index, int np, int length )
+{
+    unsigned char  a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    unsigned char  inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    unsigned char* rhs[FEC_MAX_PARITY];
+    unsigned char  t;
+    int            missing[FEC_MAX_PARITY];
+    int            m = 0;
+    int            i, r, c, p;
+
+    for( i=0; i<n; i++ )
+    {
+        if( !(present & (1u << i)) )
+        {
+            if( m == np || m == FEC_MAX_PARITY )
+            {
+                return -1;
+            }
+            missing[m++] = i;
+        }
+    }
+    if( m == 0 )
+    {
+        return 0;
+    }
+
+    /* the parities without the contribution of the data we have */
+    for( r=0; r<m; r++ )
+    {
+        rhs[r] = (unsigned char*)malloc( length );
+        if( rhs[r] == NULL )
+        {
+            while( r-- > 0 ) free( rhs[r] );
+            return -1;
+        }
+        memcpy( rhs[r], parity[r], length );
+        for( i=0; i<n; i++ )
+        {
+            if( present & (1u << i) )
+            {
+                gf_mul_add( rhs[r], data[i], coef[index[r]][i], length );
+            }
+        }
+        for( c=0; c<m; c++ )
+        {
+            a[r][c]   = coef[index[r]][missing[c]];
+            inv[r][c] = r == c;
+        }
+    }
+
+    /* invert a by Gauss-Jordan elimination */
+    for( c=0; c<m; c++ )
+    {
+        for( p=c; p<m && a[p][c] == 0; p++ )
+            ;
+        if( p == m )
+        {
+            break;   /* can't happen with a Cauchy matrix */
+        }
+        for( i=0; i<m; i++ )
+        {
+            t = a[c][i];   a[c][i]   = a[p][i];   a[p][i]   = t;
+            t = inv[c][i]; inv[c][i] = inv[p][i]; inv[p][i] = t;
+        }
+        t = gf_inv( a[c][c] );
+        for( i=0; i<m; i++ )
+        {
+            a[c][i]   = gf_mul( a[c][i], t );
+            inv[c][i] = gf_mul( inv[c][i], t );
+        }
+        for( r=0; r<m; r++ )
+        {
+            if( r != c && a[r][c] != 0 )
+            {
+                t = a[r][c];
+                for( i=0; i<m; i++ )
+                {
+                    a[r][i]   ^= gf_mul( a[c][i], t );
+                    inv[r][i] ^= gf_mul( inv[c][i], t );
+                }
+            }
+        }
+    }
+
+    for( c=0; c<m; c++ )
+    {
+        memset( data[missing[c]], 0, length );
+        for( r=0; r<m; r++ )
+        {
+            gf_mul_add( data[missing[c]], rhs[r], inv[c][r], length );
+        }
+    }
+
+    for( r=0; r<m; r++ )
+    {
+        free( rhs[r] );
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef FEC_H
+#define FEC_H
+
+/* see comments in the c file */
+
+#define FEC_MAX_DATA   16
+#define FEC_MAX_PARITY 4
+
+void          fec_init( );
+const char*   fec_kernel( );
+
+unsigned char gf_mul( unsigned char a, unsigned char b );
+unsigned char gf_inv( unsigned char a );
+void          gf_mul_add( unsigned char* dst, const unsigned char* src, unsigned char c, int length );
+
+unsigned char fec_coef( int parity, int data );
+int           fec_decode( unsigned char** data, unsigned present, int n,
+                          unsigned char** parity, const int* index, int np, int length );
+
+#endif /* FEC_H */
@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "hdr.h"
+
+/*
+ * A histogram with high dynamic range (HdrHistogram): values up to
+ * 2^40 are counted with a relative error below 1/64, in a fixed
+ * number of counters.
+ *
+ * Values below HDR_SUB have a counter each. Above that, every power
+ * of two is split into HDR_SUB/2 counters of equal width: the value
+ * is shifted right until it is below HDR_SUB, and the bits that are
+ * left select the counter. Recording a value is a few shifts and an
+ * increment, and a percentile is one pass over the counters.
+ */
+#define HDR_MAX ((1ULL << (HDR_SUB_BITS + HDR_SHIFTS)) - 1)
+
+static int msb( unsigned long long v )
+{
+    return 63 - __builtin_clzll( v );
+}
+
+static int index_of( unsigned long long v )
+{
+    int shift;
+
+    if( v < HDR_SUB )
+    {
+        return (int)v;
+    }
+    shift = msb( v ) - HDR_SUB_BITS + 1;
+    return HDR_SUB + (shift - 1) * (HDR_SUB/2) + (int)(v >> shift) - HDR_SUB/2;
+}
+
+/*
+ * The largest value that is counted in counter i.
+ */
+static unsigned long long highest_of( int i )
+{
+    int shift;
+
+    if( i < HDR_SUB )
+    {
+        return i;
+    }
+    i    -= HDR_SUB;
+    shift = i / (HDR_SUB/2) + 1;
+    return ((unsigned long long)(i % (HDR_SUB/2) + HDR_SUB/2 + 1) << shift) - 1;
+}
+
+void hdr_reset( hdr_t* h )
+{
+    memset( h, 0, sizeof(hdr_t) );
+}
+
+void hdr_record( hdr_t* h, unsigned long long value )
+{
+    if( value > HDR_MAX )
+    {
+        value = HDR_MAX;
+    }
+    if( h->total == 0 || value < h->min ) h->min = value;
+    if( h->total == 0 || value > h->max ) h->max = value;
+    h->counts[index_of( value )]++;
+    h->total++;
+    h->sum += value;
+}
+
+/*
+ * The value below which percent of the recorded values are, 0 if
+ * nothing has been recorded. Like HdrHistogram, it is the highest
+ * value that falls into the same counter, but never above the
+ * largest recorded value.
+ */
+unsigned long long hdr_percentile( const hdr_t* h, double percent )
+{
+    unsigned long      want;
+    unsigned long      seen = 0;
+    unsigned long long v;
+    int                i;
+
+    if( h->total == 0 )
+    {
+        return 0;
+    }
+    want = (unsigned long)(percent / 100.0 * h->total + 0.5);
+    if( want < 1 )        want = 1;
+    if( want > h->total ) want = h->total;
+
+    for( i=0; i<HDR_COUNTS; i++ )
+    {
+        seen += h->counts[i];
+        if( seen >= want )
+        {
+            v = highest_of( i );
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hdr_mean( const hdr_t* h )
+{
+    return h->total ? (double)h->sum / h->total : 0.0;
+}
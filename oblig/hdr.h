@@ -0,0 +1,26 @@
+#ifndef HDR_H
+#define HDR_H
+
+/* see comments in the c file */
+
+#define HDR_SUB_BITS 7
+#define HDR_SUB      (1 << HDR_SUB_BITS)
+#define HDR_SHIFTS   34
+#define HDR_COUNTS   (HDR_SUB + HDR_SHIFTS * HDR_SUB / 2)
+
+struct Hdr
+{
+    unsigned long      counts[HDR_COUNTS];
+    unsigned long      total;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+};
+typedef struct Hdr hdr_t;
+
+void               hdr_reset( hdr_t* h );
+void               hdr_record( hdr_t* h, unsigned long long value );
+unsigned long long hdr_percentile( const hdr_t* h, double percent );
+double             hdr_mean( const hdr_t* h );
+
+#endif /* HDR_H */
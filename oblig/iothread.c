@@ -0,0 +1,405 @@
+#define _GNU_SOURCE   /* recvmmsg, sendmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "fabric.h"
+#include "iothread.h"
+#include "logger.h"
+
+/*
+ * The I/O thread. Without it, the select loop makes the system calls
+ * of the socket between the work of the layers. With it, a second
+ * thread receives frames with recvmmsg and sends them with sendmmsg,
+ * up to IO_BATCH per call, while the select loop only runs the
+ * layers and the timers. Both can keep a CPU busy.
+ *
+ * Frames go through two rings with one producer and one consumer
+ * each: rx from the I/O thread to the select loop, tx the other way.
+ * The indexes only grow, the consumer writes head and the producer
+ * tail, and they are on cache lines of their own. A frame is written
+ * into its slot before tail moves past it, and its slot is not reused
+ * before head has moved past it, so the rings need no lock.
+ *
+ * Each ring has an eventfd that the consumer sleeps on, in select()
+ * or poll(). The producer writes it only when the ring was empty,
+ * after it has published the frames. The consumer clears it before
+ * it checks the last time that the ring is empty, and sets it again
+ * if the ring is not, because it may stop taking frames before the
+ * ring is empty and sleep on the eventfd. With a full fence
+ * between the write of one index and the read of the other on both
+ * sides, either the consumer sees the new frames or the producer
+ * sees that it must wake the consumer.
+ *
+ * The select loop handles a received frame in its slot, which is
+ * given back at the next iothread_recv(). A full tx ring makes the
+ * sender wait, as a full socket buffer would. A full rx ring leaves
+ * the frames in the socket, and the I/O thread looks again after
+ * IO_FULL_WAIT ms.
+ */
+#define IO_SLOTS     256      /* frames in a ring, a power of 2 */
+#define IO_FRAME     65536    /* bytes in a slot, more than the largest datagram */
+#define IO_BATCH     32       /* frames per recvmmsg and sendmmsg */
+#define IO_FULL_WAIT 1        /* ms */
+#define IO_CACHELINE 64
+
+struct IoSlot
+{
+    int                len;
+    struct sockaddr_in addr;
+    char               data[IO_FRAME];
+};
+typedef struct IoSlot ioslot_t;
+
+struct IoRing
+{
+    unsigned int head __attribute__((aligned(IO_CACHELINE)));   /* next slot to take */
+    unsigned int tail __attribute__((aligned(IO_CACHELINE)));   /* next slot to fill */
+    int          efd  __attribute__((aligned(IO_CACHELINE)));   /* wakes the consumer */
+    ioslot_t*    slots;
+};
+typedef struct IoRing ioring_t;
+
+static ioring_t rx;
+static ioring_t tx;
+static int      sock    = -1;
+static int      running = 0;
+static int      holding = 0;   /* the select loop has a frame of rx */
+
+/* written by the I/O thread, read by iothread_print_stats */
+static unsigned long rx_frames  = 0;
+static unsigned long rx_batches = 0;
+static unsigned long tx_frames  = 0;
+static unsigned long tx_batches = 0;
+
+/* the select loop's */
+static unsigned long tx_waits   = 0;
+
+/*
+ * Free slots, for the producer.
+ */
+static unsigned int ring_free( ioring_t* r )
+{
+    return IO_SLOTS - (r->tail - __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ));
+}
+
+/*
+ * Filled slots, for the consumer.
+ */
+static unsigned int ring_used( ioring_t* r )
+{
+    return __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE ) - r->head;
+}
+
+/*
+ * Hand n filled slots to the consumer, and wake it if the ring was
+ * empty.
+ */
+static void ring_publish( ioring_t* r, unsigned int n )
+{
+    unsigned int       old = r->tail;
+    unsigned long long one = 1;
+
+    __atomic_store_n( &r->tail, old + n, __ATOMIC_RELEASE );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) == old )
+    {
+        if( write( r->efd, &one, sizeof(one) ) < 0 )
+        {
+            /* the counter is full, so the consumer will wake up anyway */
+        }
+    }
+}
+
+/*
+ * Give n slots back to the producer.
+ */
+static void ring_release( ioring_t* r, unsigned int n )
+{
+    __atomic_store_n( &r->head, r->head + n, __ATOMIC_RELEASE );
+}
+
+/*
+ * Returns 1 if the consumer may sleep: the ring is empty, and a frame
+ * that is published afterwards will wake it. If frames have come
+ * while the eventfd was cleared, it is set again for them.
+ */
+static int ring_empty( ioring_t* r )
+{
+    unsigned long long n;
+    unsigned long long one = 1;
+
+    if( ring_used( r ) > 0 )
+    {
+        return 0;
+    }
+    if( read( r->efd, &n, sizeof(n) ) < 0 )
+    {
+        /* it was clear */
+    }
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( ring_used( r ) == 0 )
+    {
+        return 1;
+    }
+    if( write( r->efd, &one, sizeof(one) ) < 0 )
+    {
+        /* the counter is full, so it is set */
+    }
+    return 0;
+}
+
+static void count( unsigned long* counter, unsigned long n )
+{
+    __atomic_store_n( counter, *counter + n, __ATOMIC_RELAXED );
+}
+
+/*
+ * Receive into the free slots of rx. Returns the number of frames.
+ */
+static int receive_batch( )
+{
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec   iov[IO_BATCH];
+    ioslot_t*      slot;
+    unsigned int   n = ring_free( &rx );
+    int            got;
+    int            i;
+
+    if( n > IO_BATCH ) n = IO_BATCH;
+    for( i=0; i<n; i++ )
+    {
+        slot = &rx.slots[(rx.tail + i) % IO_SLOTS];
+        iov[i].iov_base = slot->data;
+        iov[i].iov_len  = IO_FRAME;
+        memset( &msgs[i].msg_hdr, 0, sizeof(struct msghdr) );
+        msgs[i].msg_hdr.msg_name    = &slot->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(slot->addr);
+        msgs[i].msg_hdr.msg_iov     = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+    if( n == 0 )
+    {
+        return 0;
+    }
+
+    got = recvmmsg( sock, msgs, n, MSG_DONTWAIT, NULL );
+    if( got <= 0 )
+    {
+        if( got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+        {
+            logmsg_limited( LL_ERROR, "Error receiving frames: %s\n", strerror( errno ) );
+        }
+        return 0;
+    }
+    for( i=0; i<got; i++ )
+    {
+        rx.slots[(rx.tail + i) % IO_SLOTS].len = msgs[i].msg_len;
+    }
+    ring_publish( &rx, got );
+    count( &rx_frames, got );
+    count( &rx_batches, 1 );
+    return got;
+}
+
+/*
+ * Send the frames of tx, up to IO_BATCH. Returns the number of
+ * frames.
+ */
+static int send_batch( )
+{
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec   iov[IO_BATCH];
+    ioslot_t*      slot;
+    unsigned int   n;
+    int            sent;
+    int            i;
+
+    if( ring_empty( &tx ) )
+    {
+        return 0;
+    }
+    n = ring_used( &tx );
+    if( n > IO_BATCH ) n = IO_BATCH;
+    for( i=0; i<n; i++ )
+    {
+        slot = &tx.slots[(tx.head + i) % IO_SLOTS];
+        iov[i].iov_base = slot->data;
+        iov[i].iov_len  = slot->len;
+        memset( &msgs[i].msg_hdr, 0, sizeof(struct msghdr) );
+        msgs[i].msg_hdr.msg_name    = &slot->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(slot->addr);
+        msgs[i].msg_hdr.msg_iov     = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    sent = sendmmsg( sock, msgs, n, 0 );
+    if( sent <= 0 )
+    {
+        /* the first frame could not be sent, drop it like the wire would */
+        logmsg_limited( LL_ERROR, "Error sending frame: %s\n", strerror( errno ) );
+        sent = 1;
+    }
+    ring_release( &tx, sent );
+    count( &tx_frames, sent );
+    count( &tx_batches, 1 );
+    return sent;
+}
+
+static void* io_thread( void* arg )
+{
+    struct pollfd fds[2];
+
+    for( ;; )
+    {
+        if( receive_batch( ) + send_batch( ) > 0 )
+        {
+            continue;
+        }
+
+        /* Nothing to do. Sleep until the socket has frames, which
+         * we can only take when rx has room, or until tx has some.
+         */
+        fds[0].fd     = sock;
+        fds[0].events = ring_free( &rx ) > 0 ? POLLIN : 0;
+        fds[1].fd     = tx.efd;
+        fds[1].events = POLLIN;
+        if( poll( fds, 2, fds[0].events ? -1 : IO_FULL_WAIT ) < 0 && errno != EINTR )
+        {
+            logmsg_limited( LL_ERROR, "Error in poll: %s\n", strerror( errno ) );
+        }
+    }
+    return NULL;
+}
+
+static int ring_init( ioring_t* r )
+{
+    r->head  = 0;
+    r->tail  = 0;
+    r->slots = (ioslot_t*)calloc( IO_SLOTS, sizeof(ioslot_t) );
+    r->efd   = eventfd( 0, EFD_NONBLOCK );
+    return r->slots != NULL && r->efd >= 0 ? 0 : -1;
+}
+
+/*
+ * Start the I/O thread on the socket s, from l1_init. Afterwards,
+ * frames are taken with iothread_recv() and sent with
+ * iothread_sendto(), and the select loop watches iothread_fd()
+ * instead of the socket. Returns -1 if there is no I/O thread.
+ */
+int iothread_start( int s )
+{
+    pthread_t tid;
+
+    if( fabric_enabled( ) )
+    {
+        logmsg( LL_WARN, "There is no I/O thread on the simulated fabric\n" );
+        return -1;
+    }
+    if( ring_init( &rx ) < 0 || ring_init( &tx ) < 0 )
+    {
+        logmsg( LL_ERROR, "Could not set up the I/O thread: %s\n", strerror( errno ) );
+        exit( -1 );
+    }
+
+    sock = s;
+    if( pthread_create( &tid, NULL, &io_thread, NULL ) != 0 )
+    {
+        logmsg( LL_ERROR, "Failed to start the I/O thread\n" );
+        exit( -1 );
+    }
+    pthread_detach( tid );
+    running = 1;
+    return 0;
+}
+
+int iothread_running( )
+{
+    return running;
+}
+
+/*
+ * The descriptor that is readable when frames have been received,
+ * or -1 without the I/O thread.
+ */
+int iothread_fd( )
+{
+    return running ? rx.efd : -1;
+}
+
+/*
+ * Take the next received frame. *frame points into its slot, which
+ * stays valid until the next call. Returns the length, or -1 if
+ * there is no frame.
+ */
+int iothread_recv( char** frame, struct sockaddr_in* from )
+{
+    ioslot_t* slot;
+
+    if( holding )
+    {
+        ring_release( &rx, 1 );
+        holding = 0;
+    }
+    if( ring_empty( &rx ) )
+    {
+        return -1;
+    }
+
+    slot    = &rx.slots[rx.head % IO_SLOTS];
+    holding = 1;
+    *frame  = slot->data;
+    *from   = slot->addr;
+    return slot->len;
+}
+
+/*
+ * Like sendto(), for l1_set_wire(): the frame is copied into tx and
+ * sent by the I/O thread.
+ */
+ssize_t iothread_sendto( int s, const void* msg, size_t len, int flags,
+                         const struct sockaddr* to, socklen_t tolen )
+{
+    ioslot_t* slot;
+
+    if( len > IO_FRAME || tolen > sizeof(struct sockaddr_in) )
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    while( ring_free( &tx ) == 0 )
+    {
+        tx_waits++;
+        sched_yield( );
+    }
+
+    slot = &tx.slots[tx.tail % IO_SLOTS];
+    memcpy( slot->data, msg, len );
+    memset( &slot->addr, 0, sizeof(slot->addr) );
+    memcpy( &slot->addr, to, tolen );
+    slot->len = len;
+    ring_publish( &tx, 1 );
+    return len;
+}
+
+void iothread_print_stats( )
+{
+    unsigned long rf = __atomic_load_n( &rx_frames, __ATOMIC_RELAXED );
+    unsigned long rb = __atomic_load_n( &rx_batches, __ATOMIC_RELAXED );
+    unsigned long tf = __atomic_load_n( &tx_frames, __ATOMIC_RELAXED );
+    unsigned long tb = __atomic_load_n( &tx_batches, __ATOMIC_RELAXED );
+
+    fprintf( stderr, "I/O thread: received %lu frames in %lu batches (%.1f), "
+                     "sent %lu frames in %lu batches (%.1f), %lu waits for a full ring\n",
+                     rf, rb, rb ? (double)rf / rb : 0.0,
+                     tf, tb, tb ? (double)tf / tb : 0.0, tx_waits );
+}
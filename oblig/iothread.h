@@ -0,0 +1,18 @@
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* see comments in the c file */
+
+int     iothread_start( int s );
+int     iothread_running( );
+int     iothread_fd( );
+int     iothread_recv( char** frame, struct sockaddr_in* from );
+ssize_t iothread_sendto( int s, const void* msg, size_t len, int flags,
+                         const struct sockaddr* to, socklen_t tolen );
+void    iothread_print_stats( );
+
+#endif /* IOTHREAD_H */
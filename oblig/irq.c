@@ -1,9 +1,12 @@
+#define _GNU_SOURCE   /* sched_setaffinity */
 #include <assert.h>
+#include <sched.h>
 #include <sys/select.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,8 +18,13 @@
  */
 #include "delayed_sendto.h"
 #include "slow_receiver.h"
+#include "node.h"
+#include "fabric.h"
+#include "resolver.h"
+#include "iothread.h"
 #include "l1_phys.h"
 #include "l5_app.h"
+#include "logger.h"
 
 /*
  * You will be interested to try things repeatedly after a little
@@ -32,21 +40,243 @@ struct TimeoutCallback
     struct timeval  calltime;
     TimeoutCallFunc callback;
     void* parameter;
+    node_t* node;     /* the node that registered the timeout */
     int timerId;
-    struct TimeoutCallback* next;
+    unsigned long seq;   /* registration order, for equal calltimes */
+    int heap_index;      /* position in the timeouts heap */
+    struct TimeoutCallback* next;   /* in the same by_id bucket */
 };
 typedef struct TimeoutCallback timeout_cb_t;
 
-static int timerId_next = 0;
+static int           timerId_next = 0;
+static unsigned long seq_next     = 0;
+
+/*
+ * In virtual time mode, the clock is not read from the operating
+ * system. It only moves forward when handle_events() finds that no
+ * I/O is pending, and then it jumps directly to the next timeout.
+ * Delays of several seconds in the delayed senders pass in no
+ * time at all, but everything happens in the same order as with
+ * the real clock.
+ */
+static int            virtual_time = 0;
+static struct timeval virtual_now;
 
 /* two local functions, defined below */
 static struct timeval* set_timeout_time( struct timeval* tv );
 static void check_timeout_expired( );
+static int  advance_virtual_time( );
+static void unlink_timeout( timeout_cb_t* t );
+
+/*
+ * The pending timeouts. They are kept in a binary heap that is ordered
+ * by calltime, so timeouts[0] is the timeout that expires first.
+ * Timeouts with the same calltime expire in the order in which they
+ * were registered. Initially the heap is empty.
+ * With thousands of links, each with its own timers, a sorted list
+ * would make every register_timeout_cb() walk thousands of entries.
+ */
+static timeout_cb_t** timeouts     = 0;
+static int            num_timeouts = 0;
+static int            max_timeouts = 0;
+
+/*
+ * All pending timeouts, hashed by timerId, for remove_timeout().
+ */
+#define ID_HASH_SIZE 16384
+static timeout_cb_t*  by_id[ID_HASH_SIZE];
+
+/*
+ * Whether select() watches STDIN, see irq_enable_keyboard().
+ */
+static int            keyboard_enabled = 1;
+
+/*
+ * Under load, calling select() for every frame costs a system call
+ * per frame. So handle_events() takes up to budget frames from the
+ * UDP socket when it is readable, like NAPI polling in Linux. If it
+ * used up the budget, there are probably more, and the next round
+ * takes them without asking select() first. The timers are checked
+ * between rounds. After IRQ_POLL_ROUNDS rounds like that, select()
+ * is called anyway, without waiting, so that the keyboard and the
+ * resolver are not starved.
+ */
+#define IRQ_DEFAULT_BUDGET 64
+#define IRQ_POLL_ROUNDS    4
+
+static int            budget = IRQ_DEFAULT_BUDGET;
+
+/*
+ * Busy polling, for links where the latency of a wakeup from select()
+ * matters more than the CPU. After a frame has arrived,
+ * handle_events() does not sleep for busy_poll_us: it takes frames
+ * from the socket without blocking and checks the timers, over and
+ * over. Every IRQ_BUSY_SELECT empty rounds it asks select() about the
+ * keyboard and the resolver, without waiting. When no frame has come
+ * for busy_poll_us, it sleeps in select() again until the next one.
+ * The socket gets SO_BUSY_POLL as well, so that the kernel polls the
+ * driver for a frame instead of waiting for its interrupt.
+ */
+#define IRQ_BUSY_SELECT 256
+
+static int            busy_poll_us  = 0;    /* 0 is off */
+static int            busy_poll_cpu = -1;   /* pin the thread, -1 is don't */
+
+/*
+ * Switch the clock to virtual time. Call this before any layer is
+ * initialized, so that all timestamps are taken from the same clock.
+ * The virtual clock starts at the current real time.
+ */
+void irq_set_virtual_time( int enable )
+{
+    virtual_time = enable;
+    if( virtual_time )
+    {
+        gettimeofday( &virtual_now, 0 );
+    }
+}
+
+/*
+ * Stop or resume watching the keyboard. The application layer stops
+ * it while it can't take more input, and at the end of the input.
+ */
+void irq_enable_keyboard( int enable )
+{
+    keyboard_enabled = enable;
+}
+
+/*
+ * Set the number of frames that handle_events() takes from the UDP
+ * socket in one round. 1 is one frame per select().
+ */
+void irq_set_budget( int frames )
+{
+    budget = frames > 0 ? frames : 1;
+}
+
+/*
+ * Spin for idle_us microseconds after the last frame before
+ * sleeping again, see above. 0 switches busy polling off. A cpu of
+ * 0 or more pins the event loop to that CPU.
+ */
+void irq_set_busy_poll( int idle_us, int cpu )
+{
+    busy_poll_us  = idle_us > 0 ? idle_us : 0;
+    busy_poll_cpu = cpu;
+}
+
+/*
+ * Take up to budget frames from the UDP socket. Returns the number
+ * of frames. If it is budget, more may be waiting.
+ */
+static int poll_socket( )
+{
+    int n;
+
+    for( n=0; n<budget; n++ )
+    {
+        if( !l1_handle_event( ) )
+        {
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+ * Prepare the socket and the thread for busy polling.
+ */
+static void start_busy_poll( )
+{
+    cpu_set_t cpus;
+
+    if( busy_poll_cpu >= 0 )
+    {
+        CPU_ZERO( &cpus );
+        CPU_SET( busy_poll_cpu, &cpus );
+        if( sched_setaffinity( 0, sizeof(cpus), &cpus ) < 0 )
+        {
+            logmsg( LL_WARN, "Could not pin the event loop to CPU %d: %s\n",
+                    busy_poll_cpu, strerror( errno ) );
+        }
+    }
+
+    /* raising it above net.core.busy_read needs CAP_NET_ADMIN */
+    if( !fabric_enabled( )
+        && setsockopt( this_node->udp_socket, SOL_SOCKET, SO_BUSY_POLL,
+                       &busy_poll_us, sizeof(busy_poll_us) ) < 0 )
+    {
+        logmsg( LL_WARN, "No SO_BUSY_POLL on the socket: %s\n", strerror( errno ) );
+    }
+}
 
 /*
- * The list of pending timeouts. Initially the list is empty.
+ * Keep busy polling for busy_poll_us from now.
  */
-static timeout_cb_t* timeouts = 0;
+static void busy_poll_extend( struct timeval* busy_until )
+{
+    struct timeval now;
+    struct timeval idle;
+
+    gettimeofday( &now, 0 );
+    idle.tv_sec  = busy_poll_us / 1000000;
+    idle.tv_usec = busy_poll_us % 1000000;
+    timeradd( &now, &idle, busy_until );
+}
+
+/*
+ * One round of busy polling. Returns 0 when select() should be
+ * called instead: the idle time is over, or it is time to look at
+ * the other descriptors. Sets *pending if the budget was used up.
+ */
+static int busy_poll( struct timeval* busy_until, int* spins, int* pending )
+{
+    struct timeval now;
+    int            n;
+
+    if( !timerisset( busy_until ) )
+    {
+        return 0;
+    }
+    if( ++*spins >= IRQ_BUSY_SELECT )
+    {
+        *spins = 0;
+        return 0;
+    }
+
+    n = poll_socket( );
+    *pending = n == budget;
+
+    if( n > 0 )
+    {
+        busy_poll_extend( busy_until );
+        return 1;
+    }
+    gettimeofday( &now, 0 );
+    if( !timercmp( &now, busy_until, < ) )
+    {
+        timerclear( busy_until );
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * All layers must use this function instead of gettimeofday().
+ * It returns the real time or the virtual time, depending on the
+ * mode that has been chosen with irq_set_virtual_time().
+ */
+void irq_get_time( struct timeval* tv )
+{
+    if( virtual_time )
+    {
+        *tv = virtual_now;
+    }
+    else
+    {
+        gettimeofday( tv, 0 );
+    }
+}
 
 /*
  * This is the main loop of this program.
@@ -55,7 +285,16 @@ static timeout_cb_t* timeouts = 0;
  */
 void handle_events( )
 {
-    int max_fd = my_udp_socket + 1;
+    int            socket_pending = 0;   /* the socket used up its budget */
+    int            rounds         = 0;   /* rounds since the last select */
+    int            spins          = 0;   /* busy polling rounds since the last select */
+    struct timeval busy_until;           /* busy polling until then, if set */
+
+    timerclear( &busy_until );
+    if( busy_poll_us && !virtual_time )
+    {
+        start_busy_poll( );
+    }
 
     while( 1 )
     {
@@ -63,33 +302,86 @@ void handle_events( )
         struct timeval  tv;
         struct timeval* tv_ptr = NULL;
         int             retval;
+        int             res_fd = resolver_fd( );
+
+        /* With the I/O thread, frames come from its ring, and its
+         * descriptor is readable when there are some.
+         */
+        int             sock_fd = iothread_running( ) ? iothread_fd( ) : this_node->udp_socket;
+        int             max_fd = sock_fd + 1;
 
         /* Allow the timeout mechanisms to set a time when select
          * must wake up at the latest.
          */
         tv_ptr = set_timeout_time( &tv );
 
+        /* The socket has more frames than the last round took. Take
+         * the next batch right away.
+         */
+        if( socket_pending && rounds < IRQ_POLL_ROUNDS )
+        {
+            rounds++;
+            socket_pending = poll_socket( ) == budget;
+            continue;
+        }
+        rounds = 0;
+
+        /* Busy polling: take frames without select(). When it is
+         * time to look at the other descriptors, select() is called
+         * without waiting.
+         */
+        if( busy_poll_us && !virtual_time )
+        {
+            if( busy_poll( &busy_until, &spins, &socket_pending ) )
+            {
+                continue;
+            }
+        }
+
+        /* In virtual time, we never sleep while a timeout is pending.
+         * We only poll for I/O, and jump to the timeout if there is none.
+         * Neither do we sleep when the socket may still have frames,
+         * or while busy polling.
+         */
+        if( (virtual_time && tv_ptr) || socket_pending || timerisset( &busy_until ) )
+        {
+            tv.tv_sec = tv.tv_usec = 0;
+            tv_ptr = &tv;
+        }
+
         /* The fd_set must be cleared and refilled every time before
          * you call select.
          */
         FD_ZERO( &read_set );
-        FD_SET( STDIN_FILENO, &read_set );             /* add keyboard input */
-        FD_SET( my_udp_socket, &read_set ); /* add UDP socket */
+        if( keyboard_enabled )
+        {
+            FD_SET( STDIN_FILENO, &read_set );         /* add keyboard input */
+        }
+        FD_SET( sock_fd, &read_set );               /* add UDP socket or I/O thread */
+        if( res_fd >= 0 )
+        {
+            FD_SET( res_fd, &read_set );                /* add host name lookups */
+            if( res_fd >= max_fd ) max_fd = res_fd + 1;
+        }
 
         /* Now wait until something happens.
          */
         retval = select( max_fd, &read_set, 0, 0, tv_ptr );
 
+        socket_pending = 0;
+
         switch( retval )
         {
         case -1 :
-            perror( "Error in select" );
+            logmsg_limited( LL_ERROR, "Error in select: %s\n", strerror( errno ) );
             break;
 
         case 0 :
             /* Nothing happened on the socket or the keyboard. But the
-             * timeout has expired.
+             * timeout has expired. In virtual time, the clock must be
+             * moved to the timeout first.
              */
+            if( virtual_time ) advance_virtual_time( );
             check_timeout_expired();
             break;
 
@@ -108,13 +400,28 @@ void handle_events( )
              * the keyboard. That's most likely user input. Call
              * the application layer directly.
              */
-            if( FD_ISSET( STDIN_FILENO, &read_set ) ) l5_handle_keyboard( );
+            if( keyboard_enabled && FD_ISSET( STDIN_FILENO, &read_set ) ) l5_handle_keyboard( );
 
             /* If this file descriptor is set, something has happened on
              * the UDP socket. Probably data has arrived. Call the event
-             * handler of the physical layer.
+             * handler of the physical layer, for up to budget frames.
              */
-            if( FD_ISSET( my_udp_socket, &read_set ) ) l1_handle_event( );
+            if( FD_ISSET( sock_fd, &read_set ) )
+            {
+                int n = poll_socket( );
+                socket_pending = n == budget;
+
+                /* a frame has come, start busy polling */
+                if( n > 0 && busy_poll_us && !virtual_time )
+                {
+                    busy_poll_extend( &busy_until );
+                }
+            }
+
+            /* Host names that the physical layer has asked for have
+             * been resolved.
+             */
+            if( res_fd >= 0 && FD_ISSET( res_fd, &read_set ) ) resolver_handle_event( );
             break;
         }
     }
@@ -135,16 +442,16 @@ struct timeval* set_timeout_time( struct timeval* tv )
 {
     check_timeout_expired();
 
-    if( timeouts == 0 )
+    if( num_timeouts == 0 )
     {
         /* nothing to do */
         return 0;
     }
 
     struct timeval now;
-    gettimeofday( &now, 0 );
+    irq_get_time( &now );
 
-    timersub( &timeouts->calltime, &now, tv );
+    timersub( &timeouts[0]->calltime, &now, tv );
 
     /* make sure we don't end up calling select() with a negative timeout time */
     if(tv->tv_usec < 0 || tv->tv_sec < 0)
@@ -160,30 +467,150 @@ struct timeval* set_timeout_time( struct timeval* tv )
  */
 static void check_timeout_expired( )
 {
-    if( timeouts == 0 )
+    if( num_timeouts == 0 )
     {
         /* nothing to do */
         return;
     }
 
     struct timeval now;
-    gettimeofday( &now, 0 );
+    irq_get_time( &now );
 
-    while( timeouts && timercmp( &timeouts->calltime, &now, < ) )
+    while( num_timeouts > 0 && timercmp( &timeouts[0]->calltime, &now, <= ) )
     {
-        timeout_cb_t* temp = timeouts;
-        timeouts = temp->next;
-        temp->next = 0;
+        timeout_cb_t* temp = timeouts[0];
+        unlink_timeout( temp );
+        this_node = temp->node;
         (*temp->callback)(temp->parameter);
         free(temp);
     }
 }
 
 /*
- * Add a timeout to the timeout list.
+ * For event loops other than handle_events(), like the simulator's.
+ * Wait for the first pending timeout and call all the callbacks that
+ * are due. In virtual time, there is no waiting, the clock jumps.
+ * Returns 0 if there is no pending timeout, 1 otherwise.
+ */
+int irq_run_next_timeout( )
+{
+    struct timeval  tv;
+
+    if( num_timeouts == 0 )
+    {
+        return 0;
+    }
+
+    if( virtual_time )
+    {
+        advance_virtual_time( );
+    }
+    else if( set_timeout_time( &tv ) )
+    {
+        select( 0, 0, 0, 0, &tv );
+    }
+
+    check_timeout_expired( );
+    return 1;
+}
+
+/*
+ * Virtual time only: move the clock forward to the first pending
+ * timeout. The clock never moves backwards.
+ * Returns 1 if the clock was moved, 0 if there is no pending timeout.
+ */
+static int advance_virtual_time( )
+{
+    if( num_timeouts == 0 )
+    {
+        return 0;
+    }
+
+    if( timercmp( &timeouts[0]->calltime, &virtual_now, > ) )
+    {
+        virtual_now = timeouts[0]->calltime;
+    }
+    return 1;
+}
+
+/*
+ * Helper functions for the heap of timeouts.
+ */
+static int expires_before( const timeout_cb_t* a, const timeout_cb_t* b )
+{
+    if( timercmp( &a->calltime, &b->calltime, != ) )
+    {
+        return timercmp( &a->calltime, &b->calltime, < );
+    }
+    return a->seq < b->seq;
+}
+
+static void heap_set( int i, timeout_cb_t* t )
+{
+    timeouts[i] = t;
+    t->heap_index = i;
+}
+
+static void sift_up( int i )
+{
+    timeout_cb_t* t = timeouts[i];
+
+    while( i > 0 && expires_before( t, timeouts[(i-1)/2] ) )
+    {
+        heap_set( i, timeouts[(i-1)/2] );
+        i = (i-1)/2;
+    }
+    heap_set( i, t );
+}
+
+static void sift_down( int i )
+{
+    timeout_cb_t* t = timeouts[i];
+    int           child;
+
+    while( (child = 2*i+1) < num_timeouts )
+    {
+        if( child+1 < num_timeouts && expires_before( timeouts[child+1], timeouts[child] ) )
+        {
+            child++;
+        }
+        if( !expires_before( timeouts[child], t ) )
+        {
+            break;
+        }
+        heap_set( i, timeouts[child] );
+        i = child;
+    }
+    heap_set( i, t );
+}
+
+/*
+ * Take a timeout out of the heap and the hash table, without
+ * freeing it.
+ */
+static void unlink_timeout( timeout_cb_t* t )
+{
+    timeout_cb_t** finder = &by_id[t->timerId % ID_HASH_SIZE];
+    int            i      = t->heap_index;
+
+    while( *finder != t ) finder = &(*finder)->next;
+    *finder = t->next;
+    t->next = 0;
+
+    num_timeouts--;
+    if( i < num_timeouts )
+    {
+        heap_set( i, timeouts[num_timeouts] );
+        sift_down( i );
+        sift_up( timeouts[i]->heap_index );
+    }
+}
+
+/*
+ * Add a timeout to the timeout heap.
  * The timeout time is an absolute time, as in "today, 16:34".
  * It is NOT a time relative from now, as in "in two minutes".
- * The first timeout that will expire is first in the queue.
+ * The first timeout that will expire is first in the heap.
  *
  * The return value is a unique id, which can be used 
  * with remove_timeout() to remove the timer.
@@ -192,78 +619,68 @@ int register_timeout_cb( struct timeval tv, TimeoutCallFunc cb, void* param )
 {
     timeout_cb_t* t;
     t = (timeout_cb_t*)malloc(sizeof(timeout_cb_t));
-    t->timerId          = timerId_next++;
+    if( t == 0 )
+    {
+        logmsg_limited( LL_ERROR, "Not enough memory in register_timeout_cb\n" );
+        return -1;
+    }
+    t->timerId          = timerId_next;
+    t->seq              = seq_next++;
     t->calltime.tv_sec  = tv.tv_sec;
     t->calltime.tv_usec = tv.tv_usec;
     t->callback         = cb;
     t->parameter        = param;
-    t->next             = 0;
+    t->node             = this_node;
 
-    if( timeouts == 0 )
-    {
-        timeouts = t;
-    }
-    else if( timercmp( &t->calltime, &timeouts->calltime, < ) )
-    {
-        t->next = timeouts;
-        timeouts = t;
-    }
-    else
-    {
-        timeout_cb_t* finder = timeouts;
+    /* ids are never negative, also after wrapping around */
+    timerId_next = (timerId_next + 1) & 0x7fffffff;
 
-        while( finder->next )
+    if( num_timeouts == max_timeouts )
+    {
+        int            new_max = max_timeouts ? 2*max_timeouts : 256;
+        timeout_cb_t** h       = (timeout_cb_t**)realloc( timeouts, new_max*sizeof(timeout_cb_t*) );
+        if( h == 0 )
         {
-            if( timercmp( &t->calltime, &finder->next->calltime, < ) )
-            {
-                t->next = finder->next;
-                finder->next = t;
-                return t->timerId;
-            }
-
-            finder = finder->next;
+            logmsg_limited( LL_ERROR, "Not enough memory in register_timeout_cb\n" );
+            free( t );
+            return -1;
         }
-
-        finder->next = t;
+        timeouts     = h;
+        max_timeouts = new_max;
     }
 
+    t->next = by_id[t->timerId % ID_HASH_SIZE];
+    by_id[t->timerId % ID_HASH_SIZE] = t;
+
+    heap_set( num_timeouts, t );
+    num_timeouts++;
+    sift_up( t->heap_index );
+
     return t->timerId;
 }
 
 
-/* Remove a timeout from the timeout list.
+/* Remove a timeout from the timeout heap.
  *
  * The parameter is a timer id, as returned from register_timeout_cb().
  * Returns 0 on success, -1 if not found.
  */
 int remove_timeout( int timerId ) 
 {
-    timeout_cb_t *t = timeouts;
-    timeout_cb_t *prev = NULL;
+    timeout_cb_t *t;
 
-    while(t != NULL) 
-    {
-        if(t->timerId == timerId)
-            break;
+    if( timerId < 0 )
+        return -1;
 
-        prev = t;
+    t = by_id[timerId % ID_HASH_SIZE];
+    while( t != NULL && t->timerId != timerId )
         t = t->next;
-    }
 
     if(t == NULL) /* not found */
         return -1;
 
-    if(prev == NULL) /* remove head */
-    {
-        timeouts = timeouts->next;
-    }
-    else 
-    {
-        prev->next = t->next;
-    }
-
+    unlink_timeout( t );
     free(t);
     return 0;
 }
 
-
@@ -1,8 +1,17 @@
 #ifndef IRQ_H
 #define IRQ_H
 
+#include <sys/time.h>
+
 void handle_events( );
 
+void irq_set_virtual_time( int enable );
+void irq_enable_keyboard( int enable );
+void irq_set_budget( int frames );
+void irq_set_busy_poll( int idle_us, int cpu );
+void irq_get_time( struct timeval* tv );
+int  irq_run_next_timeout( );
+
 int register_timeout_cb( struct timeval tv, void (*cb)(), void* param );
 int remove_timeout( int timer_id );
 
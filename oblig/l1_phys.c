@@ -3,32 +3,173 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
+#include "irq.h"
+#include "node.h"
+#include "fabric.h"
+#include "resolver.h"
+#include "iothread.h"
 #include "l1_phys.h"
 #include "l2_link.h"
+#include "logger.h"
+#include "checkpoint.h"
+#include "hdr.h"
 
+#include "delayed_sendto.h"
 #include "delayed_dropping_sendto.h"
 
 #define MAX_CONNS 1024
 
-static phys_conn_t my_conns[MAX_CONNS];
+/* The largest frame that fits into a UDP datagram. */
+#define L1_MAX_FRAME 65507
 
-int my_udp_socket = -1;
+/* Repeat UP packets until the other side answers. */
+#define UP_RETRY_INTERVAL 1 /* seconds */
+
+/*
+ * Link liveness detection: every established link sends a HELLO per
+ * interval. A link that has received nothing at all for detect_mult
+ * intervals is declared down. On a delayed cable the other side's
+ * first HELLO may take much longer than the detection time, so the
+ * first deadline after the UP exchange leaves time for the answer to
+ * travel there and back, and for one repeated UP (first_rx_grace()).
+ * The links are checked by one timer per node, which visits a
+ * different slice of the devices (device % LIVENESS_PHASES) on every
+ * tick. That spreads the HELLOs over the interval and costs one
+ * timer per node instead of one per link.
+ */
+#define LIVENESS_PHASES 8
+
+/*
+ * Egress shaping: every device has a token bucket that fills at
+ * shaper_rate bytes per second up to shaper_burst bytes. A frame may
+ * be sent while there are tokens, and takes its length from the
+ * bucket, which may go below zero. While the bucket is empty the
+ * device is not ready, layer 2 keeps its frames, and a timer calls
+ * l2_device_ready() when the bucket has tokens again.
+ */
+#define SHAPER_MIN_BURST 3000   /* bytes */
+
+/*
+ * Kernel timestamps (SO_TIMESTAMPING): the kernel notes when a frame
+ * came in, and when a frame that we sent left the stack. With the
+ * time of the user side, that gives two latencies per device: from
+ * the kernel to l1_handle_event, which includes the wait in select
+ * and in the socket queue, and from send_frame to the driver.
+ *
+ * The stamp of a sent frame comes back on the error queue of the
+ * socket with the number of the send (SOF_TIMESTAMPING_OPT_ID). The
+ * send times wait for it in a ring of TX_STAMPS entries; a stamp
+ * that comes back after its entry has been reused is not counted.
+ *
+ * Software stamps are taken with the clock of gettimeofday. The
+ * hardware stamps of a NIC are used only for frames without a
+ * software stamp, which assumes that the clock of the NIC follows
+ * the system clock (phc2sys). Hardware stamping must be switched on
+ * at the NIC (SIOCSHWTSTAMP), which is left to the administrator.
+ */
+#define TX_STAMPS 4096
+
+struct TxStamp
+{
+    unsigned int    key;
+    int             device;     /* -1 if the entry is free */
+    struct timespec sent;
+};
+
+/*
+ * Every frame starts with this header. It tells UP packets, which
+ * plug in a cable, apart from data that is delivered to layer 2.
+ * UP packets carry the MAC address of the sender after the header,
+ * and the epoch of the link at the sender.
+ */
+struct L1Header
+{
+    int type;
+};
+
+enum
+{
+    L1_UP = 1,
+    L1_UP_ACK,
+    L1_DATA,
+    L1_HELLO
+};
+
+/*
+ * The private state of the physical layer of one node.
+ */
+struct L1State
+{
+    phys_conn_t my_conns[MAX_CONNS];
+    int         num_conns;        /* devices 0..num_conns-1 have been used */
+    int         own_mac_address;
+    int         liveness_phase;
+    unsigned int incarnation;     /* differs from one start of the program to the next */
+
+    /* kernel timestamps, see above */
+    int             rx_stamping;
+    int             tx_stamping;
+    int             rx_stamped;     /* rx_time is valid for the frame being handled */
+    struct timespec rx_time;
+    unsigned int    tx_key;         /* the number of the next send */
+    struct TxStamp  tx_stamps[TX_STAMPS];
+    unsigned long   sw_stamps;
+    unsigned long   hw_stamps;
+    unsigned long   tx_unmatched;
+};
+
+/*
+ * The function that puts frames onto the "cable". It is the same for
+ * all nodes, see l1_set_wire().
+ */
+static ssize_t (*wire_sendto)(int s, const void *msg, size_t len, int flags,
+                              const struct sockaddr *to, socklen_t tolen) = fabric_sendto;
+
+/*
+ * Liveness parameters, the same for all nodes. An interval of 0
+ * switches liveness detection off.
+ */
+static struct timeval liveness_interval = { 0, 250000 };
+static int            liveness_detect_mult = 3;
+
+/* How long a frame is on the cable, see l1_set_wire() */
+static struct timeval wire_delay = { 0, 0 };
+
+/*
+ * Shaper parameters, the same for all devices. A rate of 0 switches
+ * shaping off.
+ */
+static double shaper_rate  = 0;   /* bytes/s */
+static double shaper_burst = 0;   /* bytes */
+
+/* Ask the kernel for timestamps, for all nodes. */
+static int timestamping = 0;
+
+/* Leave the socket to the I/O thread, see iothread.c */
+static int io_thread = 0;
 
 /* Finds the connection associated with the given sockaddr */
 static phys_conn_t *get_phys_conn( struct sockaddr_in *addr ) {
+    struct L1State *l1 = this_node->l1;
     phys_conn_t *conn = NULL;
 
     int i;
-    for( i=0; i<MAX_CONNS && my_conns[i].remote_hostname != 0; ++i )
+    for( i=0; i<l1->num_conns; ++i )
     {
-        if ( my_conns[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr 
-                && my_conns[i].addr.sin_port == addr->sin_port )
+        if ( l1->my_conns[i].remote_hostname != 0
+                && l1->my_conns[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr 
+                && l1->my_conns[i].addr.sin_port == addr->sin_port )
         {
             /* Match */
-            conn = &my_conns[i];
+            conn = &l1->my_conns[i];
             break;
         }
     }
@@ -36,41 +177,611 @@ static phys_conn_t *get_phys_conn( struct sockaddr_in *addr ) {
     return conn;
 }
 
-/* Create an entry in the table of physical connection */
+/*
+ * Create an entry in the table of physical connection. The address
+ * of the remote host is not known yet, the caller must set it with
+ * set_phys_addr() before sending anything.
+ */
 static phys_conn_t *create_phys_conn( const char *hostname, unsigned short port )
 {
+    struct L1State *l1 = this_node->l1;
     phys_conn_t *conn = NULL;
 
     /* Find an available device id */
     int device;
     for( device=0; device<MAX_CONNS; device++ )
     {
-        if( my_conns[device].remote_hostname == 0 )
+        if( l1->my_conns[device].remote_hostname == 0 )
         {
-            conn = &my_conns[device];
+            conn = &l1->my_conns[device];
             conn->device = device;
+            if( device >= l1->num_conns ) l1->num_conns = device + 1;
             break;
         }
     }
 
     if( !conn  )
     {
-        fprintf( stderr, "Too many physical connections established.\n" );
+        logmsg( LL_ERROR, "Too many physical connections established.\n" );
         exit( -1 );
     }
 
     conn->remote_hostname = strdup(hostname);
     conn->remote_port = port;
     conn->state = UNASSIGNED;
+    conn->tokens = shaper_burst;
+    conn->shaper_timer = -1;
+    conn->up_timer = -1;
+    conn->epoch = l1->incarnation;
+    if( conn->rx_latency ) hdr_reset( conn->rx_latency );
+    if( conn->tx_latency ) hdr_reset( conn->tx_latency );
+    irq_get_time( &conn->refilled );
+    memset( &conn->addr, 0, sizeof(struct sockaddr_in) );
 
+    return conn;
+}
 
+/*
+ * Give the entry of a connection that was never established back, so
+ * that its device can be used again.
+ */
+static void free_phys_conn( phys_conn_t *conn )
+{
+    if( conn->up_timer >= 0 )
+    {
+        remove_timeout( conn->up_timer );
+        conn->up_timer = -1;
+    }
+    free( conn->remote_hostname );
+    conn->remote_hostname = 0;
+    conn->state = UNASSIGNED;
+    memset( &conn->addr, 0, sizeof(struct sockaddr_in) );
+}
 
-    /* ... */
+static void set_phys_addr( phys_conn_t *conn, const struct in_addr *in )
+{
+    conn->addr.sin_family = AF_INET;
+    conn->addr.sin_addr   = *in;
+    conn->addr.sin_port   = htons(conn->remote_port);
+}
 
-    /* HERE: Get the address of the remote host and initialize conn->addr.  */
+/*
+ * Send a frame of the given type to the remote end of conn. Its
+ * payload is hdr followed by buf. They are gathered into the frame,
+ * so that the layer above doesn't have to put them together first.
+ */
+static int send_frame( phys_conn_t *conn, int type, const char* hdr, int hlen,
+                       const char* buf, int length )
+{
+    struct L1State*  l1 = this_node->l1;
+    char*            frame;
+    struct L1Header* hdr_pointer;
+    struct timespec  sent;
+    int              retval;
 
-    
-    return conn;
+    frame = (char*)malloc( hlen+length+sizeof(struct L1Header) );
+    if( frame == 0 )
+    {
+        logmsg_limited( LL_ERROR, "Not enough memory in l1_send\n" );
+        return -1;
+    }
+
+    hdr_pointer = (struct L1Header*)frame;
+    hdr_pointer->type = htonl(type);
+    if( hlen > 0 )
+    {
+        memcpy( &frame[sizeof(struct L1Header)], hdr, hlen );
+    }
+    if( length > 0 )
+    {
+        memcpy( &frame[sizeof(struct L1Header)+hlen], buf, length );
+    }
+
+    if( l1->tx_stamping )
+    {
+        clock_gettime( CLOCK_REALTIME, &sent );
+    }
+    retval = wire_sendto( this_node->udp_socket,
+                          frame, hlen+length+sizeof(struct L1Header),
+                          0,
+                          (struct sockaddr*)&conn->addr, sizeof(struct sockaddr_in) );
+    free( frame );
+    if( retval < 0 )
+    {
+        logmsg_limited( LL_ERROR, "Error sending frame: %s\n", strerror( errno ) );
+        return -1;
+    }
+    if( l1->tx_stamping )
+    {
+        struct TxStamp* t = &l1->tx_stamps[l1->tx_key % TX_STAMPS];
+        t->key    = l1->tx_key++;
+        t->device = conn->device;
+        t->sent   = sent;
+    }
+    return retval-sizeof(struct L1Header);
+}
+
+static void shaper_refill( phys_conn_t *conn )
+{
+    struct timeval now;
+    struct timeval elapsed;
+
+    irq_get_time( &now );
+    timersub( &now, &conn->refilled, &elapsed );
+    conn->refilled = now;
+
+    conn->tokens += shaper_rate * (elapsed.tv_sec + elapsed.tv_usec / 1e6);
+    if( conn->tokens > shaper_burst )
+    {
+        conn->tokens = shaper_burst;
+    }
+}
+
+/*
+ * Timeout callback: the bucket has tokens again.
+ */
+static void shaper_wakeup( void* param )
+{
+    phys_conn_t *conn = (phys_conn_t*)param;
+
+    conn->shaper_timer = -1;
+    if( conn->state == ESTABLISHED )
+    {
+        l2_device_ready( conn->device );
+    }
+}
+
+/*
+ * Returns 1 if the token bucket of the device allows a frame now.
+ * Otherwise a timer is started that tells layer 2 when it does.
+ */
+static int shaper_ready( phys_conn_t *conn )
+{
+    struct timeval now;
+    struct timeval wait;
+    double         sec;
+
+    if( shaper_rate == 0 )
+    {
+        return 1;
+    }
+
+    shaper_refill( conn );
+    if( conn->tokens > 0 )
+    {
+        return 1;
+    }
+
+    if( conn->shaper_timer < 0 )
+    {
+        sec = -conn->tokens / shaper_rate;
+        wait.tv_sec  = (long)sec;
+        wait.tv_usec = (long)((sec - wait.tv_sec) * 1e6) + 1;
+        irq_get_time( &now );
+        timeradd( &now, &wait, &now );
+        conn->shaper_timer = register_timeout_cb( now, &shaper_wakeup, conn );
+    }
+    return 0;
+}
+
+/*
+ * Send an UP or UP_ACK packet that carries our MAC address and the
+ * epoch of the link. The epoch changes when we start the link over,
+ * after a restart or when we have declared it down. The other side
+ * then knows that everything it has for the link is stale, even if
+ * it has not noticed that the link was gone. Repeated UPs of the
+ * same epoch change nothing.
+ */
+static void send_up( phys_conn_t *conn, int type )
+{
+    int up[2];
+
+    up[0] = htonl(this_node->l1->own_mac_address);
+    up[1] = htonl(conn->epoch);
+    send_frame( conn, type, NULL, 0, (const char*)up, sizeof(up) );
+}
+
+/*
+ * Timeout callback: repeat the UP packet until the link is
+ * established, because the first one may have been dropped. There is
+ * at most one such timer per connection, start it with start_up().
+ */
+static void retry_up( void* param )
+{
+    phys_conn_t   *conn = (phys_conn_t*)param;
+    struct timeval now;
+    struct timeval interval = { UP_RETRY_INTERVAL, 0 };
+
+    conn->up_timer = -1;
+
+    /* A link that went down is plugged in again as soon as the other
+     * side answers.
+     */
+    if( conn->state != CONNECTING && conn->state != DISCONNECTED
+     && !(conn->state == ESTABLISHED && conn->confirming) )
+    {
+        return;
+    }
+
+    send_up( conn, L1_UP );
+
+    irq_get_time( &now );
+    timeradd( &now, &interval, &now );
+    conn->up_timer = register_timeout_cb( now, &retry_up, conn );
+}
+
+/*
+ * Send UP packets until the other side answers. A link that flaps
+ * still has its timer from the last time, which keeps repeating.
+ */
+static void start_up( phys_conn_t *conn )
+{
+    if( conn->up_timer < 0 )
+    {
+        retry_up( conn );
+    }
+}
+
+/*
+ * The time from our side of the UP exchange until the first frame of
+ * the other side may arrive: our answer goes there, a HELLO comes
+ * back, and one of them may have to wait for a repeated UP.
+ */
+static void first_rx_grace( struct timeval* grace )
+{
+    struct timeval retry = { UP_RETRY_INTERVAL, 0 };
+
+    timeradd( &wire_delay, &wire_delay, grace );
+    timeradd( grace, &liveness_interval, grace );
+    timeradd( grace, &retry, grace );
+}
+
+/*
+ * The other side has been silent for too long. Stop using the link
+ * and tell the layers above, so that they can react at once. We keep
+ * sending UP packets in case the other side comes back.
+ */
+static void link_down( phys_conn_t *conn )
+{
+    conn->state = DISCONNECTED;
+    conn->epoch++;
+    checkpoint_link_down( conn->device );
+    l2_linkdown( conn->device );
+    start_up( conn );
+}
+
+/*
+ * Take the links that were up before a restart from the checkpoint,
+ * and use them at once. The UPs tell the other sides to start over
+ * with us, and are repeated until they answer. Liveness detection
+ * finds the links whose other side is gone.
+ */
+static void restore_links( )
+{
+    struct L1State* l1 = this_node->l1;
+    ckpt_link_t*    l;
+    phys_conn_t*    conn;
+    struct in_addr  in;
+    int             device;
+
+    for( device=0; device<MAX_CONNS; device++ )
+    {
+        l = checkpoint_link( device );
+        if( l == NULL )
+        {
+            continue;
+        }
+
+        conn = &l1->my_conns[device];
+        conn->device          = device;
+        conn->remote_hostname = strdup( l->hostname );
+        conn->remote_port     = l->port;
+        conn->tokens          = shaper_burst;
+        conn->shaper_timer    = -1;
+        conn->up_timer        = -1;
+        conn->epoch           = l1->incarnation;
+        conn->peer_epoch      = l->peer_epoch;
+        conn->confirming      = 1;
+        conn->state           = ESTABLISHED;
+        irq_get_time( &conn->refilled );
+        irq_get_time( &conn->last_rx );
+        in.s_addr = l->addr;
+        set_phys_addr( conn, &in );
+        if( device >= l1->num_conns ) l1->num_conns = device + 1;
+
+        start_up( conn );
+    }
+}
+
+/*
+ * Timeout callback, one per node: send HELLOs on one slice of the
+ * established links and check whether their other sides are alive.
+ */
+static void liveness_tick( void* param )
+{
+    struct L1State *l1 = this_node->l1;
+    phys_conn_t    *conn;
+    struct timeval  now;
+    struct timeval  detect_time;
+    struct timeval  silent;
+    struct timeval  tick;
+    long            usec;
+    int             device;
+
+    irq_get_time( &now );
+
+    usec = (liveness_interval.tv_sec * 1000000L + liveness_interval.tv_usec);
+    detect_time.tv_sec  = usec * liveness_detect_mult / 1000000;
+    detect_time.tv_usec = usec * liveness_detect_mult % 1000000;
+
+    for( device = l1->liveness_phase; device < l1->num_conns; device += LIVENESS_PHASES )
+    {
+        conn = &l1->my_conns[device];
+        if( conn->state != ESTABLISHED )
+        {
+            continue;
+        }
+
+        timersub( &now, &conn->last_rx, &silent );
+        if( timercmp( &silent, &detect_time, > ) )
+        {
+            logmsg( LL_WARN, "Physical link to host:port %s:%d is down\n",
+                             conn->remote_hostname, conn->remote_port );
+            link_down( conn );
+            continue;
+        }
+
+        send_frame( conn, L1_HELLO, NULL, 0, NULL, 0 );
+    }
+
+    l1->liveness_phase = (l1->liveness_phase + 1) % LIVENESS_PHASES;
+
+    usec /= LIVENESS_PHASES;
+    tick.tv_sec  = usec / 1000000;
+    tick.tv_usec = usec % 1000000;
+    timeradd( &now, &tick, &now );
+    register_timeout_cb( now, &liveness_tick, NULL );
+}
+
+/*
+ * Resolver callback: the address of the remote host of a connection
+ * that is being set up is known now, or it could not be found.
+ */
+static void resolved( void* param, const struct in_addr* addr )
+{
+    phys_conn_t *conn = (phys_conn_t*)param;
+
+    if( conn->state != RESOLVING )
+    {
+        return;
+    }
+
+    if( addr == NULL )
+    {
+        logmsg( LL_WARN, "Could not resolve host name %s\n", conn->remote_hostname );
+        free_phys_conn( conn );
+        return;
+    }
+
+    set_phys_addr( conn, addr );
+    if( get_phys_conn( &conn->addr ) != conn )
+    {
+        logmsg( LL_WARN, "There is already a physical connection to %s:%d\n",
+                         conn->remote_hostname, conn->remote_port );
+        free_phys_conn( conn );
+        return;
+    }
+
+    conn->state = CONNECTING;
+    start_up( conn );
+}
+
+/*
+ * Configure liveness detection for all nodes that are initialized
+ * afterwards. A link is declared down after detect_mult intervals
+ * without hearing from the other side. interval_ms 0 switches
+ * liveness detection off.
+ */
+void l1_set_liveness( int interval_ms, int detect_mult )
+{
+    liveness_interval.tv_sec  = interval_ms / 1000;
+    liveness_interval.tv_usec = (interval_ms % 1000) * 1000;
+    liveness_detect_mult = detect_mult > 0 ? detect_mult : 1;
+}
+
+/*
+ * Limit every device to rate bytes per second, with bursts of up to
+ * burst bytes. A burst of 0 picks 50 ms worth of the rate. A rate of
+ * 0 switches shaping off.
+ */
+void l1_set_shaper( int rate, int burst )
+{
+    shaper_rate  = rate > 0 ? rate : 0;
+    shaper_burst = burst > 0 ? burst : shaper_rate / 20;
+    if( shaper_burst < SHAPER_MIN_BURST )
+    {
+        shaper_burst = SHAPER_MIN_BURST;
+    }
+}
+
+/*
+ * Ask the kernel for receive and send timestamps on the sockets of
+ * the nodes that are initialized afterwards. The simulated fabric
+ * has none, and the delayed wires send frames later than send_frame,
+ * so they get receive timestamps only.
+ */
+void l1_set_timestamping( int on )
+{
+    timestamping = on;
+}
+
+static void start_timestamping( )
+{
+    struct L1State* l1 = this_node->l1;
+    int             flags;
+    int             i;
+
+    if( fabric_enabled( ) )
+    {
+        logmsg( LL_WARN, "There are no kernel timestamps on the simulated fabric\n" );
+        return;
+    }
+
+    flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+          | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE;
+    if( wire_sendto == fabric_sendto )
+    {
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE
+               | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+    if( setsockopt( this_node->udp_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags) ) < 0 )
+    {
+        logmsg( LL_WARN, "No kernel timestamps: %s\n", strerror( errno ) );
+        return;
+    }
+
+    l1->rx_stamping = 1;
+    l1->tx_stamping = (flags & SOF_TIMESTAMPING_OPT_ID) != 0;
+    for( i=0; i<TX_STAMPS; i++ )
+    {
+        l1->tx_stamps[i].device = -1;
+    }
+}
+
+/*
+ * Make the system calls of the socket in a thread of their own, see
+ * iothread.c. This is for main, with plain sendto() as the wire.
+ */
+void l1_set_io_thread( int on )
+{
+    io_thread = on;
+}
+
+/*
+ * Add the time from a to b to the histogram *h, which is allocated
+ * at the first use.
+ */
+static void record_latency( struct Hdr** h, const struct timespec* a, const struct timespec* b )
+{
+    long long ns = (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+
+    if( *h == NULL )
+    {
+        *h = (struct Hdr*)malloc( sizeof(hdr_t) );
+        if( *h == NULL )
+        {
+            logmsg_limited( LL_ERROR, "Not enough memory in record_latency\n" );
+            return;
+        }
+        hdr_reset( *h );
+    }
+    hdr_record( *h, ns > 0 ? ns : 0 );
+}
+
+/*
+ * The time in a SCM_TIMESTAMPING message: the software stamp, or the
+ * hardware stamp if there is no software stamp. Returns 0 if there
+ * is neither.
+ */
+static int stamp_time( struct cmsghdr* cm, struct timespec* ts )
+{
+    struct L1State*         l1 = this_node->l1;
+    struct scm_timestamping stamps;
+
+    memcpy( &stamps, CMSG_DATA( cm ), sizeof(stamps) );
+    if( stamps.ts[0].tv_sec || stamps.ts[0].tv_nsec )
+    {
+        *ts = stamps.ts[0];
+        l1->sw_stamps++;
+        return 1;
+    }
+    if( stamps.ts[2].tv_sec || stamps.ts[2].tv_nsec )
+    {
+        *ts = stamps.ts[2];
+        l1->hw_stamps++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Take the stamps of sent frames from the error queue of the socket
+ * and match them with the send times.
+ */
+static void drain_tx_stamps( )
+{
+    struct L1State*  l1 = this_node->l1;
+    char             control[256];
+    struct msghdr    msg;
+    struct cmsghdr*  cm;
+    struct timespec  ts;
+    struct TxStamp*  t;
+    struct sock_extended_err err;
+    int              stamped;
+    int              have_err;
+
+    for( ;; )
+    {
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if( fabric_recvmsg( this_node->udp_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+        {
+            return;
+        }
+
+        stamped  = 0;
+        have_err = 0;
+        for( cm=CMSG_FIRSTHDR( &msg ); cm; cm=CMSG_NXTHDR( &msg, cm ) )
+        {
+            if( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPING )
+            {
+                stamped = stamp_time( cm, &ts );
+            }
+            else if( cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR )
+            {
+                memcpy( &err, CMSG_DATA( cm ), sizeof(err) );
+                have_err = err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING
+                        && err.ee_info   == SCM_TSTAMP_SND;
+            }
+        }
+        if( !stamped || !have_err )
+        {
+            continue;
+        }
+
+        t = &l1->tx_stamps[err.ee_data % TX_STAMPS];
+        if( t->key != err.ee_data || t->device < 0 )
+        {
+            l1->tx_unmatched++;
+            continue;
+        }
+        record_latency( &l1->my_conns[t->device].tx_latency, &t->sent, &ts );
+        t->device = -1;
+    }
+}
+
+/*
+ * Choose how frames are put onto the cable. The default is sendto(),
+ * which doesn't delay and doesn't drop packets.
+ */
+void l1_set_wire( int wire )
+{
+    switch( wire )
+    {
+    case WIRE_DELAYED :
+        wire_sendto = delayed_sendto;
+        delayed_sendto_delay( &wire_delay );
+        break;
+    case WIRE_DELAYED_DROPPING :
+        wire_sendto = delayed_dropping_sendto;
+        delayed_dropping_sendto_delay( &wire_delay );
+        break;
+    default :
+        wire_sendto = fabric_sendto;
+        timerclear( &wire_delay );
+        break;
+    }
 }
 
 /*
@@ -80,27 +791,32 @@ static phys_conn_t *create_phys_conn( const char *hostname, unsigned short port
  * local_port is the port that for the local UDP socket that
  *   we will use for all communication.
  *
- * hosts is a pointer to an array of remote hostnames and ports
- *   that we want to establish connections to. Each entry in
- *   hosts represents one network device. The index of the entry
- *   is the device number.
- *
- * numhosts is the number of hosts in the array.
+ * local_mac_address is sent to the other side when a physical
+ *   connection is established.
  *
  * Here in particular: initialize all of your socket communication
  * in this function. The socket communication is meant to fake
  * physical cables, so it should be done completely before
  * continuing.
  */
-void l1_init( int local_port )
+void l1_init( int local_port, int local_mac_address )
 {
     int                err;
     struct sockaddr_in addr;
+    struct timeval     now;
+
+    this_node->l1 = (struct L1State*)calloc( 1, sizeof(struct L1State) );
+    if( this_node->l1 == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in l1_init\n" );
+        exit( -1 );
+    }
+    this_node->l1->own_mac_address = local_mac_address;
 
-    my_udp_socket = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
-    if( my_udp_socket < 0 )
+    this_node->udp_socket = fabric_socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if( this_node->udp_socket < 0 )
     {
-        fprintf( stderr, "Failed to create local UDP socket" );
+        logmsg( LL_ERROR, "Failed to create local UDP socket\n" );
         exit( -1 );
     }
 
@@ -109,14 +825,38 @@ void l1_init( int local_port )
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port        = htons(local_port);
 
-    err = bind( my_udp_socket, (struct sockaddr*)&addr, sizeof(struct sockaddr_in) );
+    err = fabric_bind( this_node->udp_socket, (struct sockaddr*)&addr, sizeof(struct sockaddr_in) );
     if( err < 0 )
     {
-        fprintf( stderr, "Failed to bind local UDP socket to port %d", local_port );
+        logmsg( LL_ERROR, "Failed to bind local UDP socket to port %d\n", local_port );
         exit( -1 );
     }
 
-    memset( my_conns, 0, sizeof(my_conns) );
+    gettimeofday( &now, 0 );
+    this_node->l1->incarnation = (unsigned int)(now.tv_sec * 1000000 + now.tv_usec) ^ (getpid() << 16);
+
+    if( io_thread && iothread_start( this_node->udp_socket ) == 0 && wire_sendto == fabric_sendto )
+    {
+        wire_sendto = iothread_sendto;
+    }
+
+    if( timestamping && iothread_running( ) )
+    {
+        logmsg( LL_WARN, "There are no kernel timestamps with the I/O thread\n" );
+    }
+    else if( timestamping )
+    {
+        start_timestamping( );
+    }
+
+    checkpoint_open( local_port, local_mac_address );
+    restore_links( );
+
+    if( timerisset( &liveness_interval ) )
+    {
+        irq_get_time( &now );
+        register_timeout_cb( now, &liveness_tick, NULL );
+    }
 }
 
 /*
@@ -129,22 +869,17 @@ int l1_connect( const char* hostname, int port )
     phys_conn_t *conn = create_phys_conn( hostname, port );
 
     if (!conn) {
-        fprintf( stderr, "Could not create physical connection to %s\n", hostname );
+        logmsg( LL_WARN, "Could not create physical connection to %s\n", hostname );
         return -1;
     }
 
-
-    /* ... */
-
     /*
-     * Extend this function to set up all the necessary information that 
-     * makes it possible to communicate between my_udp_socket and the 
-     * socket on (hostname,port) as if there was a physical connection.
-     *
-     * To do that, you can block in this function, or you can make use of
-     * the select loop.
+     * The host name is resolved in the background, and then an UP
+     * packet is sent. The connection is established when the other
+     * side answers our UP packet. That is handled in l1_handle_event.
      */
-
+    conn->state = RESOLVING;
+    resolver_lookup( hostname, &resolved, conn );
 
     return conn->device;
 }
@@ -154,26 +889,64 @@ int l1_connect( const char* hostname, int port )
  * "physical connection" that is represented by device.
  * A positive return value means the number of bytes that have been
  * sent.
+ * A zero return value means that the shaper holds the frame back, and
+ * the caller should keep it until l2_device_ready() is called.
  * A negative return value means that an error has occured.
  */
 int l1_send( int device, const char* buf, int length )
-{    
-    /* ... */
-    return -1;
-    /* ... */
+{
+    return l1_sendv( device, NULL, 0, buf, length );
+}
 
-    /*
-     * Extend this function so that you send the given data over YOUR
-     * "physical connection" using the function sendto(), the
-     * function delayed_sendto() and the function delayed_dropping_sendto().
-     *
-     * It's easiest to start with sendto(), because it doesn't delay
-     * and it doesn't drop packets randomly.
-     *
-     * delayed_sendto() works very similar to the system function
-     * sendto() but it delays packet delivery in annoying ways.
-     * The same for delayed_dropping_sendto().
-     */
+/*
+ * Like l1_send, for a frame whose header and payload are in two
+ * places. The payload can be shared with other frames.
+ */
+int l1_sendv( int device, const char* hdr, int hlen, const char* buf, int length )
+{
+    phys_conn_t *conn;
+    int          retval;
+
+    if( device < 0 || device >= MAX_CONNS )
+    {
+        return -1;
+    }
+
+    conn = &this_node->l1->my_conns[device];
+    if( conn->state != ESTABLISHED )
+    {
+        return -1;
+    }
+
+    if( !shaper_ready( conn ) )
+    {
+        return 0;
+    }
+
+    retval = send_frame( conn, L1_DATA, hdr, hlen, buf, length );
+    if( retval > 0 )
+    {
+        conn->tokens -= hlen+length+sizeof(struct L1Header);
+    }
+    return retval;
+}
+
+/*
+ * Returns 1 if l1_send can send a frame on the device right now,
+ * 0 if it can't. Layer 2 keeps its frames queued until the device
+ * is ready, and is told by l2_device_ready() when that happens.
+ */
+int l1_ready( int device )
+{
+    if( device < 0 || device >= MAX_CONNS )
+    {
+        return 0;
+    }
+    if( this_node->l1->my_conns[device].state != ESTABLISHED )
+    {
+        return 0;
+    }
+    return shaper_ready( &this_node->l1->my_conns[device] );
 }
 
 /*
@@ -183,61 +956,289 @@ int l1_send( int device, const char* buf, int length )
  * The function should assign a device that is now connected in the
  * table my_conn and print an UP message onto the screen.
  */
-static phys_conn_t *l1_linkup( phys_conn_t *conn, const char* other_hostname, int other_port, int other_address )
+static phys_conn_t *l1_linkup( phys_conn_t *conn, const char* other_hostname, int other_port, int other_address,
+                               unsigned int peer_epoch )
 {
+    struct timeval now;
+    struct timeval grace;
 
     if ( !conn) {
-        /* If the conn parameter was NULL, we need to assign a new device.  */
+        /* If the conn parameter was NULL, we need to assign a new device.
+         * The remote host has told us its address by sending to us.
+         */
+        struct in_addr in;
 
-        /* ... */
+        conn = create_phys_conn( other_hostname, other_port );
+        if( !conn || inet_aton( other_hostname, &in ) == 0 )
+        {
+            return NULL;
+        }
+        set_phys_addr( conn, &in );
    }
 
-    /* ... */
+    conn->state      = ESTABLISHED;
+    conn->peer_epoch = peer_epoch;
+    conn->confirming = 0;
+
+    /* Nothing has been received yet. last_rx lies in the future, so
+     * that the first deadline is later by the time that the first
+     * frame needs.
+     */
+    irq_get_time( &now );
+    first_rx_grace( &grace );
+    timeradd( &now, &grace, &conn->last_rx );
+    l2_linkup( conn->device, conn->remote_hostname, conn->remote_port, other_address );
+    checkpoint_link_up( conn->device, conn->remote_hostname, conn->remote_port,
+                        conn->addr.sin_addr.s_addr, peer_epoch );
 
     return conn;
 }
 
+/*
+ * Receive a frame with its kernel timestamp, which is kept in the
+ * state for l1_rx_time().
+ */
+static int recv_stamped( char* buf, int size, struct sockaddr_in* from )
+{
+    struct L1State* l1 = this_node->l1;
+    char            control[256];
+    struct iovec    iov;
+    struct msghdr   msg;
+    struct cmsghdr* cm;
+    int             len;
+
+    iov.iov_base = buf;
+    iov.iov_len  = size;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_name       = from;
+    msg.msg_namelen    = sizeof(*from);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    l1->rx_stamped = 0;
+    len = fabric_recvmsg( this_node->udp_socket, &msg, MSG_DONTWAIT );
+    if( len < 0 )
+    {
+        return -1;
+    }
+    for( cm=CMSG_FIRSTHDR( &msg ); cm; cm=CMSG_NXTHDR( &msg, cm ) )
+    {
+        if( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPING )
+        {
+            l1->rx_stamped = stamp_time( cm, &l1->rx_time );
+        }
+    }
+    return len;
+}
+
 /*
  * In interrupt occurs when data arrives. Our interrupts are simulated
  * by data-arrival events in the select loop.
- * When select notices that data for my_udp_socket has arrived, it calls
- * this function.
- *
- * A positive return value means that all data has been delivered.
- * A zero return value means that the receiver can not receive the
- * data right now.
- * A negative return value means that an error has occured and
- * receiving failed.
+ * When select notices that data for the UDP socket has arrived, it calls
+ * this function. It reads one frame without blocking, and returns 1
+ * if there was one, 0 if nothing was waiting. The event loop calls it
+ * again until it returns 0 or the budget of the socket is used up.
  *
  * NOTE:
  * Link layer error correction and flow control must be considered
  * here. You will certainly need several helper functions because
  * you will need to perform retransmissions after a timeout.
  */
-void l1_handle_event( )
+int l1_handle_event( )
 {
+    struct L1State*    l1 = this_node->l1;
+    char               space[L1_MAX_FRAME];
+    char*              buf = space;
+    struct sockaddr_in from;
+    socklen_t          fromlen = sizeof(from);
+    const struct L1Header* hdr_pointer;
+    phys_conn_t*       conn;
+    int                len;
+    int                mac;
+    unsigned int       epoch;
 
-    /* ... */
+    if( iothread_running( ) )
+    {
+        len = iothread_recv( &buf, &from );
+    }
+    else if( l1->rx_stamping )
+    {
+        len = recv_stamped( buf, sizeof(space), &from );
+    }
+    else
+    {
+        len = fabric_recvfrom( this_node->udp_socket, buf, sizeof(space), MSG_DONTWAIT,
+                               (struct sockaddr*)&from, &fromlen );
+    }
+    if( len < 0 )
+    {
+        /* The stamps of sent frames make the socket readable too */
+        if( l1->tx_stamping )
+        {
+            drain_tx_stamps( );
+        }
+        return 0;
+    }
+    if( len < (int)sizeof(struct L1Header) )
+    {
+        /* nothing we can use, the physical layer can't report errors */
+        return 1;
+    }
 
-    /*
-     * Write this function so that it can deliver data to layer 2
-     * using l2_recv. You must find the right device identifier to
-     * pass to l2_recv. A good way of finding it is a combination
-     * the system function recvfrom for receiving from the network
-     * and finding the right entry in my_conns.
-     *
-     * This function does not have any return values. The physical
-     * layer can not handle errors, and the interrupt handler can't,
-     * either. The higher level functions must be able to deal with
-     * everything.
+    hdr_pointer = (const struct L1Header*)buf;
+    conn = get_phys_conn( &from );
+
+    if( conn && l1->rx_stamped )
+    {
+        struct timespec now;
+        clock_gettime( CLOCK_REALTIME, &now );
+        record_latency( &conn->rx_latency, &l1->rx_time, &now );
+    }
+
+    /* Any frame after the UP exchange shows that the other side
+     * is alive.
      */
+    if( conn && conn->state == ESTABLISHED
+        && ntohl(hdr_pointer->type) != L1_UP && ntohl(hdr_pointer->type) != L1_UP_ACK )
+    {
+        irq_get_time( &conn->last_rx );
+    }
 
-     /* Should among other functions call if the data that has
-      * arrived was an UP packet.
-      *
-      * The hostname and port that l1_linkup needs are those of
-      * the remote host.
-      *    l2_linkup( hostname, port, mac_address );
-      */
+    switch( ntohl(hdr_pointer->type) )
+    {
+    case L1_UP :
+    case L1_UP_ACK :
+        if( len < (int)(sizeof(struct L1Header)+sizeof(int)) )
+        {
+            return 1;
+        }
+        memcpy( &mac, &buf[sizeof(struct L1Header)], sizeof(int) );
+        mac   = ntohl(mac);
+        epoch = 0;
+        if( len >= (int)(sizeof(struct L1Header)+2*sizeof(int)) )
+        {
+            memcpy( &epoch, &buf[sizeof(struct L1Header)+sizeof(int)], sizeof(int) );
+            epoch = ntohl(epoch);
+        }
+
+        if( conn && conn->state == ESTABLISHED )
+        {
+            conn->confirming = 0;
+            if( conn->peer_epoch != epoch )
+            {
+                /* The other side has started the link over. What we
+                 * have for it is stale, so we start over as well.
+                 */
+                conn->state = DISCONNECTED;
+                checkpoint_link_down( conn->device );
+                l2_linkdown( conn->device );
+            }
+        }
+
+        if( !conn || conn->state != ESTABLISHED )
+        {
+            /* The hostname and port that l1_linkup needs are those of
+             * the remote host.
+             */
+            conn = l1_linkup( conn, inet_ntoa(from.sin_addr), ntohs(from.sin_port), mac, epoch );
+            if( !conn )
+            {
+                return 1;
+            }
+        }
+
+        /* Answer every UP, also repeated ones, because our answer to
+         * the first may have been dropped.
+         */
+        if( ntohl(hdr_pointer->type) == L1_UP )
+        {
+            send_up( conn, L1_UP_ACK );
+        }
+        break;
+
+    case L1_HELLO :
+        /* The other side still thinks that the link is up, but we
+         * have declared it down. Plug it in again.
+         */
+        if( conn && conn->state == DISCONNECTED )
+        {
+            send_up( conn, L1_UP );
+        }
+        break;
+
+    case L1_DATA :
+        if( conn && conn->state == ESTABLISHED )
+        {
+            l2_recv( conn->device,
+                     &buf[sizeof(struct L1Header)],
+                     len-sizeof(struct L1Header) );
+        }
+        break;
+
+    default :
+        break;
+    }
+    return 1;
 }
 
+/*
+ * The time at which the kernel received the frame that is being
+ * handled, for the layers above. Returns 0 if there is none.
+ */
+int l1_rx_time( struct timespec* ts )
+{
+    if( !this_node->l1->rx_stamped )
+    {
+        return 0;
+    }
+    *ts = this_node->l1->rx_time;
+    return 1;
+}
+
+static void print_latency( const char* what, const hdr_t* h )
+{
+    if( h == NULL || h->total == 0 )
+    {
+        return;
+    }
+    fprintf( stderr, "    %s %lu frames, min/avg/p50/p99/max %.1f/%.1f/%.1f/%.1f/%.1f us\n",
+                     what, h->total,
+                     h->min / 1000.0, hdr_mean( h ) / 1000.0,
+                     hdr_percentile( h, 50.0 ) / 1000.0, hdr_percentile( h, 99.0 ) / 1000.0,
+                     h->max / 1000.0 );
+}
+
+/*
+ * Print the latencies of the kernel timestamps per device.
+ */
+void l1_print_stats( )
+{
+    struct L1State* l1 = this_node->l1;
+    phys_conn_t*    conn;
+    int             device;
+
+    if( iothread_running( ) )
+    {
+        iothread_print_stats( );
+    }
+    if( !l1->rx_stamping )
+    {
+        return;
+    }
+    fprintf( stderr, "kernel timestamps: %lu software, %lu hardware, %lu sent frames not matched\n",
+                     l1->sw_stamps, l1->hw_stamps, l1->tx_unmatched );
+    for( device=0; device<l1->num_conns; device++ )
+    {
+        conn = &l1->my_conns[device];
+        if( conn->rx_latency == NULL && conn->tx_latency == NULL )
+        {
+            continue;
+        }
+        fprintf( stderr, "device %d (%s:%d):\n", device,
+                         conn->remote_hostname ? conn->remote_hostname : "-", conn->remote_port );
+        print_latency( "kernel to user", conn->rx_latency );
+        print_latency( "user to kernel", conn->tx_latency );
+    }
+}
@@ -2,6 +2,8 @@
 #define L1_PHYS_H
 
 #include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
 
 struct PhysicalConnection
 {
@@ -9,9 +11,26 @@ struct PhysicalConnection
     char* remote_hostname;
     int   remote_port;
     struct sockaddr_in addr;
+    struct timeval last_rx;   /* when we last heard from the other side */
+
+    /* Changes when a side starts the link over, see send_up() */
+    unsigned int   epoch;
+    unsigned int   peer_epoch;
+    int            confirming;    /* restored, repeat UP until the other side answers */
+    int            up_timer;      /* -1 unless UP is repeated, see retry_up() */
+
+    /* egress shaper, see l1_set_shaper() */
+    double         tokens;        /* bytes */
+    struct timeval refilled;
+    int            shaper_timer;  /* -1 unless waiting for tokens */
+
+    /* kernel timestamps, see l1_set_timestamping(), in ns */
+    struct Hdr*    rx_latency;    /* from the kernel to l1_handle_event */
+    struct Hdr*    tx_latency;    /* from send_frame to the kernel */
 
     enum {
         UNASSIGNED = 0,
+        RESOLVING,
         CONNECTING,
         ESTABLISHED,
         DISCONNECTED,
@@ -21,18 +40,37 @@ struct PhysicalConnection
 typedef struct PhysicalConnection phys_conn_t;
 
 /*
- * This is the one UDP socket that is used for all sending
- * and receiving. The select loop must know it.
+ * The ways of putting frames onto the "cable", see l1_set_wire().
+ */
+enum
+{
+    WIRE_PLAIN = 0,
+    WIRE_DELAYED,
+    WIRE_DELAYED_DROPPING
+};
+
+/*
+ * The one UDP socket that is used for all sending and receiving
+ * is kept in the node (this_node->udp_socket). The select loop
+ * must know it.
  */
-extern int my_udp_socket;
 
 /* see more comments in the c file */
 
-void l1_init( int local_port );
+void l1_set_wire( int wire );
+void l1_set_liveness( int interval_ms, int detect_mult );
+void l1_set_shaper( int rate, int burst );
+void l1_set_timestamping( int on );
+void l1_set_io_thread( int on );
+void l1_init( int local_port, int local_mac_address );
 int  l1_connect( const char* hostname, int port );
 void l1_req_physical_connection( const char* hostname, int port );
 int  l1_send( int device, const char* buf, int length );
-void l1_handle_event( );
+int  l1_sendv( int device, const char* hdr, int hlen, const char* buf, int length );
+int  l1_ready( int device );
+int  l1_handle_event( );
+int  l1_rx_time( struct timespec* ts );
+void l1_print_stats( );
 
 #endif /* L1_PHYS_H */
 
@@ -2,30 +2,1448 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
+#include <math.h>
 
+#include "irq.h"
+#include "node.h"
 #include "l1_phys.h"
 #include "l2_link.h"
 #include "l3_net.h"
+#include "varint.h"
+#include "fec.h"
+#include "logger.h"
+#include "checkpoint.h"
 
 #define MAX_ADDRESSES 1024
+#define MAX_DEVICES   1024
 
 /*
- * The MAC header. It is included in every frame.
- * You must extend it for your needs.
+ * Credit-based flow control. The receiver of a link has room for
+ * RX_BUFFER frames that the network layer has not accepted yet. It
+ * tells the sender up to which sequence number it may send (the
+ * limit) in every frame that goes the other way, and in CREDIT
+ * frames when nothing else goes the other way. The sender keeps
+ * frames in its own queue while it has no credit, instead of sending
+ * them into a full buffer where they would be lost.
+ */
+#define RX_BUFFER        32   /* frames */
+#define CREDIT_STEP      (RX_BUFFER/4)
+#define RETRY_INTERVAL   10   /* ms until we offer a refused frame again */
+#define PERSIST_INTERVAL 500  /* ms until we ask for lost credit */
+#define PERSIST_MAX      8000 /* ms, the persist interval doubles up to this */
+
+/*
+ * Egress scheduling. Every device has three levels of queues, and a
+ * lower level is only served when the levels above it are empty:
+ *   1. our own CREDIT and PROBE frames,
+ *   2. frames that the layers above have marked as control traffic,
+ *   3. data frames, hashed into NUM_FLOWS flow queues that share
+ *      the link by deficit round robin (DRR_QUANTUM bytes per round).
+ * Whenever the physical layer is ready, drain() takes the next frame.
+ */
+#define NUM_FLOWS        16
+#define FLOW_HASH_BYTES  16   /* of the payload, if it has no static header */
+#define DRR_QUANTUM      1500
+
+/*
+ * Active queue management. Data frames that have waited longer than
+ * the CoDel target for a whole interval start being dropped, more
+ * often the longer the delay stays above the target. The queues of
+ * a device are also limited to L2_QUEUE_LIMIT frames.
+ */
+#define L2_QUEUE_LIMIT   1024
+#define CODEL_MTU        1500
+
+/*
+ * Header compression. The first bytes of a packet from layer 3, its
+ * header and the ports of layer 4, are the same for all packets of a
+ * flow (l3_static_header_len). When header compression is switched
+ * on, the sender keeps L2_CONTEXTS such static headers per link. A
+ * frame with a new static header carries it in full, together with
+ * the context ID that it is assigned to (CTX_FULL). The receiver
+ * stores it and reports which contexts it has in an ECHO field of
+ * the frames that go back. Frames of confirmed contexts carry only
+ * the context ID (CTX). A context ID has a 4 bit generation, so that
+ * a frame for a context that has been reused is not expanded with
+ * the wrong header. The receiver forgets a context when that
+ * happens, and the sender goes back to full headers.
+ */
+#define L2_CONTEXTS      16
+#define L2_MAX_STATIC    32   /* bytes of a static header */
+#define ECHO_EVERY       16   /* frames, also when nothing has changed */
+
+/*
+ * Forward error correction. When it is switched on, the sender adds
+ * parity frames (L2_PARITY, see fec.c) to every block of fec_block
+ * data frames. The data frames of a protected block have L2_F_FEC
+ * set. If a block loses no more data frames than it has parity
+ * frames, the receiver rebuilds the lost frames without a round
+ * trip. It holds the frames after a gap meanwhile, so that layer 3
+ * still gets them in order. It gives up on a gap when the parity of
+ * a later block arrives, or after FEC_HOLD ms.
+ * The receiver reports the loss that it sees in REPORT frames. The
+ * sender picks the number of parity frames per block from it, so
+ * that a block can't be repaired with a probability below FEC_TARGET.
+ * One parity frame is a plain XOR of the block.
+ */
+#define FEC_FLUSH        20     /* ms until an incomplete block is closed */
+#define FEC_HOLD         100    /* ms that frames wait for a repair */
+#define FEC_WINDOW       32     /* frames the receiver keeps, a power of 2 */
+#define FEC_REPORT_EVERY 64     /* frames between two loss reports */
+#define FEC_TARGET       0.001
+#define FEC_PARITY_HDR   7      /* start, n, k, index, symbol length */
+#define FEC_MAX_SYMBOL   60000
+
+/*
+ * The MAC header. It is included in every frame. On the wire it is
+ * packed:
+ *   type, flags          1 byte
+ *   src and dst MAC      varints
+ *   seq                  the lowest 16 bits, L2_DATA only
+ *   limit                the lowest 16 bits
+ *   known, parity        16 bits each, with L2_F_ECHO
+ *   context ID           1 byte, with L2_F_CTX or L2_F_CTX_FULL
+ *   static header length 1 byte, with L2_F_CTX_FULL
  */
 struct L2Header
 {
-    int src_mac_address;
-    int dst_mac_address;
-};
+    int src_mac_address;
+    int dst_mac_address;
+    int type;
+    int flags;
+    unsigned int seq;     /* L2_DATA only */
+    unsigned int limit;   /* the sender of this frame accepts seq < limit */
+    unsigned int known;   /* ECHO: the contexts that the sender has */
+    unsigned int parity;  /* ECHO: the lowest bit of their generations */
+    int cid;              /* context index and generation << 4 */
+    int static_len;
+};
+
+#define L2_F_ECHO        0x10
+#define L2_F_CTX         0x20
+#define L2_F_CTX_FULL    0x40
+#define L2_F_FEC         0x80
+#define L2_TYPE_MASK     0x0f
+
+#define L2_MAX_HEADER    (1 + 2*VARINT_MAX + 2 + 2 + 4 + 2)
+
+enum
+{
+    L2_DATA = 1,
+    L2_CREDIT,            /* no payload, only the limit */
+    L2_PROBE,             /* no payload, asks for a CREDIT frame */
+    L2_PARITY,            /* a parity frame of FEC */
+    L2_REPORT             /* the loss that the receiver sees, for FEC */
+};
+
+/*
+ * A frame that waits in a queue. The payload is in data, or in a
+ * buffer that is shared with the frames to other neighbours
+ * (l2_send_buf). The header is made when the frame is sent, and the
+ * physical layer gathers both.
+ */
+struct L2Frame
+{
+    int             length;     /* of the payload */
+    long long       enqueued;   /* us, for the queue delay */
+    long long       stalled;    /* credit_stalled of the device then */
+    l2buf_t*        shared;     /* NULL if the payload is in data */
+    struct L2Frame* next;
+    char            data[];
+};
+typedef struct L2Frame frame_t;
+
+/*
+ * A static header of header compression.
+ */
+struct L2Context
+{
+    int          used;
+    int          gen;
+    int          length;
+    unsigned int last_used;
+    char         header[L2_MAX_STATIC];
+};
+typedef struct L2Context l2ctx_t;
+
+/*
+ * A data frame that the receiver keeps for FEC: to rebuild other
+ * frames of its block, or because it waits for a repair in front of
+ * it.
+ */
+struct L2Kept
+{
+    int          valid;
+    unsigned int seq;
+    int          length;
+    char*        data;
+};
+typedef struct L2Kept l2kept_t;
+
+/*
+ * The data frames of the flows that hash to the same value.
+ */
+struct FlowQueue
+{
+    frame_t*     head;
+    frame_t*     tail;
+    int          deficit;
+    int          active;        /* in the round of the DRR scheduler */
+    int          next_active;
+};
+typedef struct FlowQueue flowq_t;
+
+/*
+ * The flow control and scheduling state of one link.
+ */
+struct L2Device
+{
+    int          device;
+    int          src_mac_address;
+    int          dst_mac_address;
+
+    /* sending */
+    unsigned int next_seq;
+    unsigned int peer_limit;
+    int          credit_pending;  /* send a CREDIT frame */
+    int          probe_pending;   /* send a PROBE frame */
+    frame_t*     ctl_head;        /* control traffic of the layers above */
+    frame_t*     ctl_tail;
+    flowq_t      flows[NUM_FLOWS];
+    int          active_head;     /* the DRR round, -1 if empty */
+    int          active_tail;
+    int          tx_len;          /* frames in ctl and flows */
+    int          persist_timer;
+    int          persist_ms;
+
+    /* CoDel on the data queues, times in us */
+    int          data_bytes;
+    long long    first_above_time;
+    long long    drop_next;
+    int          drop_count;
+    int          dropping;
+
+    /* Time that data has waited for credit. Flow control holds frames
+     * back on purpose, so CoDel doesn't count it as queue delay.
+     */
+    long long    credit_stalled;
+    long long    stall_start;     /* 0 unless waiting for credit now */
+
+    /* header compression */
+    l2ctx_t      tx_ctx[L2_CONTEXTS];
+    unsigned int ctx_clock;
+    unsigned int peer_known;      /* from the last ECHO */
+    unsigned int peer_parity;
+    l2ctx_t      rx_ctx[L2_CONTEXTS];
+    int          echo_pending;
+    int          echo_countdown;
+
+    /* FEC, sending */
+    int          fec_parity;      /* parity frames per block */
+    double       fec_loss;        /* as reported by the receiver */
+    int          fec_k;           /* parity frames of the current block */
+    int          fec_n;           /* data frames in the current block */
+    unsigned int fec_start;       /* seq of its first data frame */
+    frame_t*     fec_data[FEC_MAX_DATA];
+    int          fec_timer;
+    frame_t*     par_head;        /* parity frames to send */
+    frame_t*     par_tail;
+
+    /* FEC, receiving */
+    int          fec_started;
+    unsigned int deliver_next;    /* the next seq for layer 3 */
+    l2kept_t     kept[FEC_WINDOW];
+    int          held;            /* kept frames that wait for a gap */
+    int          hold_timer;
+    unsigned int par_start;       /* the block of the parity frames we have */
+    int          par_n;
+    int          par_len;
+    int          par_count;
+    int          par_index[FEC_MAX_PARITY];
+    unsigned char* par_data[FEC_MAX_PARITY];
+    unsigned int loss_expected;
+    unsigned int loss_lost;
+    int          report_pending;
+    int          report_value;    /* loss in 1/10000 */
+
+    /* receiving */
+    unsigned int rcv_next;      /* one after the highest seq received */
+    unsigned int advertised;    /* the limit that we have sent last */
+    frame_t*     rx_head;       /* frames the network layer refused */
+    frame_t*     rx_tail;
+    int          rx_len;
+    int          retry_timer;
+
+    /* statistics */
+    unsigned long tx_frames;
+    unsigned long tx_bytes;
+    unsigned long tail_drops;
+    unsigned long codel_drops;
+    long long     delay_sum;      /* us that sent data frames have queued */
+    long long     delay_max;
+    unsigned long rx_frames;
+    unsigned long rx_refused;     /* not taken by the network layer at once */
+    unsigned long rx_overflows;
+    long long     hdr_bytes;      /* L2 headers sent */
+    long long     ctx_saved;      /* static header bytes not sent */
+    unsigned long ctx_misses;     /* frames for a context we don't have */
+    unsigned long fec_sent;       /* parity frames */
+    unsigned long fec_repaired;
+    unsigned long fec_lost;       /* gaps that could not be repaired */
+};
+typedef struct L2Device l2dev_t;
+
+/*
+ * The CoDel parameters, the same for all nodes. A target of 0
+ * switches CoDel off.
+ */
+static long long codel_target   = 5000;     /* us */
+static long long codel_interval = 100000;   /* us */
+
+/*
+ * Whether header compression is used, the same for all nodes.
+ */
+static int header_compression = 0;
+
+/*
+ * FEC parameters, the same for all nodes. A block of 0 switches FEC
+ * off.
+ */
+static int fec_block      = 0;
+static int fec_max_parity = 0;
+
+/*
+ * The link layer needs to maintain private information about
+ * the MAC address at the other end of every link.
+ * The map is kept in the node's private L2 state because it is
+ * inappropriate for other layers to see or change it.
+ */
+struct L2State
+{
+    link_entry_t mac_to_device_map[MAX_ADDRESSES];
+    l2dev_t*     devices[MAX_DEVICES];
+};
+
+static void drain( l2dev_t* d );
+static void new_device( int device, int mac, int other_mac_address );
+
+/* sequence numbers wrap around */
+static int seq_before( unsigned int a, unsigned int b )
+{
+    return (int)(a - b) < 0;
+}
+
+static void timer_in( int* timer, int ms, void (*cb)(void*), void* param )
+{
+    struct timeval now;
+    struct timeval delay;
+
+    delay.tv_sec  = ms / 1000;
+    delay.tv_usec = (ms % 1000) * 1000;
+    irq_get_time( &now );
+    timeradd( &now, &delay, &now );
+    *timer = register_timeout_cb( now, cb, param );
+}
+
+static long long now_us( )
+{
+    struct timeval now;
+    irq_get_time( &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static frame_t* frame_alloc( int length )
+{
+    frame_t* f = (frame_t*)malloc( sizeof(frame_t) + length );
+    if( f )
+    {
+        f->length   = length;
+        f->enqueued = now_us( );
+        f->stalled  = 0;
+        f->shared   = NULL;
+        f->next     = NULL;
+    }
+    return f;
+}
+
+static void frame_free( frame_t* f )
+{
+    if( f->shared )
+    {
+        l2_buf_put( f->shared );
+    }
+    free( f );
+}
+
+static char* payload( frame_t* f )
+{
+    return f->shared ? f->shared->data : f->data;
+}
+
+static void frame_append( frame_t** head, frame_t** tail, frame_t* f )
+{
+    f->next = NULL;
+    if( *tail ) (*tail)->next = f;
+    else        *head = f;
+    *tail = f;
+}
+
+static frame_t* frame_pop( frame_t** head, frame_t** tail )
+{
+    frame_t* f = *head;
+    if( f )
+    {
+        *head = f->next;
+        if( *head == NULL ) *tail = NULL;
+        f->next = NULL;
+    }
+    return f;
+}
+
+/*
+ * The limit that we grant to the other side: everything it has sent
+ * so far, plus as many frames as we have free buffers.
+ */
+static unsigned int rx_limit( l2dev_t* d )
+{
+    return d->rcv_next + (RX_BUFFER - d->rx_len - d->held);
+}
+
+/*
+ * Find or make the compression context of a frame's static header.
+ * Returns its index, or -1 if the frame has no static header.
+ */
+static int tx_context( l2dev_t* d, const char* buf, int length )
+{
+    int      n = l3_static_header_len( buf, length );
+    l2ctx_t* c;
+    int      i;
+    int      victim = 0;
+
+    if( n <= 0 || n > L2_MAX_STATIC )
+    {
+        return -1;
+    }
+
+    for( i=0; i<L2_CONTEXTS; i++ )
+    {
+        c = &d->tx_ctx[i];
+        if( c->used && c->length == n && !memcmp( c->header, buf, n ) )
+        {
+            c->last_used = ++d->ctx_clock;
+            return i;
+        }
+        if( !c->used || (d->tx_ctx[victim].used && c->last_used < d->tx_ctx[victim].last_used) )
+        {
+            victim = i;
+        }
+    }
+
+    /* replace the least recently used context */
+    c = &d->tx_ctx[victim];
+    c->used      = 1;
+    c->gen       = (c->gen + 1) & 0xf;
+    c->length    = n;
+    c->last_used = ++d->ctx_clock;
+    memcpy( c->header, buf, n );
+    return victim;
+}
+
+/* does the other side have context i as we know it? */
+static int tx_context_confirmed( l2dev_t* d, int i )
+{
+    return ((d->peer_known >> i) & 1) && ((d->peer_parity >> i) & 1) == (d->tx_ctx[i].gen & 1);
+}
+
+static int echo_due( l2dev_t* d )
+{
+    if( d->echo_pending )
+    {
+        return 1;
+    }
+    if( !header_compression )
+    {
+        return 0;
+    }
+    return --d->echo_countdown <= 0;
+}
+
+/*
+ * Make the header of a frame and hand it with the payload to the
+ * physical layer. Every frame carries our current limit.
+ */
+static int transmit( l2dev_t* d, const char* data, int length, int type, unsigned int seq )
+{
+    unsigned char hdr[L2_MAX_HEADER];
+    int           hlen;
+    int           flags = 0;
+    int           cid   = -1;
+    unsigned int  known = 0;
+    unsigned int  parity = 0;
+    int           i;
+
+    d->advertised = rx_limit( d );
+
+    if( type == L2_DATA && header_compression )
+    {
+        cid = tx_context( d, data, length );
+        if( cid >= 0 )
+        {
+            flags |= tx_context_confirmed( d, cid ) ? L2_F_CTX : L2_F_CTX_FULL;
+        }
+    }
+    if( echo_due( d ) )
+    {
+        flags |= L2_F_ECHO;
+    }
+    if( type == L2_DATA && d->fec_k > 0 )
+    {
+        flags |= L2_F_FEC;
+    }
+
+    hdr[0] = type | flags;
+    hlen   = 1;
+    hlen  += varint_put( &hdr[hlen], d->src_mac_address );
+    hlen  += varint_put( &hdr[hlen], d->dst_mac_address );
+    if( type == L2_DATA )
+    {
+        put16( &hdr[hlen], seq );
+        hlen += 2;
+    }
+    put16( &hdr[hlen], d->advertised );
+    hlen += 2;
+
+    if( flags & L2_F_ECHO )
+    {
+        for( i=0; i<L2_CONTEXTS; i++ )
+        {
+            if( d->rx_ctx[i].used )
+            {
+                known  |= 1 << i;
+                parity |= (d->rx_ctx[i].gen & 1) << i;
+            }
+        }
+        put16( &hdr[hlen], known );
+        put16( &hdr[hlen+2], parity );
+        hlen += 4;
+        d->echo_pending   = 0;
+        d->echo_countdown = ECHO_EVERY;
+    }
+
+    if( flags & (L2_F_CTX | L2_F_CTX_FULL) )
+    {
+        hdr[hlen++] = cid | d->tx_ctx[cid].gen << 4;
+    }
+    if( flags & L2_F_CTX )
+    {
+        data        += d->tx_ctx[cid].length;
+        length      -= d->tx_ctx[cid].length;
+        d->ctx_saved += d->tx_ctx[cid].length;
+    }
+    else if( flags & L2_F_CTX_FULL )
+    {
+        hdr[hlen++] = d->tx_ctx[cid].length;
+    }
+
+    d->hdr_bytes += hlen;
+    return l1_sendv( d->device, (char*)hdr, hlen, data, length );
+}
+
+/*
+ * Parse a packed header. Sequence numbers are expanded to what we
+ * expect. Returns the length of the header, or -1 if it is broken.
+ */
+static int parse_header( l2dev_t* d, const unsigned char* buf, int length, struct L2Header* hdr )
+{
+    unsigned int v;
+    int          hlen = 1;
+    int          n;
+
+    memset( hdr, 0, sizeof(struct L2Header) );
+    if( length < 1 )
+    {
+        return -1;
+    }
+    hdr->type  = buf[0] & L2_TYPE_MASK;
+    hdr->flags = buf[0] & ~L2_TYPE_MASK;
+
+    if( (n = varint_get( &buf[hlen], length-hlen, &v )) < 0 ) return -1;
+    hdr->src_mac_address = v;
+    hlen += n;
+    if( (n = varint_get( &buf[hlen], length-hlen, &v )) < 0 ) return -1;
+    hdr->dst_mac_address = v;
+    hlen += n;
+
+    n = 2 + (hdr->type == L2_DATA ? 2 : 0)
+          + (hdr->flags & L2_F_ECHO ? 4 : 0)
+          + (hdr->flags & (L2_F_CTX | L2_F_CTX_FULL) ? 1 : 0)
+          + (hdr->flags & L2_F_CTX_FULL ? 1 : 0);
+    if( hlen + n > length )
+    {
+        return -1;
+    }
+
+    if( hdr->type == L2_DATA )
+    {
+        hdr->seq = expand16( get16( &buf[hlen] ), d->rcv_next );
+        hlen += 2;
+    }
+    hdr->limit = expand16( get16( &buf[hlen] ), d->peer_limit );
+    hlen += 2;
+    if( hdr->flags & L2_F_ECHO )
+    {
+        hdr->known  = get16( &buf[hlen] );
+        hdr->parity = get16( &buf[hlen+2] );
+        hlen += 4;
+    }
+    if( hdr->flags & (L2_F_CTX | L2_F_CTX_FULL) )
+    {
+        hdr->cid = buf[hlen++];
+    }
+    if( hdr->flags & L2_F_CTX_FULL )
+    {
+        hdr->static_len = buf[hlen++];
+    }
+    return hlen;
+}
+
+static int send_control( l2dev_t* d, int type )
+{
+    return transmit( d, NULL, 0, type, 0 );
+}
+
+/*
+ * Grant new credit when enough buffers have become free since the
+ * last grant. Small steps are not worth a frame of their own.
+ */
+static void maybe_send_credit( l2dev_t* d )
+{
+    if( (int)(rx_limit( d ) - d->advertised) >= CREDIT_STEP )
+    {
+        d->credit_pending = 1;
+        drain( d );
+    }
+}
+
+static int has_credit( l2dev_t* d )
+{
+    return seq_before( d->next_seq, d->peer_limit );
+}
+
+static int data_queued( l2dev_t* d )
+{
+    return d->ctl_head != NULL || d->active_head >= 0;
+}
+
+/*
+ * Pick the flow queue for a data frame by hashing the beginning of
+ * its payload, which holds the addresses and ports of the layers
+ * above. Frames of one flow stay in order.
+ */
+static int flow_hash( const char* buf, int length )
+{
+    unsigned int h = 2166136261u;
+    int          n = l3_static_header_len( buf, length );
+    int          i;
+
+    if( n <= 0 )
+    {
+        n = FLOW_HASH_BYTES;
+    }
+    for( i=0; i<length && i<n; i++ )
+    {
+        h = (h ^ (unsigned char)buf[i]) * 16777619u;
+    }
+    return h % NUM_FLOWS;
+}
+
+static void enqueue_data( l2dev_t* d, frame_t* f, int flow )
+{
+    flowq_t* q = &d->flows[flow];
+
+    d->data_bytes += f->length;
+    f->stalled     = d->credit_stalled;
+    if( d->stall_start ) f->stalled += f->enqueued - d->stall_start;
+    frame_append( &q->head, &q->tail, f );
+    if( !q->active )
+    {
+        q->active      = 1;
+        q->deficit     = 0;
+        q->next_active = -1;
+        if( d->active_tail >= 0 ) d->flows[d->active_tail].next_active = flow;
+        else                      d->active_head = flow;
+        d->active_tail = flow;
+    }
+}
+
+/*
+ * Deficit round robin: the flow at the head of the round may send
+ * while its deficit covers the next frame. Otherwise it gets another
+ * quantum and goes to the end of the round. Flows that have become
+ * empty leave the round.
+ */
+static frame_t* dequeue_data( l2dev_t* d )
+{
+    flowq_t* q;
+    frame_t* f;
+    int      flow;
+
+    for( ;; )
+    {
+        flow = d->active_head;
+        if( flow < 0 )
+        {
+            return NULL;
+        }
+        q = &d->flows[flow];
+
+        if( q->deficit >= q->head->length )
+        {
+            f = frame_pop( &q->head, &q->tail );
+            q->deficit -= f->length;
+            d->data_bytes -= f->length;
+            d->tx_len--;
+            if( q->head == NULL )
+            {
+                q->active      = 0;
+                d->active_head = q->next_active;
+                if( d->active_head < 0 ) d->active_tail = -1;
+            }
+            return f;
+        }
+
+        q->deficit += DRR_QUANTUM;
+        if( q->next_active >= 0 )
+        {
+            d->active_head = q->next_active;
+            d->flows[d->active_tail].next_active = flow;
+            d->active_tail = flow;
+            q->next_active = -1;
+        }
+    }
+}
+
+/*
+ * Timeout callback: we have frames to send but no credit. Either the
+ * receiver is still busy, or the frame with its credit got lost. Ask
+ * again, less often every time.
+ */
+static void persist( void* param )
+{
+    l2dev_t* d = (l2dev_t*)param;
+
+    d->persist_timer = -1;
+    if( !data_queued( d ) || has_credit( d ) )
+    {
+        return;
+    }
+
+    /* drain() starts the timer again, with the longer interval */
+    if( d->persist_ms < PERSIST_MAX ) d->persist_ms *= 2;
+    d->probe_pending = 1;
+    drain( d );
+}
+
+/*
+ * CoDel: is the frame's queue delay above the target, and has it
+ * been above the target for at least an interval? The time that it
+ * has waited for credit doesn't count.
+ */
+static int codel_should_drop( l2dev_t* d, frame_t* f, long long now )
+{
+    long long sojourn = now - f->enqueued - (d->credit_stalled - f->stalled);
+
+    if( sojourn < codel_target || d->data_bytes <= CODEL_MTU )
+    {
+        d->first_above_time = 0;
+        return 0;
+    }
+    if( d->first_above_time == 0 )
+    {
+        d->first_above_time = now + codel_interval;
+        return 0;
+    }
+    return now >= d->first_above_time;
+}
+
+/* drops become more frequent with the square root of their count */
+static long long codel_control_law( long long t, int count )
+{
+    return t + (long long)(codel_interval / sqrt( (double)count ));
+}
+
+static void codel_drop( l2dev_t* d, frame_t* f )
+{
+    d->codel_drops++;
+    frame_free( f );
+}
+
+/*
+ * Take the next data frame, and drop frames on the way while CoDel
+ * is in its dropping state. This follows the pseudo code of RFC 8289.
+ */
+static frame_t* codel_dequeue( l2dev_t* d )
+{
+    long long now = now_us( );
+    frame_t*  f   = dequeue_data( d );
+    int       ok_to_drop;
+
+    if( f == NULL )
+    {
+        d->dropping = 0;
+        return NULL;
+    }
+    if( codel_target == 0 )
+    {
+        return f;
+    }
+
+    ok_to_drop = codel_should_drop( d, f, now );
+    if( d->dropping )
+    {
+        if( !ok_to_drop )
+        {
+            d->dropping = 0;
+        }
+        while( d->dropping && now >= d->drop_next )
+        {
+            codel_drop( d, f );
+            d->drop_count++;
+            f = dequeue_data( d );
+            if( f == NULL || !codel_should_drop( d, f, now ) )
+            {
+                d->dropping = 0;
+            }
+            else
+            {
+                d->drop_next = codel_control_law( d->drop_next, d->drop_count );
+            }
+        }
+    }
+    else if( ok_to_drop )
+    {
+        codel_drop( d, f );
+        f = dequeue_data( d );
+        d->dropping = 1;
+
+        /* start where we left off if we were dropping recently */
+        if( d->drop_count > 2 && now - d->drop_next < 16*codel_interval )
+            d->drop_count -= 2;
+        else
+            d->drop_count = 1;
+        d->drop_next = codel_control_law( now, d->drop_count );
+    }
+    return f;
+}
+
+/*
+ * FEC, sending. The parity of a block is chosen when its first data
+ * frame is sent.
+ */
+static void fec_begin( l2dev_t* d )
+{
+    if( d->fec_n == 0 )
+    {
+        d->fec_k = fec_block ? d->fec_parity : 0;
+    }
+}
+
+/*
+ * Close the current block: compute its parity frames and queue them.
+ * A data symbol is the length of a frame (2 bytes) and the frame,
+ * padded with zeros to the longest frame of the block.
+ */
+static void fec_close( l2dev_t* d )
+{
+    unsigned char  len16[2];
+    unsigned char* p;
+    frame_t*       f;
+    int            length = 0;
+    int            i, j;
+
+    if( d->fec_timer >= 0 )
+    {
+        remove_timeout( d->fec_timer );
+        d->fec_timer = -1;
+    }
+
+    for( i=0; i<d->fec_n; i++ )
+    {
+        if( d->fec_data[i]->length + 2 > length ) length = d->fec_data[i]->length + 2;
+    }
+
+    for( j=0; j<d->fec_k && length <= FEC_MAX_SYMBOL; j++ )
+    {
+        f = frame_alloc( FEC_PARITY_HDR + length );
+        if( f == NULL )
+        {
+            break;
+        }
+        p = (unsigned char*)payload( f );
+        put16( p, d->fec_start );
+        p[2] = d->fec_n;
+        p[3] = d->fec_k;
+        p[4] = j;
+        put16( p+5, length );
+
+        p += FEC_PARITY_HDR;
+        memset( p, 0, length );
+        for( i=0; i<d->fec_n; i++ )
+        {
+            put16( len16, d->fec_data[i]->length );
+            gf_mul_add( p, len16, fec_coef( j, i ), 2 );
+            gf_mul_add( p+2, (unsigned char*)payload( d->fec_data[i] ), fec_coef( j, i ),
+                        d->fec_data[i]->length );
+        }
+        frame_append( &d->par_head, &d->par_tail, f );
+    }
+
+    for( i=0; i<d->fec_n; i++ )
+    {
+        frame_free( d->fec_data[i] );
+    }
+    d->fec_n = 0;
+}
+
+/*
+ * Timeout callback: nothing more has been sent for a while, send the
+ * parity of the incomplete block.
+ */
+static void fec_flush( void* param )
+{
+    l2dev_t* d = (l2dev_t*)param;
+
+    d->fec_timer = -1;
+    if( d->fec_n > 0 )
+    {
+        fec_close( d );
+        drain( d );
+    }
+}
+
+/*
+ * Keep a data frame that has been sent for the parity of its block,
+ * or free it if the block is not protected.
+ */
+static void fec_add( l2dev_t* d, frame_t* f, unsigned int seq )
+{
+    if( d->fec_k == 0 )
+    {
+        frame_free( f );
+        return;
+    }
+    if( d->fec_n == 0 )
+    {
+        d->fec_start = seq;
+        timer_in( &d->fec_timer, FEC_FLUSH, &fec_flush, d );
+    }
+    d->fec_data[d->fec_n++] = f;
+    if( d->fec_n == fec_block )
+    {
+        fec_close( d );
+    }
+}
+
+/*
+ * The number of parity frames that a block of n data frames needs,
+ * so that more than that many of its n+k frames are lost with a
+ * probability below FEC_TARGET, when frames are lost with
+ * probability p.
+ */
+static int parity_needed( double p, int n, int max )
+{
+    double term, sum;
+    int    k, i;
+
+    if( p > 0.5 ) p = 0.5;
+    for( k=0; k<max; k++ )
+    {
+        /* P(at most k losses), binomial(n+k, p) */
+        term = pow( 1-p, n+k );
+        sum  = term;
+        for( i=1; i<=k; i++ )
+        {
+            term *= (double)(n+k-i+1) / i * p / (1-p);
+            sum  += term;
+        }
+        if( 1 - sum < FEC_TARGET )
+        {
+            return k;
+        }
+    }
+    return max;
+}
+
+static void send_report( l2dev_t* d )
+{
+    unsigned char value[2];
+
+    put16( value, d->report_value );
+    transmit( d, (char*)value, 2, L2_REPORT, 0 );
+}
+
+/*
+ * The drain loop: feed the physical layer with the next frame from
+ * the highest level that has something to send, as long as it is
+ * ready. Data frames also need credit from the receiver.
+ */
+static void drain( l2dev_t* d )
+{
+    frame_t*  f;
+    long long delay;
+
+    if( d->stall_start )
+    {
+        d->credit_stalled += now_us( ) - d->stall_start;
+        d->stall_start     = 0;
+    }
+
+    while( l1_ready( d->device ) )
+    {
+        if( d->credit_pending )
+        {
+            d->credit_pending = 0;
+            send_control( d, L2_CREDIT );
+            continue;
+        }
+        if( d->probe_pending )
+        {
+            d->probe_pending = 0;
+            send_control( d, L2_PROBE );
+            continue;
+        }
+        if( d->report_pending )
+        {
+            d->report_pending = 0;
+            send_report( d );
+            continue;
+        }
+
+        /* parity frames don't take room at the receiver, no credit */
+        f = frame_pop( &d->par_head, &d->par_tail );
+        if( f != NULL )
+        {
+            transmit( d, payload( f ), f->length, L2_PARITY, 0 );
+            d->fec_sent++;
+            frame_free( f );
+            continue;
+        }
+
+        if( !has_credit( d ) )
+        {
+            break;
+        }
+
+        f = frame_pop( &d->ctl_head, &d->ctl_tail );
+        if( f != NULL )
+        {
+            d->tx_len--;
+        }
+        else
+        {
+            f = codel_dequeue( d );
+        }
+        if( f == NULL )
+        {
+            break;
+        }
+
+        delay = now_us( ) - f->enqueued;
+        d->tx_frames++;
+        d->tx_bytes  += f->length;
+        d->delay_sum += delay;
+        if( delay > d->delay_max ) d->delay_max = delay;
+
+        fec_begin( d );
+        transmit( d, payload( f ), f->length, L2_DATA, d->next_seq );
+        fec_add( d, f, d->next_seq++ );
+    }
+
+    if( data_queued( d ) && !has_credit( d ) )
+    {
+        d->stall_start = now_us( );
+        if( d->persist_timer < 0 )
+        {
+            timer_in( &d->persist_timer, d->persist_ms, &persist, d );
+        }
+    }
+}
+
+/*
+ * Offer the frames that the network layer has refused before once
+ * more, in order, until it refuses again.
+ */
+static void deliver_queued( l2dev_t* d )
+{
+    frame_t* f;
+    int      err;
+
+    while( (f = d->rx_head) != NULL )
+    {
+        err = l3_recv( d->dst_mac_address, payload( f ), f->length );
+        if( err == 0 )
+        {
+            break;
+        }
+        frame_pop( &d->rx_head, &d->rx_tail );
+        d->rx_len--;
+        frame_free( f );
+    }
+
+    maybe_send_credit( d );
+}
+
+/*
+ * Timeout callback: the network layer was too slow, try again.
+ */
+static void retry_deliver( void* param )
+{
+    l2dev_t* d = (l2dev_t*)param;
+
+    d->retry_timer = -1;
+    deliver_queued( d );
+    if( d->rx_head )
+    {
+        timer_in( &d->retry_timer, RETRY_INTERVAL, &retry_deliver, d );
+    }
+}
+
+/*
+ * Give a data frame to the network layer, or keep it if the network
+ * layer refuses it.
+ */
+static void deliver_up( l2dev_t* d, const char* buf, int length )
+{
+    frame_t* f;
+    int      err;
+
+    if( d->rx_head == NULL )
+    {
+        err = l3_recv( d->dst_mac_address, buf, length );
+        if( err != 0 )
+        {
+            /* Delivered, or an error that a retry won't fix. */
+            maybe_send_credit( d );
+            return;
+        }
+    }
+
+    /* The receiver is too slow. Keep the frame. */
+    d->rx_refused++;
+    f = frame_alloc( length );
+    if( f == 0 )
+    {
+        return;
+    }
+    memcpy( payload( f ), buf, length );
+    frame_append( &d->rx_head, &d->rx_tail, f );
+    d->rx_len++;
+    if( d->retry_timer < 0 )
+    {
+        timer_in( &d->retry_timer, RETRY_INTERVAL, &retry_deliver, d );
+    }
+    maybe_send_credit( d );
+}
+
+/*
+ * FEC, receiving. The kept frames are a ring indexed by seq.
+ */
+static l2kept_t* kept_slot( l2dev_t* d, unsigned int seq )
+{
+    return &d->kept[seq % FEC_WINDOW];
+}
+
+static int kept_has( l2dev_t* d, unsigned int seq )
+{
+    l2kept_t* k = kept_slot( d, seq );
+    return k->valid && k->seq == seq;
+}
+
+static void keep( l2dev_t* d, unsigned int seq, const char* buf, int length )
+{
+    l2kept_t* k    = kept_slot( d, seq );
+    char*     data = (char*)malloc( length > 0 ? length : 1 );
+
+    if( data == NULL )
+    {
+        return;
+    }
+    memcpy( data, buf, length );
+    free( k->data );
+    k->valid  = 1;
+    k->seq    = seq;
+    k->length = length;
+    k->data   = data;
+}
+
+static void hold_expired( void* param );
+
+/*
+ * Deliver the kept frames that are next in order. Watch the ones
+ * that still wait behind a gap.
+ */
+static void fec_release( l2dev_t* d )
+{
+    l2kept_t* k;
+    int       i;
+
+    while( kept_has( d, d->deliver_next ) )
+    {
+        k = kept_slot( d, d->deliver_next++ );
+        deliver_up( d, k->data, k->length );
+    }
+
+    d->held = 0;
+    for( i=0; i<FEC_WINDOW; i++ )
+    {
+        if( d->kept[i].valid && !seq_before( d->kept[i].seq, d->deliver_next ) ) d->held++;
+    }
+    if( d->held == 0 && d->hold_timer >= 0 )
+    {
+        remove_timeout( d->hold_timer );
+        d->hold_timer = -1;
+    }
+    else if( d->held > 0 && d->hold_timer < 0 )
+    {
+        timer_in( &d->hold_timer, FEC_HOLD, &hold_expired, d );
+    }
+}
+
+/*
+ * Give up on the frames before seq that have not arrived.
+ */
+static void fec_give_up( l2dev_t* d, unsigned int seq )
+{
+    l2kept_t* k;
+
+    while( seq_before( d->deliver_next, seq ) )
+    {
+        if( kept_has( d, d->deliver_next ) )
+        {
+            k = kept_slot( d, d->deliver_next );
+            deliver_up( d, k->data, k->length );
+        }
+        else
+        {
+            d->fec_lost++;
+        }
+        d->deliver_next++;
+    }
+    fec_release( d );
+}
+
+/*
+ * Timeout callback: the repair of a gap takes too long.
+ */
+static void hold_expired( void* param )
+{
+    l2dev_t*     d   = (l2dev_t*)param;
+    unsigned int seq = d->deliver_next;
+    int          i;
+
+    d->hold_timer = -1;
+    for( i=0; i<FEC_WINDOW && !kept_has( d, seq ); i++ )
+    {
+        seq++;
+    }
+    if( i < FEC_WINDOW )
+    {
+        fec_give_up( d, seq );
+    }
+}
+
+static void fec_forget_parity( l2dev_t* d )
+{
+    while( d->par_count > 0 )
+    {
+        free( d->par_data[--d->par_count] );
+    }
+}
+
+/*
+ * Rebuild the missing data frames of the block of the parity frames
+ * that we have, if there are enough of them.
+ */
+static void fec_try_repair( l2dev_t* d )
+{
+    unsigned char* data[FEC_MAX_DATA];
+    unsigned int   present = 0;
+    unsigned int   seq;
+    l2kept_t*      k;
+    int            missing = 0;
+    int            ok = 1;
+    int            i, length;
+
+    for( i=0; i<d->par_n; i++ )
+    {
+        if( kept_has( d, d->par_start + i ) ) present |= 1u << i;
+        else                                  missing++;
+    }
+    if( missing == 0 || missing > d->par_count )
+    {
+        return;
+    }
+
+    for( i=0; i<d->par_n; i++ )
+    {
+        data[i] = (unsigned char*)calloc( 1, d->par_len );
+        if( data[i] == NULL )
+        {
+            ok = 0;
+        }
+        else if( present & (1u << i) )
+        {
+            k = kept_slot( d, d->par_start + i );
+            if( k->length + 2 > d->par_len )
+            {
+                ok = 0;
+                continue;
+            }
+            put16( data[i], k->length );
+            memcpy( data[i]+2, k->data, k->length );
+        }
+    }
+
+    if( ok && fec_decode( data, present, d->par_n, d->par_data, d->par_index,
+                          d->par_count, d->par_len ) == 0 )
+    {
+        for( i=0; i<d->par_n; i++ )
+        {
+            seq    = d->par_start + i;
+            length = get16( data[i] );
+            if( !(present & (1u << i)) && !seq_before( seq, d->deliver_next )
+                && length + 2 <= d->par_len )
+            {
+                keep( d, seq, (char*)data[i]+2, length );
+                d->fec_repaired++;
+            }
+        }
+    }
+
+    for( i=0; i<d->par_n; i++ )
+    {
+        free( data[i] );
+    }
+    fec_release( d );
+}
+
+/*
+ * A data frame has arrived while FEC is on. Frames of protected
+ * blocks are kept, because they may be needed to rebuild others.
+ */
+static void fec_recv_data( l2dev_t* d, unsigned int seq, int flags, const char* buf, int length )
+{
+    if( !d->fec_started )
+    {
+        d->fec_started  = 1;
+        d->deliver_next = seq;
+    }
+    if( seq_before( seq, d->deliver_next ) )
+    {
+        /* repaired before, or given up */
+        return;
+    }
+    if( (int)(seq - d->deliver_next) >= FEC_WINDOW )
+    {
+        fec_give_up( d, seq - FEC_WINDOW + 1 );
+    }
+
+    if( !(flags & L2_F_FEC) )
+    {
+        /* nothing can repair the gap in front of it */
+        fec_give_up( d, seq );
+        deliver_up( d, buf, length );
+        d->deliver_next++;
+        fec_release( d );
+        return;
+    }
+
+    keep( d, seq, buf, length );
+    fec_release( d );
+    if( d->par_count > 0 && !seq_before( seq, d->par_start ) && seq_before( seq, d->par_start + d->par_n ) )
+    {
+        fec_try_repair( d );
+    }
+}
+
+static void fec_recv_parity( l2dev_t* d, const char* buf, int length )
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    unsigned int         start;
+    int                  n, k, index, symbol;
+
+    if( length < FEC_PARITY_HDR )
+    {
+        return;
+    }
+    start  = expand16( get16( p ), d->rcv_next );
+    n      = p[2];
+    k      = p[3];
+    index  = p[4];
+    symbol = get16( p+5 );
+    if( n < 1 || n > FEC_MAX_DATA || k > FEC_MAX_PARITY || index >= k
+        || symbol != length - FEC_PARITY_HDR )
+    {
+        return;
+    }
+
+    if( !d->fec_started )
+    {
+        d->fec_started  = 1;
+        d->deliver_next = start;
+    }
+
+    /* the parity of earlier blocks won't come any more */
+    fec_give_up( d, start );
+
+    if( start != d->par_start || n != d->par_n || symbol != d->par_len )
+    {
+        fec_forget_parity( d );
+        d->par_start = start;
+        d->par_n     = n;
+        d->par_len   = symbol;
+    }
+    if( d->par_count == FEC_MAX_PARITY )
+    {
+        return;
+    }
+    d->par_data[d->par_count] = (unsigned char*)malloc( symbol );
+    if( d->par_data[d->par_count] == NULL )
+    {
+        return;
+    }
+    memcpy( d->par_data[d->par_count], p + FEC_PARITY_HDR, symbol );
+    d->par_index[d->par_count++] = index;
+
+    fec_try_repair( d );
+}
 
 /*
- * The network layer needs to maintain private information about
- * the MAC address at the other end of every link.
- * The map is static because it is inappropriate for other layers
- * to see or change it.
+ * Forget everything about a link, including the frames in its queues.
  */
-static link_entry_t mac_to_device_map[MAX_ADDRESSES];
+static void free_device( l2dev_t* d )
+{
+    frame_t* f;
+
+    if( d->persist_timer >= 0 ) remove_timeout( d->persist_timer );
+    if( d->retry_timer >= 0 )   remove_timeout( d->retry_timer );
+    if( d->fec_timer >= 0 )     remove_timeout( d->fec_timer );
+    if( d->hold_timer >= 0 )    remove_timeout( d->hold_timer );
+    int      i;
+
+    while( (f = frame_pop( &d->ctl_head, &d->ctl_tail )) != NULL ) frame_free( f );
+    for( i=0; i<NUM_FLOWS; i++ )
+    {
+        while( (f = frame_pop( &d->flows[i].head, &d->flows[i].tail )) != NULL ) frame_free( f );
+    }
+    while( (f = frame_pop( &d->rx_head, &d->rx_tail )) != NULL ) frame_free( f );
+    while( (f = frame_pop( &d->par_head, &d->par_tail )) != NULL ) frame_free( f );
+    for( i=0; i<d->fec_n; i++ ) frame_free( d->fec_data[i] );
+    for( i=0; i<FEC_WINDOW; i++ ) free( d->kept[i].data );
+    fec_forget_parity( d );
+    free( d );
+}
 
 /*
  * Call at the start of the program. Initialize data structures
@@ -36,97 +1454,405 @@ static link_entry_t mac_to_device_map[MAX_ADDRESSES];
  */
 void l2_init( int local_mac_address, int device )
 {
+    struct L2State* l2;
     int mac;
+    int dev;
+
+    l2 = (struct L2State*)calloc( 1, sizeof(struct L2State) );
+    if( l2 == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in l2_init\n" );
+        exit( -1 );
+    }
+    this_node->l2 = l2;
 
     for( mac=0; mac<MAX_ADDRESSES; mac++ )
     {
-        mac_to_device_map[mac].remote_mac_address = -1;
-        mac_to_device_map[mac].phys_device        = -1;
+        l2->mac_to_device_map[mac].remote_mac_address = -1;
+        l2->mac_to_device_map[mac].phys_device        = -1;
+    }
+
+    l2->mac_to_device_map[local_mac_address].remote_mac_address = -1;
+    l2->mac_to_device_map[local_mac_address].phys_device        = device;
+
+    /* the links that layer 1 has restored */
+    for( dev=0; dev<MAX_DEVICES; dev++ )
+    {
+        ckpt_link_t* l = checkpoint_link( dev );
+        if( l != NULL )
+        {
+            l2->mac_to_device_map[l->local_mac].phys_device        = dev;
+            l2->mac_to_device_map[l->local_mac].remote_mac_address = l->remote_mac;
+            new_device( dev, l->local_mac, l->remote_mac );
+        }
+    }
+}
+
+/*
+ * Set up the state of a device whose link has come up. Both sides
+ * start counting from 0 and assume that the other side has a
+ * complete receive buffer free.
+ */
+static void new_device( int device, int mac, int other_mac_address )
+{
+    struct L2State* l2 = this_node->l2;
+    l2dev_t*        d;
+
+    if( device < 0 || device >= MAX_DEVICES )
+    {
+        return;
+    }
+    d = (l2dev_t*)calloc( 1, sizeof(l2dev_t) );
+    if( d == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in l2_linkup\n" );
+        exit( -1 );
     }
+    d->device          = device;
+    d->src_mac_address = mac;
+    d->dst_mac_address = other_mac_address;
+    d->peer_limit      = RX_BUFFER;
+    d->advertised      = RX_BUFFER;
+    d->persist_timer   = -1;
+    d->persist_ms      = PERSIST_INTERVAL;
+    d->active_head     = -1;
+    d->active_tail     = -1;
+    d->retry_timer     = -1;
+    d->fec_timer       = -1;
+    d->hold_timer      = -1;
+    d->fec_parity      = fec_max_parity > 0 ? 1 : 0;
 
-    mac_to_device_map[local_mac_address].remote_mac_address = -1;
-    mac_to_device_map[local_mac_address].phys_device        = device;
+    if( l2->devices[device] ) free_device( l2->devices[device] );
+    l2->devices[device] = d;
 }
 
 /*
  * We have gotten an UP packet for a particular device from the remote host.
  * We have to remember that in our table that maps MAC addresses to devices.
+ * A device that has no local MAC address yet gets the first unused one.
  */
 void l2_linkup( int device, const char* other_hostname, int other_port, int other_mac_address )
 {
+    struct L2State* l2 = this_node->l2;
+    int mac;
+    int unused = -1;
+
+    for( mac=0; mac<MAX_ADDRESSES; mac++ )
+    {
+        if( l2->mac_to_device_map[mac].phys_device == device )
+        {
+            break;
+        }
+        if( unused < 0 && l2->mac_to_device_map[mac].phys_device == -1 )
+        {
+            unused = mac;
+        }
+    }
+
+    if( mac == MAX_ADDRESSES )
+    {
+        if( unused < 0 )
+        {
+            logmsg( LL_ERROR, "Programming error in establishing a physical link\n" );
+            exit( -1 );
+        }
+        mac = unused;
+        l2->mac_to_device_map[mac].phys_device = device;
+    }
+
+    l2->mac_to_device_map[mac].remote_mac_address = other_mac_address;
+    checkpoint_link_mac( device, mac, other_mac_address );
+
+    new_device( device, mac, other_mac_address );
+
+    l3_linkup( other_hostname, other_port, other_mac_address );
+}
+
+/*
+ * The physical layer has found that the device is not connected any
+ * more. Forget the MAC address at the other end, so that nothing is
+ * sent to it, and tell the network layer.
+ */
+void l2_linkdown( int device )
+{
+    struct L2State* l2 = this_node->l2;
     int mac;
+
     for( mac=0; mac<MAX_ADDRESSES; mac++ )
     {
-        if( mac_to_device_map[mac].phys_device == device )
+        if( l2->mac_to_device_map[mac].phys_device == device )
         {
-            mac_to_device_map[mac].remote_mac_address = other_mac_address;
-            l3_linkup( other_hostname, other_port, other_mac_address );
+            int other_mac_address = l2->mac_to_device_map[mac].remote_mac_address;
+            if( other_mac_address < 0 )
+            {
+                return;
+            }
+            l2->mac_to_device_map[mac].remote_mac_address = -1;
+            if( device >= 0 && device < MAX_DEVICES && l2->devices[device] )
+            {
+                free_device( l2->devices[device] );
+                l2->devices[device] = NULL;
+            }
+            l3_linkdown( other_mac_address );
             return;
         }
     }
-    fprintf( stderr, "Programming error in establishing a physical link\n" );
-    exit( -1 );
+}
+
+/*
+ * Configure CoDel for all nodes. A target of 0 switches it off.
+ */
+void l2_set_codel( int target_ms, int interval_ms )
+{
+    codel_target   = target_ms * 1000LL;
+    codel_interval = (interval_ms > 0 ? interval_ms : 100) * 1000LL;
+}
+
+/*
+ * Switch header compression on or off for all nodes.
+ */
+void l2_set_header_compression( int on )
+{
+    header_compression = on;
+}
+
+/*
+ * Switch FEC on for all nodes, with blocks of block data frames and
+ * up to max_parity parity frames per block. A block of 0 switches it
+ * off.
+ */
+void l2_set_fec( int block, int max_parity )
+{
+    if( block <= 0 )
+    {
+        fec_block = 0;
+        return;
+    }
+    fec_block      = block < 2 ? 2 : block > FEC_MAX_DATA ? FEC_MAX_DATA : block;
+    fec_max_parity = max_parity < 1 ? 1 : max_parity > FEC_MAX_PARITY ? FEC_MAX_PARITY : max_parity;
+    fec_init( );
+}
+
+/*
+ * Print the statistics of all links of this node: what has been
+ * sent, how long data frames have waited in the queues on average
+ * and at most, and what has been dropped.
+ */
+void l2_print_stats( )
+{
+    struct L2State* l2 = this_node->l2;
+    l2dev_t*        d;
+    int             device;
+
+    for( device=0; device<MAX_DEVICES; device++ )
+    {
+        d = l2->devices[device];
+        if( d == NULL )
+        {
+            continue;
+        }
+
+        fprintf( stderr, "device %d (MAC %d):\n"
+                         "    sent %lu frames, %lu bytes, %d queued\n"
+                         "    queue delay avg %.3f ms, max %.3f ms\n"
+                         "    dropped %lu by CoDel, %lu on full queue\n"
+                         "    received %lu frames, %lu refused by layer 3 at first, %lu overflows\n"
+                         "    headers %.1f bytes per frame, %lld bytes saved by %d contexts, %lu context misses\n",
+                         device, d->dst_mac_address,
+                         d->tx_frames, d->tx_bytes, d->tx_len,
+                         d->tx_frames ? d->delay_sum / 1000.0 / d->tx_frames : 0.0,
+                         d->delay_max / 1000.0,
+                         d->codel_drops, d->tail_drops,
+                         d->rx_frames, d->rx_refused, d->rx_overflows,
+                         d->tx_frames ? (double)d->hdr_bytes / d->tx_frames : 0.0,
+                         d->ctx_saved, L2_CONTEXTS, d->ctx_misses );
+        if( fec_block )
+        {
+            fprintf( stderr, "    fec %d+%d at %.1f%% loss (%s), %lu parity frames sent, "
+                             "%lu frames repaired, %lu lost\n",
+                             fec_block, d->fec_parity, 100 * d->fec_loss, fec_kernel( ),
+                             d->fec_sent, d->fec_repaired, d->fec_lost );
+        }
+    }
+}
+
+/*
+ * The physical layer can take frames again after it has said that it
+ * is not ready.
+ */
+void l2_device_ready( int device )
+{
+    if( device >= 0 && device < MAX_DEVICES && this_node->l2->devices[device] )
+    {
+        drain( this_node->l2->devices[device] );
+    }
+}
+
+/*
+ * The device that leads to a neighbour, or NULL.
+ */
+static l2dev_t* find_device( int mac_address )
+{
+    struct L2State* l2 = this_node->l2;
+    int             device;
+    int             i;
+
+    for( i=0; i<MAX_ADDRESSES; i++ )
+    {
+        if( l2->mac_to_device_map[i].remote_mac_address == mac_address )
+        {
+            device = l2->mac_to_device_map[i].phys_device;
+            if( device < 0 || device >= MAX_DEVICES )
+            {
+                return NULL;
+            }
+            return l2->devices[device];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Every frame goes through the queues. If the physical layer is
+ * ready and the receiver has granted credit, it leaves them at once.
+ * Otherwise it waits there.
+ */
+static void enqueue( l2dev_t* d, frame_t* f, int prio )
+{
+    if( prio == L2_PRIO_CONTROL )
+    {
+        frame_append( &d->ctl_head, &d->ctl_tail, f );
+    }
+    else
+    {
+        enqueue_data( d, f, flow_hash( payload( f ), f->length ) );
+    }
+    d->tx_len++;
+
+    drain( d );
 }
 
 /*
  * Called by layer 3, network, when it wants to send data to a
  * direct neighbour identified by the MAC address.
  * A positive return value means the number of bytes that have been
- * sent.
+ * sent or queued.
  * A negative return value means that an error has occured.
- *
- * NOTE:
- * You will need to split this function into many small helper
- * functions. In particular, you will need something that allows
- * you to perform retransmissions after a timeout.
  */
 int l2_send( int dest_mac_addr, const char* buf, int length )
 {
-    int   device = -1;
-    int   src_mac_addr = -1;
-    char* l1buf;
-    struct L2Header*  hdr_pointer;
-    int   retval;
-    int   i;
+    return l2_send_prio( dest_mac_addr, buf, length, L2_PRIO_DATA );
+}
 
-    for( i=0; i<MAX_ADDRESSES; i++ )
+/*
+ * Like l2_send, but the frame is queued in the given class.
+ * L2_PRIO_CONTROL frames, like acknowledgements, are sent before all
+ * data frames of the device. Data frames share the device fairly per
+ * flow.
+ */
+int l2_send_prio( int dest_mac_addr, const char* buf, int length, int prio )
+{
+    l2dev_t* d;
+    frame_t* f;
+
+    d = find_device( dest_mac_addr );
+    if( d == NULL )
     {
-        if( mac_to_device_map[i].remote_mac_address == dest_mac_addr )
-        {
-            device       = mac_to_device_map[i].phys_device;
-            src_mac_addr = i;
-            break;
-        }
+        logmsg_limited( LL_WARN, "MAC address not found in l2_send\n" );
+        return -1;
     }
-    if( i==MAX_ADDRESSES )
+
+    if( d->tx_len >= L2_QUEUE_LIMIT )
     {
-        fprintf( stderr, "MAC address not found in l2_send" );
+        d->tail_drops++;
         return -1;
     }
 
-    l1buf = (char*)malloc( length+sizeof(struct L2Header) );
-    if( l1buf == 0 )
+    f = frame_alloc( length );
+    if( f == 0 )
     {
-        fprintf( stderr, "Not enough memory in l2_send\n" );
+        logmsg_limited( LL_ERROR, "Not enough memory in l2_send\n" );
         return -1;
     }
 
-    memcpy( &l1buf[sizeof(struct L2Header)], buf, length );
+    memcpy( payload( f ), buf, length );
+    enqueue( d, f, prio );
+    return length;
+}
+
+/*
+ * Allocate a buffer for a packet that is sent to several neighbours
+ * (see l2_send_buf). Its only reference belongs to the caller.
+ */
+l2buf_t* l2_buf_alloc( int length )
+{
+    l2buf_t* b = (l2buf_t*)malloc( sizeof(l2buf_t) + length );
+    if( b )
+    {
+        b->refs   = 1;
+        b->length = length;
+    }
+    return b;
+}
+
+/*
+ * Give up a reference to a buffer. The last one frees it.
+ */
+void l2_buf_put( l2buf_t* b )
+{
+    if( --b->refs == 0 )
+    {
+        free( b );
+    }
+}
+
+/*
+ * Like l2_send_prio, for a packet in a shared buffer. The frame keeps
+ * a reference to the buffer instead of a copy, so that sending the
+ * same packet to many neighbours costs one small allocation each.
+ * The caller keeps its own reference.
+ */
+int l2_send_buf( int dest_mac_addr, l2buf_t* b, int prio )
+{
+    l2dev_t* d;
+    frame_t* f;
 
-    hdr_pointer = (struct L2Header*)l1buf;
-    hdr_pointer->src_mac_address = htonl(src_mac_addr);
-    hdr_pointer->dst_mac_address = htonl(dest_mac_addr);
+    d = find_device( dest_mac_addr );
+    if( d == NULL )
+    {
+        logmsg_limited( LL_WARN, "MAC address not found in l2_send\n" );
+        return -1;
+    }
 
-    retval = l1_send( device, l1buf, length+sizeof(struct L2Header) );
-    free(l1buf);
-    if( retval < 0 )
+    if( d->tx_len >= L2_QUEUE_LIMIT )
     {
+        d->tail_drops++;
         return -1;
     }
-    else
+
+    f = frame_alloc( 0 );
+    if( f == 0 )
     {
-        return retval-sizeof(struct L2Header);
+        logmsg_limited( LL_ERROR, "Not enough memory in l2_send\n" );
+        return -1;
     }
+    f->length = b->length;
+    f->shared = b;
+    b->refs++;
+
+    enqueue( d, f, prio );
+    return b->length;
+}
+
+/*
+ * How many bytes of data are waiting to be sent to a neighbour.
+ * Layer 3 uses this to stripe packets over parallel paths. Returns
+ * -1 if the neighbour is unknown.
+ */
+int l2_backlog( int mac_address )
+{
+    l2dev_t* d = find_device( mac_address );
+    return d ? d->data_bytes : -1;
 }
 
 /*
@@ -136,33 +1862,153 @@ int l2_send( int dest_mac_addr, const char* buf, int length )
  * problems itself because the physical layer isn't able
  * to handle errors.
  *
- * NOTE:
- * Link layer error correction and flow control must be considered
- * here. You will certainly need several helper functions because
- * you will need to perform retransmissions after a timeout.
+ * A data frame that the network layer can't take right now is kept
+ * in the receive buffer and offered again later. The sender never
+ * sends more than fits into that buffer.
  */
 void l2_recv( int device, const char* buf, int length )
 {
-    const struct L2Header* hdr_pointer;
-    const char*            l3buf;
-    int                    src_mac_address;
-    int                    dst_mac_address;
-    int                    err;
+    static char     unpacked[L2_MAX_STATIC + 65536];
+    struct L2Header hdr;
+    l2dev_t*        d;
+    l2ctx_t*        c;
+    int             hlen;
 
-    hdr_pointer = (const struct L2Header*)buf;
-    src_mac_address  = ntohl(hdr_pointer->src_mac_address);
-    dst_mac_address  = ntohl(hdr_pointer->dst_mac_address);
+    if( device < 0 || device >= MAX_DEVICES )
+    {
+        return;
+    }
+    d = this_node->l2->devices[device];
+    if( d == NULL )
+    {
+        return;
+    }
 
-    /*
-     * This is not enough.
-     * Add link layer protocol processing!
-     */
+    hlen = parse_header( d, (const unsigned char*)buf, length, &hdr );
+    if( hlen < 0 )
+    {
+        return;
+    }
+    buf    += hlen;
+    length -= hlen;
+
+    /* Every frame can carry new credit for us. */
+    if( seq_before( d->peer_limit, hdr.limit ) )
+    {
+        d->peer_limit = hdr.limit;
+        d->persist_ms = PERSIST_INTERVAL;
+        drain( d );
+    }
 
-    l3buf = buf + sizeof(struct L2Header);
-    err = l3_recv( dst_mac_address, l3buf, length-sizeof(struct L2Header) );
+    if( hdr.flags & L2_F_ECHO )
+    {
+        d->peer_known  = hdr.known;
+        d->peer_parity = hdr.parity;
+    }
 
-    /*
-     * Add error handling.
-     * The most common error will be that the receiver is too slow.
-     */
+    switch( hdr.type )
+    {
+    case L2_DATA :
+        d->rx_frames++;
+        if( d->rx_len + d->held >= RX_BUFFER )
+        {
+            /* The sender has ignored our limit. */
+            d->rx_overflows++;
+            return;
+        }
+        if( fec_block && !seq_before( hdr.seq, d->rcv_next ) )
+        {
+            /* measure the loss for the sender's FEC */
+            d->loss_expected += hdr.seq - d->rcv_next + 1;
+            d->loss_lost     += hdr.seq - d->rcv_next;
+            if( d->loss_expected >= FEC_REPORT_EVERY )
+            {
+                d->report_value   = 10000LL * d->loss_lost / d->loss_expected;
+                d->report_pending = 1;
+                d->loss_expected  = 0;
+                d->loss_lost      = 0;
+            }
+        }
+        if( !seq_before( hdr.seq, d->rcv_next ) )
+        {
+            /* frames before seq that have not arrived are lost */
+            d->rcv_next = hdr.seq + 1;
+        }
+
+        c = &d->rx_ctx[hdr.cid & 0xf];
+        if( hdr.flags & L2_F_CTX_FULL )
+        {
+            if( hdr.static_len > L2_MAX_STATIC || hdr.static_len > length )
+            {
+                return;
+            }
+            if( !c->used || c->gen != hdr.cid >> 4 )
+            {
+                d->echo_pending = 1;
+            }
+            c->used   = 1;
+            c->gen    = hdr.cid >> 4;
+            c->length = hdr.static_len;
+            memcpy( c->header, buf, hdr.static_len );
+        }
+        else if( hdr.flags & L2_F_CTX )
+        {
+            if( !c->used || c->gen != hdr.cid >> 4 || c->length + length > sizeof(unpacked) )
+            {
+                /* The sender must send the full header again. */
+                c->used = 0;
+                d->echo_pending = 1;
+                d->ctx_misses++;
+                return;
+            }
+            memcpy( unpacked, c->header, c->length );
+            memcpy( unpacked + c->length, buf, length );
+            buf     = unpacked;
+            length += c->length;
+        }
+
+        if( fec_block )
+        {
+            fec_recv_data( d, hdr.seq, hdr.flags, buf, length );
+        }
+        else
+        {
+            deliver_up( d, buf, length );
+        }
+        break;
+
+    case L2_PROBE :
+        d->credit_pending = 1;
+        drain( d );
+        break;
+
+    case L2_PARITY :
+        if( fec_block )
+        {
+            fec_recv_parity( d, buf, length );
+        }
+        break;
+
+    case L2_REPORT :
+        if( fec_block && length >= 2 )
+        {
+            d->fec_loss   = (d->fec_loss + get16( (const unsigned char*)buf ) / 10000.0) / 2;
+            d->fec_parity = parity_needed( d->fec_loss, fec_block, fec_max_parity );
+        }
+        break;
+
+    default :
+        break;
+    }
+
+    if( d->echo_pending && !data_queued( d ) )
+    {
+        /* nothing goes back soon that could carry the echo */
+        d->credit_pending = 1;
+        drain( d );
+    }
+    if( d->report_pending )
+    {
+        drain( d );
+    }
 }
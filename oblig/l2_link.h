@@ -16,12 +16,44 @@ struct LinkEntry
 };
 typedef struct LinkEntry link_entry_t;
 
+/*
+ * Traffic classes for l2_send_prio.
+ */
+enum
+{
+    L2_PRIO_CONTROL = 0,
+    L2_PRIO_DATA
+};
+
+/*
+ * A packet that is queued for several neighbours at once. The frames
+ * keep references to it instead of copies.
+ */
+struct L2Buffer
+{
+    int  refs;
+    int  length;
+    char data[];
+};
+typedef struct L2Buffer l2buf_t;
+
 /* see more comments in the c file */
 
+void l2_set_codel( int target_ms, int interval_ms );
+void l2_set_header_compression( int on );
+void l2_set_fec( int block, int max_parity );
 void l2_init( int local_mac_address, int device );
+void l2_print_stats( );
 void l2_linkup( int device, const char* other_hostname, int other_port, int other_mac_address );
+void l2_linkdown( int device );
 
 int  l2_send( int mac_address, const char* buf, int length );
+int  l2_send_prio( int mac_address, const char* buf, int length, int prio );
+int  l2_backlog( int mac_address );
+l2buf_t* l2_buf_alloc( int length );
+void l2_buf_put( l2buf_t* b );
+int  l2_send_buf( int mac_address, l2buf_t* b, int prio );
+void l2_device_ready( int device );
 void l2_recv( int device, const char* buf, int length );
 
 #endif /* L2_LINK_H */
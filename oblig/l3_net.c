@@ -3,55 +3,161 @@
 #include <string.h>
 #include <arpa/inet.h>
 
+#include "node.h"
 #include "l2_link.h"
 #include "l3_net.h"
+#include "l3_route.h"
 #include "l4_trans.h"
+#include "varint.h"
+#include "logger.h"
 
 #define MAX_ADDRESSES 1024
+#define MAX_GROUPS    256
+#define MAX_CHILDREN  64
 
 /*
- * This header is included in every network layer packet.
+ * This header is included in every network layer packet. On the
+ * wire, both addresses are varints, followed by one byte with the
+ * protocol (2 bits), the traffic class (1 bit) and the hop limit
+ * (5 bits).
  */
 struct L3Header
 {
     int src_address;
     int dst_address;
+    int proto;
+    int prio;
+    int ttl;
 };
 
+#define L3_MAX_HEADER (2*VARINT_MAX + 1)
+#define L3_TTL        31
+
+/*
+ * Multipath: a destination can have up to L3_MAX_PATHS next hops
+ * that are equally far away (ECMP). A packet takes one of them:
+ *   L3_MP_HASH   by a hash of its addresses and ports, so that
+ *                every flow stays on one path and in order,
+ *   L3_MP_STRIPE data packets go to the next hop with the shortest
+ *                queue at layer 2. A faster link drains its queue
+ *                faster and gets more packets, so one flow can use
+ *                the bandwidth of all paths. The packets of a flow
+ *                may arrive out of order. Control packets are still
+ *                hashed.
+ */
+static int multipath = L3_MP_HASH;
+
+/*
+ * Multicast: a packet to a group address goes to all members of the
+ * group. The source sends it to its neighbours, and every node sends
+ * it on along the tree of shortest paths from the source
+ * (route_children), so that it crosses each link only once. A node
+ * accepts the packet only from its next hop towards the source
+ * (reverse path check). Membership is local: the packets reach every
+ * node and are given to layer 4 where the group has been joined.
+ *
+ * The packet is put together once, in a buffer that is shared by the
+ * frames to all neighbours (l2_send_buf).
+ */
+
 /*
- * This static variable contains the host name of this machine.
- * It must be initialized at startup time.
+ * The next hops towards one destination.
  */
-static int own_host_address = -1;
+struct L3NextHops
+{
+    int num;
+    int mac[L3_MAX_PATHS];
+    int stripe;       /* where striping looks first, for ties */
+};
 
 /*
- * The network layer needs to maintain private information about
- * the link that leads to a host address. Filling this map is
- * part of the routing process.
- * The map is static because it is inappropriate for other layers
- * to see or change it. Network layer functions should be written
- * for all necessary changes to the map.
+ * The private state of the network layer of one node.
  */
-static int host_to_mac_map[MAX_ADDRESSES];
+struct L3State
+{
+    /*
+     * The host address of this machine.
+     * It must be initialized at startup time.
+     */
+    int own_host_address;
+
+    /*
+     * The network layer needs to maintain private information about
+     * the links that lead to a host address. Filling this table is
+     * the job of the routing protocol (l3_route.c), which calls
+     * l3_set_route(). The table is private because it is
+     * inappropriate for other layers to see or change it.
+     */
+    struct L3NextHops routes[MAX_ADDRESSES];
+
+    unsigned char groups[MAX_GROUPS];   /* the groups we are a member of */
+
+    unsigned long forwarded;
+    unsigned long ttl_drops;
+    unsigned long no_route;
+    unsigned long group_sent;
+    unsigned long group_forwarded;
+    unsigned long group_received;
+    unsigned long group_dups;           /* failed the reverse path check */
+};
 
 /*
  * Call at the start of the program. Initialize data structures
  * like an operating system would do at boot time. Set the own
  * host address.
  *
- * ONLY FOR ASSIGNMENT 1:
- * Host address and mac address are simply the same, allowing
- * a one-to-one mapping. Routing doesn't happen yet.
+ * Host address and MAC address are the same. Hosts that are not
+ * direct neighbours are found by the routing protocol.
  */
 void l3_init( int self )
 {
-    int i;
+    struct L3State* l3;
+
+    l3 = (struct L3State*)calloc( 1, sizeof(struct L3State) );
+    if( l3 == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in l3_init\n" );
+        exit( -1 );
+    }
+    this_node->l3 = l3;
 
-    own_host_address = self;
+    l3->own_host_address = self;
+    l3->groups[L3_GROUP_ALL] = 1;
 
-    for( i=0; i<MAX_ADDRESSES; i++ )
+    route_init( self );
+}
+
+/*
+ * Choose how packets are spread over equal-cost paths, for all nodes.
+ */
+void l3_set_multipath( int mode )
+{
+    multipath = mode;
+}
+
+/*
+ * Called by the routing protocol: packets to dest_address go to one
+ * of the num neighbours in macs from now on. num 0 means that dest
+ * can't be reached.
+ */
+void l3_set_route( int dest_address, const int* macs, int num )
+{
+    struct L3NextHops* r;
+    int                was_reachable;
+
+    if( dest_address < 0 || dest_address >= MAX_ADDRESSES )
+    {
+        return;
+    }
+    r = &this_node->l3->routes[dest_address];
+    was_reachable = r->num > 0;
+    r->num = num < L3_MAX_PATHS ? num : L3_MAX_PATHS;
+    memcpy( r->mac, macs, r->num * sizeof(int) );
+
+    /* the connections to it are gone, not when one link goes down */
+    if( was_reachable && r->num == 0 )
     {
-        host_to_mac_map[i] = i;
+        l4_unreachable( dest_address );
     }
 }
 
@@ -65,9 +171,109 @@ void l3_init( int self )
 void l3_linkup( const char* other_hostname, int other_port, int other_mac_address )
 {
     int other_host_address = other_mac_address;
+    route_linkup( other_mac_address );
     l4_linkup( other_host_address, other_hostname, other_port );
 }
 
+/*
+ * The link to a MAC address is down. The host may still be reached
+ * over other links, routing decides that.
+ */
+void l3_linkdown( int other_mac_address )
+{
+    int other_host_address = other_mac_address;
+    route_linkdown( other_mac_address );
+    l4_linkdown( other_host_address );
+}
+
+/*
+ * Parse a packed header. Returns its length, or -1 if it is broken.
+ */
+static int parse_header( const unsigned char* buf, int length, struct L3Header* hdr )
+{
+    unsigned int v;
+    int          n;
+    int          hlen;
+
+    if( (n = varint_get( buf, length, &v )) < 0 )
+    {
+        return -1;
+    }
+    hdr->src_address = v;
+    hlen = n;
+    if( (n = varint_get( &buf[hlen], length-hlen, &v )) < 0 )
+    {
+        return -1;
+    }
+    hdr->dst_address = v;
+    hlen += n;
+    if( hlen >= length )
+    {
+        return -1;
+    }
+    hdr->proto = buf[hlen] >> 6;
+    hdr->prio  = (buf[hlen] >> 5) & 1;
+    hdr->ttl   = buf[hlen] & 0x1f;
+    return hlen + 1;
+}
+
+static int put_header( unsigned char* buf, int src, int dst, int proto, int prio, int ttl )
+{
+    int hlen;
+
+    hlen  = varint_put( &buf[0], src );
+    hlen += varint_put( &buf[hlen], dst );
+    buf[hlen++] = proto << 6 | (prio == L2_PRIO_CONTROL ? 0 : 1) << 5 | ttl;
+    return hlen;
+}
+
+/*
+ * Pick the next hop of a packet. pkt is the whole packet with our
+ * header of hlen bytes.
+ */
+static int next_hop( struct L3NextHops* r, const unsigned char* pkt, int hlen, int length, int prio )
+{
+    unsigned int h = 2166136261u;
+    int          best;
+    int          backlog, b;
+    int          i, n;
+
+    if( r->num == 1 )
+    {
+        return r->mac[0];
+    }
+
+    if( multipath == L3_MP_STRIPE && prio == L2_PRIO_DATA )
+    {
+        best    = r->stripe;
+        backlog = l2_backlog( r->mac[best] );
+        for( i=1; i<r->num && backlog > 0; i++ )
+        {
+            n = (r->stripe + i) % r->num;
+            b = l2_backlog( r->mac[n] );
+            if( b < backlog )
+            {
+                best    = n;
+                backlog = b;
+            }
+        }
+        r->stripe = (best + 1) % r->num;
+        return r->mac[best];
+    }
+
+    /* the addresses and the static part of the transport header */
+    n = l4_static_header_len( (const char*)pkt+hlen, length-hlen );
+    for( i=0; i<hlen-1; i++ )
+    {
+        h = (h ^ pkt[i]) * 16777619u;
+    }
+    for( i=0; i<n; i++ )
+    {
+        h = (h ^ pkt[hlen+i]) * 16777619u;
+    }
+    return r->mac[h % r->num];
+}
+
 /*
  * Called by layer 4, transport, when it wants to send data to the
  * host identified by host_address.
@@ -77,27 +283,43 @@ void l3_linkup( const char* other_hostname, int other_port, int other_mac_addres
  */
 int l3_send( int dest_address, const char* buf, int length )
 {
+    return l3_send_prio( dest_address, buf, length, L2_PRIO_DATA );
+}
+
+/*
+ * Like l3_send, with a traffic class for the link layer
+ * (L2_PRIO_CONTROL or L2_PRIO_DATA).
+ */
+int l3_send_prio( int dest_address, const char* buf, int length, int prio )
+{
+    struct L3State*  l3 = this_node->l3;
+    unsigned char*   l2buf;
     int              mac_address;
-    char*            l2buf;
-    struct L3Header* hdr_pointer;
+    int              hlen;
     int              retval;
 
-    mac_address = host_to_mac_map[dest_address];
+    if( dest_address < 0 || dest_address >= MAX_ADDRESSES )
+    {
+        return -1;
+    }
+    if( l3->routes[dest_address].num == 0 )
+    {
+        l3->no_route++;
+        return -1;
+    }
 
-    l2buf = (char*)malloc( length+sizeof(struct L3Header) );
+    l2buf = (unsigned char*)malloc( length+L3_MAX_HEADER );
     if( l2buf == 0 )
     {
-        fprintf( stderr, "Not enough memory in l3_send\n" );
+        logmsg_limited( LL_ERROR, "Not enough memory in l3_send\n" );
         return -1;
     }
 
-    memcpy( &l2buf[sizeof(struct L3Header)], buf, length );
-
-    hdr_pointer = (struct L3Header*)l2buf;
-    hdr_pointer->dst_address = htonl(dest_address);
-    hdr_pointer->src_address = htonl(own_host_address);
+    hlen = put_header( l2buf, l3->own_host_address, dest_address, L3_PROTO_TRANSPORT, prio, L3_TTL );
+    memcpy( &l2buf[hlen], buf, length );
+    mac_address = next_hop( &l3->routes[dest_address], l2buf, hlen, length+hlen, prio );
 
-    retval = l2_send( mac_address, l2buf, length+sizeof(struct L3Header) );
+    retval = l2_send_prio( mac_address, (char*)l2buf, length+hlen, prio );
     free(l2buf);
     if( retval < 0 )
     {
@@ -105,41 +327,275 @@ int l3_send( int dest_address, const char* buf, int length )
     }
     else
     {
-        return retval-sizeof(struct L3Header);
+        return retval-hlen;
     }
 }
 
 /*
- * Called by layer 2, link, when it has received data and wants to
- * deliver it.
+ * Send a packet of another protocol than transport to a direct
+ * neighbour. The routing protocol uses this.
+ */
+int l3_send_neighbour( int mac_address, int proto, const char* buf, int length )
+{
+    unsigned char* l2buf;
+    int            hlen;
+    int            retval;
+
+    l2buf = (unsigned char*)malloc( length+L3_MAX_HEADER );
+    if( l2buf == 0 )
+    {
+        logmsg_limited( LL_ERROR, "Not enough memory in l3_send_neighbour\n" );
+        return -1;
+    }
+
+    hlen = put_header( l2buf, this_node->l3->own_host_address, mac_address, proto, L2_PRIO_CONTROL, 1 );
+    memcpy( &l2buf[hlen], buf, length );
+    retval = l2_send_prio( mac_address, (char*)l2buf, length+hlen, L2_PRIO_CONTROL );
+    free( l2buf );
+    return retval < 0 ? -1 : retval-hlen;
+}
+
+/*
+ * Receive the packets to a group from now on, or not any more.
+ */
+void l3_join( int group )
+{
+    if( group >= 0 && group < MAX_GROUPS )
+    {
+        this_node->l3->groups[group] = 1;
+    }
+}
+
+void l3_leave( int group )
+{
+    if( group > L3_GROUP_ALL && group < MAX_GROUPS )
+    {
+        this_node->l3->groups[group] = 0;
+    }
+}
+
+/*
+ * Send a shared packet to the neighbours below us in the tree of
+ * the source. Returns the number of neighbours.
+ */
+static int fan_out( int src_address, int from_mac, l2buf_t* b )
+{
+    int macs[MAX_CHILDREN];
+    int num, i;
+
+    num = route_children( src_address, from_mac, macs, MAX_CHILDREN );
+    for( i=0; i<num; i++ )
+    {
+        l2_send_buf( macs[i], b, L2_PRIO_DATA );
+    }
+    return num;
+}
+
+/*
+ * Called by layer 4 to send a packet to all members of a group. The
+ * packet is the transport header hdr followed by buf, which are
+ * copied once into the buffer that all neighbours share.
+ * Returns length, or -1 if an error has occured.
+ */
+int l3_send_group( int group, const char* hdr, int hlen, const char* buf, int length )
+{
+    struct L3State* l3 = this_node->l3;
+    unsigned char   l3hdr[L3_MAX_HEADER];
+    l2buf_t*        b;
+    int             l3hlen;
+
+    l3hlen = put_header( l3hdr, l3->own_host_address, group, L3_PROTO_MULTICAST, L2_PRIO_DATA, L3_TTL );
+
+    b = l2_buf_alloc( l3hlen+hlen+length );
+    if( b == 0 )
+    {
+        logmsg_limited( LL_ERROR, "Not enough memory in l3_send_group\n" );
+        return -1;
+    }
+    memcpy( b->data, l3hdr, l3hlen );
+    memcpy( b->data+l3hlen, hdr, hlen );
+    memcpy( b->data+l3hlen+hlen, buf, length );
+
+    fan_out( l3->own_host_address, -1, b );
+    l2_buf_put( b );
+    l3->group_sent++;
+    return length;
+}
+
+/*
+ * A group packet has arrived from the neighbour from_mac. Send it on
+ * down the tree, and give it to layer 4 if we are a member.
+ */
+static int recv_group( int from_mac, const char* buf, int length, struct L3Header* hdr, int hlen )
+{
+    struct L3State* l3 = this_node->l3;
+    l2buf_t*        b;
+    int             src = hdr->src_address;
+
+    if( src == l3->own_host_address || src < 0 || src >= MAX_ADDRESSES
+        || l3->routes[src].num == 0 || l3->routes[src].mac[0] != from_mac )
+    {
+        l3->group_dups++;
+        return length;
+    }
+
+    if( hdr->ttl > 1 )
+    {
+        b = l2_buf_alloc( length );
+        if( b != 0 )
+        {
+            memcpy( b->data, buf, length );
+            b->data[hlen-1]--;
+            if( fan_out( src, from_mac, b ) > 0 )
+            {
+                l3->group_forwarded++;
+            }
+            l2_buf_put( b );
+        }
+    }
+    else
+    {
+        l3->ttl_drops++;
+    }
+
+    if( hdr->dst_address >= 0 && hdr->dst_address < MAX_GROUPS && l3->groups[hdr->dst_address] )
+    {
+        l3->group_received++;
+        l4_recv( src, buf+hlen, length-hlen );
+    }
+    return length;
+}
+
+/*
+ * How many bytes at the start of a packet are the same for all
+ * packets of a flow: our header and the static part of the
+ * transport header. Layer 2 uses this to hash packets into flows
+ * and for header compression. Returns 0 if the packet is broken.
+ */
+int l3_static_header_len( const char* buf, int length )
+{
+    struct L3Header hdr;
+    int             hlen;
+    int             l4len;
+
+    hlen = parse_header( (const unsigned char*)buf, length, &hdr );
+    if( hlen < 0 || hdr.proto != L3_PROTO_TRANSPORT )
+    {
+        return 0;
+    }
+    l4len = l4_static_header_len( buf+hlen, length-hlen );
+    return l4len > 0 ? hlen + l4len : 0;
+}
+
+/*
+ * Send a packet for another host on towards it, with a smaller hop
+ * limit.
+ */
+static int forward( const char* buf, int length, struct L3Header* hdr, int hlen )
+{
+    struct L3State* l3 = this_node->l3;
+    unsigned char*  copy;
+    int             retval;
+
+    if( hdr->ttl <= 1 )
+    {
+        l3->ttl_drops++;
+        return -1;
+    }
+    if( hdr->dst_address < 0 || hdr->dst_address >= MAX_ADDRESSES
+        || l3->routes[hdr->dst_address].num == 0 )
+    {
+        l3->no_route++;
+        return -1;
+    }
+
+    copy = (unsigned char*)malloc( length );
+    if( copy == 0 )
+    {
+        return -1;
+    }
+    memcpy( copy, buf, length );
+    copy[hlen-1]--;
+
+    retval = l2_send_prio( next_hop( &l3->routes[hdr->dst_address], copy, hlen, length,
+                                     hdr->prio ? L2_PRIO_DATA : L2_PRIO_CONTROL ),
+                           (char*)copy, length, hdr->prio ? L2_PRIO_DATA : L2_PRIO_CONTROL );
+    free( copy );
+    if( retval > 0 )
+    {
+        l3->forwarded++;
+    }
+    return retval;
+}
+
+/*
+ * Called by layer 2, link, when it has received data from the
+ * neighbour mac_address and wants to deliver it.
  * A positive return value means that all data has been delivered.
  * A zero return value means that the receiver can not receive the
  * data right now.
  * A negative return value means that an error has occured and
  * receiving failed.
  *
- * NOTE:
- * Packet forwarding should be added here when it becomes relevant.
- * Routing is usually not included in layer 3 code, but sits beside
- * it. But routing can call functions of layer 3 to update
- * forwarding information.
+ * Routing is not included in this code, but sits beside it in
+ * l3_route.c. It calls l3_set_route() to update the forwarding
+ * information.
  */
 int l3_recv( int mac_address, const char* buf, int length )
 {
-    const struct L3Header* hdr_pointer;
-    const char*            l4buf;
-    int                    dest_address;
-    int                    src_address;
+    struct L3Header hdr;
+    int             hlen;
 
-    hdr_pointer   = (const struct L3Header*)buf;
-    src_address   = ntohl(hdr_pointer->src_address);
-    dest_address  = ntohl(hdr_pointer->dst_address);
-    if( dest_address != own_host_address )
+    hlen = parse_header( (const unsigned char*)buf, length, &hdr );
+    if( hlen < 0 )
     {
-        /* no packet forwarding yet */
         return -1;
     }
 
-    l4buf = buf + sizeof(struct L3Header);
-    return l4_recv( src_address, l4buf, length-sizeof(struct L3Header) );
+    if( hdr.proto == L3_PROTO_ROUTING )
+    {
+        route_recv( hdr.src_address, buf+hlen, length-hlen );
+        return length;
+    }
+    if( hdr.proto == L3_PROTO_MULTICAST )
+    {
+        return recv_group( mac_address, buf, length, &hdr, hlen );
+    }
+
+    if( hdr.dst_address != this_node->l3->own_host_address )
+    {
+        return forward( buf, length, &hdr, hlen );
+    }
+
+    return l4_recv( hdr.src_address, buf+hlen, length-hlen );
+}
+
+/*
+ * Print the forwarding table and what has been forwarded.
+ */
+void l3_print_stats( )
+{
+    struct L3State* l3 = this_node->l3;
+    int             dest, i;
+
+    fprintf( stderr, "network layer (%s):\n"
+                     "    %lu packets forwarded, %lu dropped at hop limit, %lu without route\n"
+                     "    multicast: %lu sent, %lu forwarded, %lu received, %lu duplicates dropped\n",
+                     multipath == L3_MP_STRIPE ? "striping" : "flow hash",
+                     l3->forwarded, l3->ttl_drops, l3->no_route,
+                     l3->group_sent, l3->group_forwarded, l3->group_received, l3->group_dups );
+    route_print_stats( );
+    for( dest=0; dest<MAX_ADDRESSES; dest++ )
+    {
+        if( l3->routes[dest].num == 0 )
+        {
+            continue;
+        }
+        fprintf( stderr, "    %d via", dest );
+        for( i=0; i<l3->routes[dest].num; i++ )
+        {
+            fprintf( stderr, " %d", l3->routes[dest].mac[i] );
+        }
+        fprintf( stderr, ", %d hops\n", route_metric( dest ) );
+    }
 }
@@ -3,11 +3,47 @@
 
 /* see comments in the c file */
 
+#define L3_MAX_PATHS 4
+
+/*
+ * Protocols carried by the network layer.
+ */
+enum
+{
+    L3_PROTO_TRANSPORT = 0,
+    L3_PROTO_ROUTING,
+    L3_PROTO_MULTICAST
+};
+
+/*
+ * The group that every node is a member of.
+ */
+#define L3_GROUP_ALL 0
+
+/*
+ * Ways to spread packets over equal-cost paths.
+ */
+enum
+{
+    L3_MP_HASH = 0,
+    L3_MP_STRIPE
+};
+
 void l3_init( int self );
 void l3_linkup( const char* other_hostname, int other_port, int other_mac_address );
+void l3_linkdown( int other_mac_address );
+void l3_set_multipath( int mode );
+void l3_set_route( int dest_address, const int* macs, int num );
+void l3_print_stats( );
+void l3_join( int group );
+void l3_leave( int group );
 
 int  l3_send( int host_address, const char* buf, int length );
+int  l3_send_prio( int host_address, const char* buf, int length, int prio );
+int  l3_send_group( int group, const char* hdr, int hlen, const char* buf, int length );
+int  l3_send_neighbour( int mac_address, int proto, const char* buf, int length );
 int  l3_recv( int mac_address, const char* buf, int length );
+int  l3_static_header_len( const char* buf, int length );
 
 #endif /* L3_NET_H */
 
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "node.h"
+#include "irq.h"
+#include "l3_net.h"
+#include "l3_route.h"
+#include "varint.h"
+#include "logger.h"
+#include "checkpoint.h"
+
+#define MAX_ADDRESSES 1024
+
+/*
+ * Routing sits beside the network layer. It is a distance vector
+ * protocol (like RIP) with the number of hops as metric:
+ *
+ *   Every node sends its distances to all destinations it can reach
+ *   to its neighbours, every ROUTE_PERIOD ms and ROUTE_TRIGGER ms
+ *   after a change. An advert is a list of (varint destination,
+ *   one byte metric) and replaces the last advert of that
+ *   neighbour. Destinations that are reached through the neighbour
+ *   itself are left out (split horizon with poisoned reverse).
+ *
+ *   The distance to a destination is the smallest distance of a
+ *   neighbour plus one. All neighbours with that distance are next
+ *   hops (equal-cost multipath), up to L3_MAX_PATHS of them. The
+ *   network layer chooses among them for every packet.
+ *
+ *   ROUTE_INF hops is unreachable. It ends counting to infinity
+ *   when a part of the network is cut off.
+ *
+ * The next hops of a destination are sorted by MAC address. The
+ * first one is its parent in the tree of shortest paths to it, which
+ * multicast uses to forward the packets of a source only once. A
+ * node tells its parent so: instead of leaving the destination out of
+ * the advert to it, it sends the metric ROUTE_CHILD. The parent keeps
+ * that in the neighbour's distances, where it counts as unreachable.
+ */
+#define ROUTE_INF     16
+#define ROUTE_CHILD   0x80   /* unreachable through me, you are my parent */
+#define ROUTE_PERIOD  1000   /* ms between periodic adverts */
+#define ROUTE_TRIGGER 10     /* ms from a change to its advert */
+
+struct Neighbour
+{
+    int                mac;
+    unsigned char*     dist;   /* MAX_ADDRESSES distances from its last advert */
+    struct Neighbour*  next;
+};
+typedef struct Neighbour neighbour_t;
+
+/*
+ * The private state of the routing protocol of one node.
+ */
+struct RoutingState
+{
+    int            self;
+    neighbour_t*   neighbours;
+    int            num_neighbours;
+
+    unsigned char  metric[MAX_ADDRESSES];
+    unsigned char  paths[MAX_ADDRESSES];
+    int            hop[MAX_ADDRESSES][L3_MAX_PATHS];
+
+    int            period_timer;
+    int            trigger_timer;
+
+    unsigned long  adverts_sent;
+    unsigned long  adverts_received;
+};
+
+static neighbour_t* add_neighbour( struct RoutingState* r, int mac_address );
+static void         recompute( struct RoutingState* r );
+static void         periodic( void* param );
+
+static void timer_in( int* timer, int ms, void (*cb)(void*), void* param )
+{
+    struct timeval now;
+    struct timeval delay;
+
+    delay.tv_sec  = ms / 1000;
+    delay.tv_usec = (ms % 1000) * 1000;
+    irq_get_time( &now );
+    timeradd( &now, &delay, &now );
+    *timer = register_timeout_cb( now, cb, param );
+}
+
+/*
+ * Call at the start of the program, from l3_init.
+ */
+void route_init( int self )
+{
+    struct RoutingState* r;
+    int                  i;
+
+    r = (struct RoutingState*)calloc( 1, sizeof(struct RoutingState) );
+    if( r == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in route_init\n" );
+        exit( -1 );
+    }
+    this_node->routing = r;
+
+    r->self          = self;
+    r->period_timer  = -1;
+    r->trigger_timer = -1;
+    memset( r->metric, ROUTE_INF, sizeof(r->metric) );
+    if( self >= 0 && self < MAX_ADDRESSES )
+    {
+        r->metric[self] = 0;
+    }
+
+    /* the neighbours of the links that layer 1 has restored, with
+     * their last adverts, so that there are routes at once
+     */
+    for( i=0; i<CKPT_LINKS; i++ )
+    {
+        ckpt_link_t* l = checkpoint_link( i );
+        neighbour_t* n;
+        if( l == NULL || l->remote_mac < 0 || l->remote_mac >= MAX_ADDRESSES )
+        {
+            continue;
+        }
+        n = add_neighbour( r, l->remote_mac );
+        if( n != NULL )
+        {
+            memcpy( n->dist, l->dist, MAX_ADDRESSES );
+            n->dist[n->mac] = 0;
+        }
+    }
+    if( r->num_neighbours > 0 )
+    {
+        recompute( r );
+        timer_in( &r->period_timer, ROUTE_PERIOD, &periodic, r );
+    }
+}
+
+/*
+ * Does dest go through the neighbour mac?
+ */
+static int is_next_hop( struct RoutingState* r, int dest, int mac )
+{
+    int i;
+
+    for( i=0; i<r->paths[dest]; i++ )
+    {
+        if( r->hop[dest][i] == mac )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void send_advert( struct RoutingState* r, neighbour_t* n )
+{
+    unsigned char* buf;
+    int            len = 0;
+    int            dest;
+
+    buf = (unsigned char*)malloc( MAX_ADDRESSES * (VARINT_MAX+1) );
+    if( buf == 0 )
+    {
+        return;
+    }
+    for( dest=0; dest<MAX_ADDRESSES; dest++ )
+    {
+        if( r->metric[dest] >= ROUTE_INF )
+        {
+            continue;
+        }
+        if( dest != n->mac && !is_next_hop( r, dest, n->mac ) )
+        {
+            len += varint_put( &buf[len], dest );
+            buf[len++] = r->metric[dest];
+        }
+        else if( r->hop[dest][0] == n->mac )
+        {
+            len += varint_put( &buf[len], dest );
+            buf[len++] = ROUTE_CHILD;
+        }
+    }
+    if( l3_send_neighbour( n->mac, L3_PROTO_ROUTING, (char*)buf, len ) >= 0 )
+    {
+        r->adverts_sent++;
+    }
+    free( buf );
+}
+
+static void send_adverts( struct RoutingState* r )
+{
+    neighbour_t* n;
+
+    for( n=r->neighbours; n; n=n->next )
+    {
+        send_advert( r, n );
+    }
+}
+
+/*
+ * Timeout callback: tell the neighbours about a change.
+ */
+static void triggered( void* param )
+{
+    struct RoutingState* r = (struct RoutingState*)param;
+
+    r->trigger_timer = -1;
+    send_adverts( r );
+}
+
+/*
+ * Timeout callback: the periodic advert. It repairs lost adverts.
+ */
+static void periodic( void* param )
+{
+    struct RoutingState* r = (struct RoutingState*)param;
+
+    r->period_timer = -1;
+    if( r->neighbours == NULL )
+    {
+        return;
+    }
+    send_adverts( r );
+    timer_in( &r->period_timer, ROUTE_PERIOD, &periodic, r );
+}
+
+static void trigger( struct RoutingState* r )
+{
+    if( r->trigger_timer < 0 )
+    {
+        timer_in( &r->trigger_timer, ROUTE_TRIGGER, &triggered, r );
+    }
+}
+
+static void sort_hops( int* hop, int num )
+{
+    int i, j, t;
+
+    for( i=1; i<num; i++ )
+    {
+        for( j=i; j>0 && hop[j-1] > hop[j]; j-- )
+        {
+            t = hop[j]; hop[j] = hop[j-1]; hop[j-1] = t;
+        }
+    }
+}
+
+/*
+ * Compute the routes from the adverts of all neighbours and give the
+ * ones that have changed to the network layer.
+ */
+static void recompute( struct RoutingState* r )
+{
+    neighbour_t* n;
+    int          hop[L3_MAX_PATHS];
+    int          best, paths;
+    int          changed = 0;
+    int          dest;
+
+    for( dest=0; dest<MAX_ADDRESSES; dest++ )
+    {
+        if( dest == r->self )
+        {
+            continue;
+        }
+
+        best  = ROUTE_INF;
+        paths = 0;
+        for( n=r->neighbours; n; n=n->next )
+        {
+            if( n->dist[dest] + 1 < best )
+            {
+                best   = n->dist[dest] + 1;
+                hop[0] = n->mac;
+                paths  = 1;
+            }
+            else if( n->dist[dest] + 1 == best && paths < L3_MAX_PATHS )
+            {
+                hop[paths++] = n->mac;
+            }
+        }
+        if( best >= ROUTE_INF )
+        {
+            best  = ROUTE_INF;
+            paths = 0;
+        }
+        sort_hops( hop, paths );
+
+        if( best != r->metric[dest] || paths != r->paths[dest]
+            || memcmp( hop, r->hop[dest], paths * sizeof(int) ) != 0 )
+        {
+            r->metric[dest] = best;
+            r->paths[dest]  = paths;
+            memcpy( r->hop[dest], hop, paths * sizeof(int) );
+            l3_set_route( dest, hop, paths );
+            changed = 1;
+        }
+    }
+
+    if( changed )
+    {
+        trigger( r );
+    }
+}
+
+/*
+ * Called by layer 3 when a link to a neighbour is up. The neighbour
+ * is one hop away until it tells us more.
+ */
+static neighbour_t* add_neighbour( struct RoutingState* r, int mac_address )
+{
+    neighbour_t* n;
+
+    n = (neighbour_t*)calloc( 1, sizeof(neighbour_t) );
+    if( n == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in route_linkup\n" );
+        return NULL;
+    }
+    n->dist = (unsigned char*)malloc( MAX_ADDRESSES );
+    if( n->dist == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in route_linkup\n" );
+        free( n );
+        return NULL;
+    }
+    memset( n->dist, ROUTE_INF, MAX_ADDRESSES );
+    n->dist[mac_address] = 0;
+    n->mac               = mac_address;
+    n->next              = r->neighbours;
+    r->neighbours        = n;
+    r->num_neighbours++;
+    return n;
+}
+
+void route_linkup( int mac_address )
+{
+    struct RoutingState* r = this_node->routing;
+    neighbour_t*         n;
+
+    if( mac_address < 0 || mac_address >= MAX_ADDRESSES )
+    {
+        return;
+    }
+
+    for( n=r->neighbours; n; n=n->next )
+    {
+        if( n->mac == mac_address )
+        {
+            return;
+        }
+    }
+
+    n = add_neighbour( r, mac_address );
+    if( n == NULL )
+    {
+        return;
+    }
+    checkpoint_route( mac_address, n->dist );
+
+    recompute( r );
+    if( r->period_timer < 0 )
+    {
+        timer_in( &r->period_timer, ROUTE_PERIOD, &periodic, r );
+    }
+}
+
+/*
+ * Called by layer 3 when the link to a neighbour is down. Everything
+ * it has told us is forgotten.
+ */
+void route_linkdown( int mac_address )
+{
+    struct RoutingState* r = this_node->routing;
+    neighbour_t**        pp;
+    neighbour_t*         n;
+
+    for( pp=&r->neighbours; (n = *pp) != NULL; pp=&n->next )
+    {
+        if( n->mac == mac_address )
+        {
+            *pp = n->next;
+            free( n->dist );
+            free( n );
+            r->num_neighbours--;
+            recompute( r );
+            return;
+        }
+    }
+}
+
+/*
+ * Called by layer 3 when an advert from a neighbour has arrived.
+ */
+void route_recv( int src_address, const char* buf, int length )
+{
+    struct RoutingState* r = this_node->routing;
+    const unsigned char* p = (const unsigned char*)buf;
+    neighbour_t*         n;
+    unsigned int         dest;
+    int                  pos = 0;
+    int                  len;
+
+    for( n=r->neighbours; n && n->mac != src_address; n=n->next )
+        ;
+    if( n == NULL )
+    {
+        return;
+    }
+    r->adverts_received++;
+
+    memset( n->dist, ROUTE_INF, MAX_ADDRESSES );
+    n->dist[n->mac] = 0;
+    while( pos < length )
+    {
+        if( (len = varint_get( &p[pos], length-pos, &dest )) < 0 || pos+len >= length )
+        {
+            break;
+        }
+        pos += len;
+        if( dest < MAX_ADDRESSES && (p[pos] < ROUTE_INF || p[pos] == ROUTE_CHILD) )
+        {
+            n->dist[dest] = p[pos];
+        }
+        pos++;
+    }
+    checkpoint_route( n->mac, n->dist );
+
+    recompute( r );
+}
+
+/*
+ * The number of hops to a destination, ROUTE_INF if it can't be
+ * reached.
+ */
+int route_metric( int dest_address )
+{
+    if( dest_address < 0 || dest_address >= MAX_ADDRESSES )
+    {
+        return ROUTE_INF;
+    }
+    return this_node->routing->metric[dest_address];
+}
+
+/*
+ * The neighbours that a multicast packet from src_address, which has
+ * arrived from from_mac (-1 if we are the source), must be sent to:
+ * those whose parent towards the source we are. They have told us so
+ * with ROUTE_CHILD. Neighbours that reach the source through us only
+ * on another of their shortest paths would drop the packet, and those
+ * without a route don't want it. Returns the number written to macs.
+ */
+int route_children( int src_address, int from_mac, int* macs, int max )
+{
+    struct RoutingState* r = this_node->routing;
+    neighbour_t*         n;
+    int                  num = 0;
+
+    if( src_address < 0 || src_address >= MAX_ADDRESSES )
+    {
+        return 0;
+    }
+    for( n=r->neighbours; n && num < max; n=n->next )
+    {
+        if( n->mac != from_mac && n->dist[src_address] == ROUTE_CHILD )
+        {
+            macs[num++] = n->mac;
+        }
+    }
+    return num;
+}
+
+void route_print_stats( )
+{
+    struct RoutingState* r = this_node->routing;
+
+    fprintf( stderr, "    routing: %d neighbours, %lu adverts sent, %lu received\n",
+                     r->num_neighbours, r->adverts_sent, r->adverts_received );
+}
@@ -0,0 +1,14 @@
+#ifndef L3_ROUTE_H
+#define L3_ROUTE_H
+
+/* see comments in the c file */
+
+void route_init( int self );
+void route_linkup( int mac_address );
+void route_linkdown( int mac_address );
+void route_recv( int src_address, const char* buf, int length );
+int  route_metric( int dest_address );
+int  route_children( int src_address, int from_mac, int* macs, int max );
+void route_print_stats( );
+
+#endif /* L3_ROUTE_H */
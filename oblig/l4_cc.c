@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "l4_cc.h"
+
+/*
+ * Congestion control algorithms of the transport layer. Each
+ * connection has an l4cc_t and picks one of the algorithms below.
+ * The transport layer calls l4_cc_on_ack for every acknowledgement
+ * that acknowledges new data, l4_cc_on_loss when it retransmits
+ * after duplicate acknowledgements, and l4_cc_on_timeout when the
+ * retransmission timer has expired. It keeps at most cwnd bytes in
+ * flight and spaces the segments according to pacing_rate.
+ */
+
+#define INITIAL_CWND   (4*L4_MSS)
+#define MAX_CWND       (4*1024*1024)
+#define MIN_RTT_WINDOW 10000000LL     /* us */
+
+#define CUBIC_C        0.4
+#define CUBIC_BETA     0.7
+
+#define BBR_HIGH_GAIN  2.885
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW };
+
+static const double bbr_cycle_gain[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static int max_int( int a, int b )
+{
+    return a > b ? a : b;
+}
+
+/*
+ * Window based algorithms pace at a multiple of cwnd per RTT, so
+ * that the window is spread over the round trip instead of being
+ * sent in one burst. The gain leaves room to grow the window.
+ */
+static void window_pacing( l4cc_t* cc )
+{
+    double gain = cc->cwnd < cc->ssthresh ? 2.0 : 1.2;
+
+    if( cc->srtt > 0 )
+    {
+        cc->pacing_rate = gain * cc->cwnd * 1e6 / cc->srtt;
+    }
+}
+
+/*
+ * Reno: slow start, then one MSS per window of acknowledged data.
+ * Halve the window on loss, restart from one MSS on a timeout.
+ */
+static void reno_on_ack( l4cc_t* cc, const struct L4CCSample* s )
+{
+    if( cc->cwnd < cc->ssthresh )
+    {
+        cc->cwnd += s->acked;
+    }
+    else
+    {
+        cc->u.reno.acked += s->acked;
+        if( cc->u.reno.acked >= cc->cwnd )
+        {
+            cc->u.reno.acked -= cc->cwnd;
+            cc->cwnd += L4_MSS;
+        }
+    }
+    window_pacing( cc );
+}
+
+static void reno_on_loss( l4cc_t* cc, int inflight )
+{
+    cc->ssthresh = max_int( inflight/2, 2*L4_MSS );
+    cc->cwnd     = cc->ssthresh;
+    window_pacing( cc );
+}
+
+static void reno_on_timeout( l4cc_t* cc, int inflight )
+{
+    cc->ssthresh = max_int( inflight/2, 2*L4_MSS );
+    cc->cwnd     = L4_MSS;
+}
+
+/*
+ * CUBIC (RFC 8312): after a loss the window grows along a cubic
+ * function of the time since the loss, which is flat around the
+ * window where the loss happened. It never grows slower than Reno
+ * would.
+ */
+static void cubic_init( l4cc_t* cc )
+{
+    cc->u.cubic.epoch_start = 0;
+    cc->u.cubic.w_max       = 0;
+}
+
+static void cubic_on_ack( l4cc_t* cc, const struct L4CCSample* s )
+{
+    double cwnd = (double)cc->cwnd / L4_MSS;
+    double t;
+    double target;
+
+    if( cc->cwnd < cc->ssthresh )
+    {
+        cc->cwnd += s->acked;
+        window_pacing( cc );
+        return;
+    }
+
+    if( cc->u.cubic.epoch_start == 0 )
+    {
+        cc->u.cubic.epoch_start = s->now;
+        if( cc->u.cubic.w_max < cwnd )
+        {
+            cc->u.cubic.k     = 0;
+            cc->u.cubic.w_max = cwnd;
+        }
+        else
+        {
+            cc->u.cubic.k = cbrt( (cc->u.cubic.w_max - cwnd) / CUBIC_C );
+        }
+        cc->u.cubic.w_est = cwnd;
+    }
+
+    t      = (s->now - cc->u.cubic.epoch_start + cc->min_rtt) / 1e6;
+    target = CUBIC_C * pow( t - cc->u.cubic.k, 3 ) + cc->u.cubic.w_max;
+
+    cc->u.cubic.w_est += 3 * (1-CUBIC_BETA) / (1+CUBIC_BETA) * s->acked / cc->cwnd;
+    if( cc->u.cubic.w_est > target )
+    {
+        target = cc->u.cubic.w_est;
+    }
+    if( target > 1.5 * cwnd )
+    {
+        target = 1.5 * cwnd;
+    }
+
+    if( target > cwnd )
+    {
+        cc->u.cubic.carry += (target - cwnd) / cwnd * s->acked;
+        cc->cwnd          += (int)cc->u.cubic.carry;
+        cc->u.cubic.carry -= (int)cc->u.cubic.carry;
+    }
+    window_pacing( cc );
+}
+
+static void cubic_reduce( l4cc_t* cc )
+{
+    double cwnd = (double)cc->cwnd / L4_MSS;
+
+    /* fast convergence: give way if the window keeps shrinking */
+    if( cwnd < cc->u.cubic.w_max )
+        cc->u.cubic.w_max = cwnd * (1+CUBIC_BETA) / 2;
+    else
+        cc->u.cubic.w_max = cwnd;
+
+    cc->u.cubic.epoch_start = 0;
+    cc->ssthresh = max_int( (int)(cc->cwnd * CUBIC_BETA), 2*L4_MSS );
+}
+
+static void cubic_on_loss( l4cc_t* cc, int inflight )
+{
+    cubic_reduce( cc );
+    cc->cwnd = cc->ssthresh;
+    window_pacing( cc );
+}
+
+static void cubic_on_timeout( l4cc_t* cc, int inflight )
+{
+    cubic_reduce( cc );
+    cc->cwnd = L4_MSS;
+}
+
+/*
+ * A BBR-like model based algorithm. It estimates the bottleneck
+ * bandwidth as the maximum delivery rate of the last rounds and the
+ * propagation delay as the minimum RTT, paces at the bandwidth and
+ * keeps about two bandwidth-delay products in flight. Single losses
+ * do not change the model.
+ * STARTUP doubles the rate every round until the bandwidth stops
+ * growing, DRAIN removes the queue that STARTUP has built, and
+ * PROBE_BW cycles the pacing gain to look for more bandwidth now and
+ * then.
+ */
+static void bbr_init( l4cc_t* cc )
+{
+    memset( &cc->u.bbr, 0, sizeof(cc->u.bbr) );
+    cc->u.bbr.mode = BBR_STARTUP;
+}
+
+static void bbr_on_ack( l4cc_t* cc, const struct L4CCSample* s )
+{
+    double bw = 0;
+    double bdp;
+    double pacing_gain;
+    double cwnd_gain;
+    int    i;
+    int    slot;
+
+    if( s->round_start )
+    {
+        cc->u.bbr.round++;
+        cc->u.bbr.bw[cc->u.bbr.round % BBR_BW_ROUNDS] = 0;
+    }
+    slot = cc->u.bbr.round % BBR_BW_ROUNDS;
+    if( s->delivery_rate > cc->u.bbr.bw[slot] )
+    {
+        cc->u.bbr.bw[slot] = s->delivery_rate;
+    }
+    for( i=0; i<BBR_BW_ROUNDS; i++ )
+    {
+        if( cc->u.bbr.bw[i] > bw ) bw = cc->u.bbr.bw[i];
+    }
+
+    if( bw == 0 || cc->min_rtt <= 0 )
+    {
+        /* no model yet */
+        cc->cwnd += s->acked;
+        return;
+    }
+    bdp = bw * cc->min_rtt / 1e6;
+
+    if( cc->u.bbr.mode == BBR_STARTUP && s->round_start )
+    {
+        if( bw >= cc->u.bbr.full_bw * 1.25 )
+        {
+            cc->u.bbr.full_bw       = bw;
+            cc->u.bbr.full_bw_count = 0;
+        }
+        else if( ++cc->u.bbr.full_bw_count >= 3 )
+        {
+            cc->u.bbr.mode = BBR_DRAIN;
+        }
+    }
+    if( cc->u.bbr.mode == BBR_DRAIN && s->inflight <= bdp )
+    {
+        cc->u.bbr.mode        = BBR_PROBE_BW;
+        cc->u.bbr.cycle       = 0;
+        cc->u.bbr.cycle_stamp = s->now;
+    }
+    if( cc->u.bbr.mode == BBR_PROBE_BW && s->now - cc->u.bbr.cycle_stamp > cc->min_rtt )
+    {
+        cc->u.bbr.cycle       = (cc->u.bbr.cycle + 1) % 8;
+        cc->u.bbr.cycle_stamp = s->now;
+    }
+
+    switch( cc->u.bbr.mode )
+    {
+    case BBR_STARTUP :
+        pacing_gain = BBR_HIGH_GAIN;
+        cwnd_gain   = BBR_HIGH_GAIN;
+        break;
+    case BBR_DRAIN :
+        pacing_gain = 1 / BBR_HIGH_GAIN;
+        cwnd_gain   = BBR_HIGH_GAIN;
+        break;
+    default :
+        pacing_gain = bbr_cycle_gain[cc->u.bbr.cycle];
+        cwnd_gain   = 2;
+        break;
+    }
+
+    cc->pacing_rate = pacing_gain * bw;
+    cc->cwnd        = max_int( (int)(cwnd_gain * bdp), 4*L4_MSS );
+}
+
+static void bbr_on_loss( l4cc_t* cc, int inflight )
+{
+}
+
+static void bbr_on_timeout( l4cc_t* cc, int inflight )
+{
+    /* the next acknowledgement restores the window from the model */
+    cc->cwnd = L4_MSS;
+}
+
+static const struct L4CCOps algorithms[] =
+{
+    { "reno",  NULL,        &reno_on_ack,  &reno_on_loss,  &reno_on_timeout },
+    { "cubic", &cubic_init, &cubic_on_ack, &cubic_on_loss, &cubic_on_timeout },
+    { "bbr",   &bbr_init,   &bbr_on_ack,   &bbr_on_loss,   &bbr_on_timeout }
+};
+
+/*
+ * Look up an algorithm by name. Returns NULL if there is none.
+ */
+const struct L4CCOps* l4_cc_find( const char* name )
+{
+    int i;
+
+    for( i=0; i<sizeof(algorithms)/sizeof(algorithms[0]); i++ )
+    {
+        if( !strcmp( algorithms[i].name, name ) )
+        {
+            return &algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+void l4_cc_init( l4cc_t* cc, const struct L4CCOps* ops )
+{
+    memset( cc, 0, sizeof(l4cc_t) );
+    cc->ops      = ops;
+    cc->cwnd     = INITIAL_CWND;
+    cc->ssthresh = MAX_CWND;
+    if( ops->init )
+    {
+        ops->init( cc );
+    }
+}
+
+void l4_cc_on_ack( l4cc_t* cc, const struct L4CCSample* s )
+{
+    cc->srtt = s->srtt;
+    if( s->rtt >= 0 )
+    {
+        if( cc->min_rtt == 0 || s->rtt <= cc->min_rtt || s->now - cc->min_rtt_stamp > MIN_RTT_WINDOW )
+        {
+            cc->min_rtt       = s->rtt;
+            cc->min_rtt_stamp = s->now;
+        }
+    }
+
+    cc->ops->on_ack( cc, s );
+    if( cc->cwnd > MAX_CWND )
+    {
+        cc->cwnd = MAX_CWND;
+    }
+}
+
+void l4_cc_on_loss( l4cc_t* cc, int inflight )
+{
+    cc->ops->on_loss( cc, inflight );
+}
+
+void l4_cc_on_timeout( l4cc_t* cc, int inflight )
+{
+    cc->ops->on_timeout( cc, inflight );
+}
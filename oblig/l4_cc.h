@@ -0,0 +1,92 @@
+#ifndef L4_CC_H
+#define L4_CC_H
+
+/* see comments in the c file */
+
+/*
+ * The unit of the congestion window. Segments can be smaller, the
+ * window is counted in bytes.
+ */
+#define L4_MSS 1024
+
+/*
+ * What the transport layer knows when an acknowledgement arrives.
+ */
+struct L4CCSample
+{
+    long long now;            /* us */
+    int       acked;          /* bytes newly acknowledged */
+    long long rtt;            /* us, -1 if the ack is ambiguous (Karn) */
+    long long srtt;           /* us, 0 before the first sample */
+    int       inflight;       /* bytes still in flight after this ack */
+    double    delivery_rate;  /* bytes/s, 0 if there is no sample */
+    int       round_start;    /* the first ack of a new round trip */
+};
+
+#define BBR_BW_ROUNDS 10
+
+/*
+ * The state of one connection's congestion control. The transport
+ * layer reads cwnd and pacing_rate, the rest belongs to the
+ * algorithm.
+ */
+struct L4CC
+{
+    const struct L4CCOps* ops;
+
+    int       cwnd;           /* bytes */
+    double    pacing_rate;    /* bytes/s, 0 is not paced */
+
+    int       ssthresh;
+    long long srtt;
+    long long min_rtt;        /* us, over the last 10 seconds */
+    long long min_rtt_stamp;
+
+    union
+    {
+        struct
+        {
+            int       acked;          /* bytes acked towards the next MSS */
+        } reno;
+        struct
+        {
+            double    w_max;          /* segments */
+            double    k;              /* s */
+            double    w_est;          /* segments, Reno-friendly estimate */
+            double    carry;          /* bytes of growth below one byte */
+            long long epoch_start;
+        } cubic;
+        struct
+        {
+            int       mode;
+            double    bw[BBR_BW_ROUNDS];   /* max delivery rate per round */
+            int       round;
+            double    full_bw;
+            int       full_bw_count;
+            int       cycle;
+            long long cycle_stamp;
+        } bbr;
+    } u;
+};
+typedef struct L4CC l4cc_t;
+
+/*
+ * A congestion control algorithm.
+ */
+struct L4CCOps
+{
+    const char* name;
+    void (*init)( l4cc_t* cc );
+    void (*on_ack)( l4cc_t* cc, const struct L4CCSample* s );
+    void (*on_loss)( l4cc_t* cc, int inflight );
+    void (*on_timeout)( l4cc_t* cc, int inflight );
+};
+
+const struct L4CCOps* l4_cc_find( const char* name );
+
+void l4_cc_init( l4cc_t* cc, const struct L4CCOps* ops );
+void l4_cc_on_ack( l4cc_t* cc, const struct L4CCSample* s );
+void l4_cc_on_loss( l4cc_t* cc, int inflight );
+void l4_cc_on_timeout( l4cc_t* cc, int inflight );
+
+#endif /* L4_CC_H */
@@ -1,48 +1,1162 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <math.h>
 #include <arpa/inet.h>
 
+#include "irq.h"
+#include "node.h"
+#include "l2_link.h"
 #include "l3_net.h"
+#include "l4_cc.h"
 #include "l4_trans.h"
 #include "l5_app.h"
+#include "lz.h"
+#include "varint.h"
+#include "logger.h"
 
 #define MAX_PORTS 1024
 
 /*
- * The transport layer header that is include in every datagram
- * or segment.
+ * Reliable connections. Every l4_send is one segment, and segments
+ * are numbered. The receiver delivers them in order and acknowledges
+ * cumulatively with the number of the next segment it expects and
+ * the number of segments it still has room for. The sender keeps
+ * segments until they are acknowledged.
+ *
+ * Segments that arrive out of order, over another path or after a
+ * loss, are kept in a ring of RCV_WINDOW slots indexed by sequence
+ * number, so that storing one and finding the next in order costs
+ * the same at any window size. The acknowledgements also carry up
+ * to L4_MAX_SACK ranges of segments that are kept beyond a gap
+ * (selective acknowledgements, most recent first). After
+ * DUPACK_THRESH duplicate acknowledgements the sender resends only
+ * the gaps below the highest selectively acknowledged segment.
+ * When the retransmission timer expires, it goes back to the first
+ * unacknowledged segment and skips those that the receiver has.
+ * How much the sender may have in flight, and how fast it sends it,
+ * is decided by the connection's congestion control (l4_cc.c).
+ *
+ * Segments to a group of hosts (l4_send_group) are datagrams outside
+ * of any connection. They are delivered once or not at all.
+ */
+#define CONN_BUCKETS   256
+#define SND_BUFFER     1024       /* segments a connection queues */
+#define RCV_WINDOW     1024       /* segments kept by the receiver, a power of 2 */
+#define SACK_RANGES    8          /* ranges the receiver remembers */
+#define L4_MAX_SACK    4          /* ranges in one acknowledgement */
+#define RTO_INITIAL    1000000    /* us */
+#define RTO_MIN        200000
+#define RTO_MAX        60000000
+#define DUPACK_THRESH  3
+#define RETRY_INTERVAL 10000      /* us until we offer a refused segment again */
+
+enum
+{
+    L4_DATA = 1,
+    L4_ACK,
+    L4_DGRAM              /* to a group, not acknowledged */
+};
+
+/*
+ * Payload compression. Every header says that its sender can
+ * decompress, and a connection that has compression switched on
+ * compresses its segments once it has heard that from the other
+ * side. Segments that are short, that look incompressible to a
+ * quick entropy probe, or that don't get smaller are sent as they
+ * are.
+ */
+#define L4_F_CAN_DECOMPRESS 0x1
+#define L4_F_COMPRESSED     0x2
+
+#define COMPRESS_MIN        64     /* bytes */
+#define ENTROPY_LIMIT       0.85   /* of what the probe can measure at most */
+#define MAX_SEGMENT         65536
+
+/*
+ * The transport layer header that is included in every segment.
+ * On the wire it is packed:
+ *   dest_port     16 bits
+ *   src_port      16 bits
+ *   type, flags   4 bits each
+ *   seq           the lowest 16 bits
+ *   window        varint, ACK only
+ *   SACK ranges   ACK only, the rest of the segment: pairs of varints,
+ *                 the start after seq and the length
+ * The ports come first and don't change during a connection, so that
+ * layer 2 can treat them as part of the flow's static header.
+ */
+struct L4Header
+{
+    int      dest_port;
+    int      src_port;
+    int      type;
+    unsigned seq;       /* DATA: this segment, ACK: the next one expected */
+    unsigned window;    /* ACK: segments the receiver has room for */
+    unsigned flags;
+    int      num_sack;  /* ACK: ranges [start, end) beyond seq */
+    unsigned sack[L4_MAX_SACK][2];
+};
+
+#define L4_STATIC_HEADER 4
+#define L4_MAX_HEADER    (7 + VARINT_MAX + L4_MAX_SACK*2*VARINT_MAX)
+
+/*
+ * A segment in the send or receive queue of a connection.
+ */
+struct L4Segment
+{
+    unsigned          seq;
+    int               length;
+    int               retransmitted;
+    int               compressed;
+    int               sacked;            /* the receiver has it, beyond a gap */
+    long long         sent;              /* us, 0 if never sent */
+    long long         delivered;         /* the connection's when sent */
+    long long         delivered_time;
+    struct L4Segment* next;
+    char              data[];
+};
+typedef struct L4Segment segment_t;
+
+/*
+ * A connection is identified by the remote address and port and the
+ * local port. It carries data in both directions.
+ */
+struct L4Conn
+{
+    int            remote_address;
+    int            remote_port;
+    int            local_port;
+    struct L4Conn* next;
+
+    /* sending */
+    segment_t*     snd_head;         /* the oldest unacknowledged */
+    segment_t*     snd_tail;
+    segment_t*     snd_next;         /* the next to send, NULL if none */
+    int            snd_len;
+    unsigned       snd_una;
+    unsigned       snd_nxt;
+    unsigned       snd_max;          /* one after the highest ever sent */
+    unsigned       next_seq;
+    unsigned       peer_window;
+    int            inflight;         /* bytes */
+    int            dupacks;
+    int            in_recovery;
+    unsigned       recover;          /* recovery ends when this is acked */
+    unsigned       sack_high;        /* one after the highest sacked segment */
+    long long      srtt;             /* us, 0 before the first sample */
+    long long      rttvar;
+    long long      rto;
+    int            rto_timer;
+    int            pace_timer;
+    long long      next_send_time;
+    long long      delivered;        /* bytes acknowledged so far */
+    long long      delivered_time;
+    long long      round_delivered;  /* a new round starts when this is acked */
+    l4cc_t         cc;
+
+    /* receiving */
+    unsigned       rcv_next;         /* the first segment not received in order */
+    unsigned       rcv_deliver;      /* the first not given to the application */
+    segment_t**    rx_ring;          /* RCV_WINDOW slots, allocated when needed */
+    int            num_ranges;
+    unsigned       ranges[SACK_RANGES][2];
+    int            retry_timer;
+    int            window_closed;    /* we have advertised no room */
+    int            send_blocked;     /* l4_send was refused, tell l5 about room */
+
+    /* compression */
+    int            compress;
+    int            peer_decompresses;
+
+    /* statistics */
+    unsigned long  segs_sent;
+    unsigned long  retransmits;
+    unsigned long  timeouts;
+    unsigned long  sacked;           /* segments the peer had beyond a gap */
+    unsigned long  reordered;        /* received beyond a gap */
+    unsigned long  comp_segments;    /* sent compressed */
+    unsigned long  comp_skipped;     /* the probe said no */
+    unsigned long  comp_failed;      /* didn't get smaller */
+    long long      comp_in;          /* bytes before and after compression */
+    long long      comp_out;
+    long long      comp_ns;          /* time spent compressing */
+    unsigned long  decomp_segments;
+    long long      decomp_ns;
+};
+typedef struct L4Conn l4conn_t;
+
+/*
+ * The private state of the transport layer of one node.
+ */
+struct L4State
+{
+    /*
+     * The transport layer needs to maintain private information about
+     * the ports that an application uses to communicate. In real
+     * operating systems, ports do not have to be globally unique.
+     * That is a simplification, and you are welcome to fix it.
+     */
+    int       port_to_process_map[MAX_PORTS];
+
+    l4conn_t* conns[CONN_BUCKETS];
+};
+
+/*
+ * The congestion control of new connections, the same for all nodes.
+ */
+static const struct L4CCOps* default_cc = NULL;
+
+/*
+ * Whether new connections compress, the same for all nodes.
+ */
+static int default_compress = 0;
+
+static long long now_us( )
+{
+    struct timeval now;
+    irq_get_time( &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static long long now_ns( )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void timer_at( int* timer, long long when, void (*cb)(void*), void* param )
+{
+    struct timeval tv;
+
+    tv.tv_sec  = when / 1000000;
+    tv.tv_usec = when % 1000000;
+    *timer = register_timeout_cb( tv, cb, param );
+}
+
+static void timer_stop( int* timer )
+{
+    if( *timer >= 0 )
+    {
+        remove_timeout( *timer );
+        *timer = -1;
+    }
+}
+
+/* sequence numbers wrap around */
+static int seq_before( unsigned int a, unsigned int b )
+{
+    return (int)(a - b) < 0;
+}
+
+static segment_t* segment_alloc( unsigned seq, const char* buf, int length )
+{
+    segment_t* s = (segment_t*)calloc( 1, sizeof(segment_t) + length );
+    if( s )
+    {
+        s->seq    = seq;
+        s->length = length;
+        memcpy( s->data, buf, length );
+    }
+    return s;
+}
+
+static int conn_bucket( int remote_address, int remote_port, int local_port )
+{
+    unsigned h = remote_address * 2654435761u ^ remote_port * 40503u ^ local_port;
+    return h % CONN_BUCKETS;
+}
+
+/*
+ * Find the connection, and create it if create is set.
+ */
+static l4conn_t* conn_find( int remote_address, int remote_port, int local_port, int create )
+{
+    struct L4State* l4 = this_node->l4;
+    int             b  = conn_bucket( remote_address, remote_port, local_port );
+    l4conn_t*       c;
+
+    for( c=l4->conns[b]; c; c=c->next )
+    {
+        if( c->remote_address == remote_address && c->remote_port == remote_port && c->local_port == local_port )
+        {
+            return c;
+        }
+    }
+    if( !create )
+    {
+        return NULL;
+    }
+
+    c = (l4conn_t*)calloc( 1, sizeof(l4conn_t) );
+    if( c == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in conn_find\n" );
+        return NULL;
+    }
+    c->remote_address = remote_address;
+    c->remote_port    = remote_port;
+    c->local_port     = local_port;
+    c->peer_window    = RCV_WINDOW;
+    c->rto            = RTO_INITIAL;
+    c->rto_timer      = -1;
+    c->pace_timer     = -1;
+    c->retry_timer    = -1;
+    c->compress       = default_compress;
+    l4_cc_init( &c->cc, default_cc ? default_cc : l4_cc_find( "reno" ) );
+
+    c->next = l4->conns[b];
+    l4->conns[b] = c;
+    return c;
+}
+
+static void conn_free( l4conn_t* c )
+{
+    segment_t* s;
+    int        i;
+
+    timer_stop( &c->rto_timer );
+    timer_stop( &c->pace_timer );
+    timer_stop( &c->retry_timer );
+    while( (s = c->snd_head) != NULL )
+    {
+        c->snd_head = s->next;
+        free( s );
+    }
+    if( c->rx_ring )
+    {
+        for( i=0; i<RCV_WINDOW; i++ )
+        {
+            free( c->rx_ring[i] );
+        }
+        free( c->rx_ring );
+    }
+    free( c );
+}
+
+static int send_header_and_data( l4conn_t* c, int type, unsigned seq, unsigned window,
+                                 unsigned flags, const char* buf, int length, int prio )
+{
+    unsigned char* l3buf;
+    int            hlen;
+    int            retval;
+    int            i;
+
+    l3buf = (unsigned char*)malloc( length+L4_MAX_HEADER );
+    if( l3buf == 0 )
+    {
+        logmsg_limited( LL_ERROR, "Not enough memory in send_header_and_data\n" );
+        return -1;
+    }
+
+    put16( &l3buf[0], c->remote_port );
+    put16( &l3buf[2], c->local_port );
+    l3buf[4] = type | (flags | L4_F_CAN_DECOMPRESS) << 4;
+    put16( &l3buf[5], seq );
+    hlen = 7;
+    if( type == L4_ACK )
+    {
+        hlen += varint_put( &l3buf[hlen], window );
+        for( i=0; i<c->num_ranges && i<L4_MAX_SACK; i++ )
+        {
+            hlen += varint_put( &l3buf[hlen], c->ranges[i][0] - seq );
+            hlen += varint_put( &l3buf[hlen], c->ranges[i][1] - c->ranges[i][0] );
+        }
+    }
+
+    memcpy( &l3buf[hlen], buf, length );
+
+    retval = l3_send_prio( c->remote_address, (char*)l3buf, length+hlen, prio );
+    free(l3buf);
+    return retval;
+}
+
+/*
+ * Parse a packed header. Returns its length, or -1 if it is broken.
+ */
+static int parse_header( const unsigned char* buf, int length, struct L4Header* hdr )
+{
+    unsigned start, len;
+    int      hlen = 7;
+    int      n, m;
+
+    if( length < hlen )
+    {
+        return -1;
+    }
+    hdr->dest_port = get16( &buf[0] );
+    hdr->src_port  = get16( &buf[2] );
+    hdr->type      = buf[4] & 0xf;
+    hdr->flags     = buf[4] >> 4;
+    hdr->seq       = get16( &buf[5] );
+    hdr->window    = 0;
+    hdr->num_sack  = 0;
+    if( hdr->type == L4_ACK )
+    {
+        n = varint_get( &buf[hlen], length-hlen, &hdr->window );
+        if( n < 0 )
+        {
+            return -1;
+        }
+        hlen += n;
+
+        while( hlen < length && hdr->num_sack < L4_MAX_SACK )
+        {
+            if( (n = varint_get( &buf[hlen], length-hlen, &start )) < 0
+             || (m = varint_get( &buf[hlen+n], length-hlen-n, &len )) < 0 )
+            {
+                return -1;
+            }
+            hlen += n + m;
+            hdr->sack[hdr->num_sack][0] = start;
+            hdr->sack[hdr->num_sack][1] = start + len;
+            hdr->num_sack++;
+        }
+    }
+    return hlen;
+}
+
+/*
+ * How many bytes at the start of a segment are the same in all
+ * segments of its connection: the ports.
+ */
+int l4_static_header_len( const char* buf, int length )
+{
+    return length >= L4_STATIC_HEADER ? L4_STATIC_HEADER : 0;
+}
+
+/*
+ * Acknowledge everything up to rcv_next. Acks go ahead of data in
+ * the link layer's queues.
+ */
+static void send_ack( l4conn_t* c )
+{
+    unsigned window = RCV_WINDOW - (c->rcv_next - c->rcv_deliver);
+
+    c->window_closed = (window == 0);
+    send_header_and_data( c, L4_ACK, c->rcv_next, window, 0, NULL, 0, L2_PRIO_CONTROL );
+}
+
+static void rto_expired( void* param );
+
+static void arm_rto( l4conn_t* c )
+{
+    if( c->rto_timer < 0 )
+    {
+        timer_at( &c->rto_timer, now_us( ) + c->rto, &rto_expired, c );
+    }
+}
+
+/*
+ * Put a segment on the wire. A segment that went out before is a
+ * retransmission, and gives no RTT sample.
+ */
+static void send_segment( l4conn_t* c, segment_t* s, long long now )
+{
+    if( s->sent )
+    {
+        s->retransmitted = 1;
+        c->retransmits++;
+    }
+    s->sent           = now;
+    s->delivered      = c->delivered;
+    s->delivered_time = c->delivered_time ? c->delivered_time : now;
+
+    c->segs_sent++;
+    send_header_and_data( c, L4_DATA, s->seq, 0, s->compressed ? L4_F_COMPRESSED : 0,
+                          s->data, s->length, L2_PRIO_DATA );
+}
+
+/*
+ * Send the segment at snd_next, and advance snd_next.
+ */
+static void transmit( l4conn_t* c, long long now )
+{
+    segment_t* s = c->snd_next;
+
+    send_segment( c, s, now );
+
+    c->inflight += s->length;
+    c->snd_nxt   = s->seq + 1;
+    if( seq_before( c->snd_max, c->snd_nxt ) )
+    {
+        c->snd_max = c->snd_nxt;
+    }
+    c->snd_next = s->next;
+
+    if( c->cc.pacing_rate > 0 )
+    {
+        if( c->next_send_time < now ) c->next_send_time = now;
+        c->next_send_time += (long long)(s->length * 1e6 / c->cc.pacing_rate);
+    }
+    arm_rto( c );
+}
+
+static void pace( void* param );
+
+/*
+ * The receiver has the segments that it has acknowledged selectively.
+ * They are not sent again.
+ */
+static void skip_sacked( l4conn_t* c )
+{
+    segment_t* s;
+
+    while( (s = c->snd_next) != NULL && s->sacked )
+    {
+        c->snd_nxt  = s->seq + 1;
+        c->snd_next = s->next;
+    }
+}
+
+/*
+ * Send what the congestion window, the receiver's window and the
+ * pacing rate allow. If pacing holds a segment back, a timer sends
+ * it later.
+ */
+static void output( l4conn_t* c )
+{
+    long long now = now_us( );
+
+    skip_sacked( c );
+    while( c->snd_next != NULL
+        && c->inflight < c->cc.cwnd
+        && seq_before( c->snd_next->seq, c->snd_una + c->peer_window ) )
+    {
+        if( c->next_send_time > now )
+        {
+            if( c->pace_timer < 0 )
+            {
+                timer_at( &c->pace_timer, c->next_send_time, &pace, c );
+            }
+            return;
+        }
+        transmit( c, now );
+        skip_sacked( c );
+    }
+
+    /* probe a closed window when the timer expires */
+    if( c->snd_next != NULL && c->inflight == 0 )
+    {
+        arm_rto( c );
+    }
+}
+
+static void pace( void* param )
+{
+    l4conn_t* c = (l4conn_t*)param;
+
+    c->pace_timer = -1;
+    output( c );
+}
+
+/*
+ * Resend everything from the first unacknowledged segment, except
+ * what the receiver has acknowledged selectively.
+ */
+static void go_back( l4conn_t* c )
+{
+    c->snd_next = c->snd_head;
+    c->snd_nxt  = c->snd_una;
+    c->inflight = 0;
+}
+
+static void rto_expired( void* param )
+{
+    l4conn_t* c   = (l4conn_t*)param;
+    long long now = now_us( );
+
+    c->rto_timer = -1;
+    if( c->snd_head == NULL )
+    {
+        return;
+    }
+
+    /* Karn: back off until an unambiguous RTT sample arrives */
+    c->rto *= 2;
+    if( c->rto > RTO_MAX ) c->rto = RTO_MAX;
+
+    if( c->peer_window == 0 )
+    {
+        /* The receiver has no room. Probe it, the network is fine. */
+        go_back( c );
+        transmit( c, now );
+    }
+    else
+    {
+        c->timeouts++;
+        l4_cc_on_timeout( &c->cc, c->inflight );
+        c->in_recovery    = 0;
+        c->dupacks        = 0;
+        c->next_send_time = now;
+        go_back( c );
+        output( c );
+    }
+}
+
+/*
+ * Jacobson's RTT estimator with the RTO of RFC 6298.
+ */
+static void rtt_sample( l4conn_t* c, long long rtt )
+{
+    if( c->srtt == 0 )
+    {
+        c->srtt   = rtt;
+        c->rttvar = rtt / 2;
+    }
+    else
+    {
+        long long err = c->srtt > rtt ? c->srtt - rtt : rtt - c->srtt;
+        c->rttvar = (3 * c->rttvar + err) / 4;
+        c->srtt   = (7 * c->srtt + rtt) / 8;
+    }
+
+    c->rto = c->srtt + 4 * c->rttvar;
+    if( c->rto < RTO_MIN ) c->rto = RTO_MIN;
+    if( c->rto > RTO_MAX ) c->rto = RTO_MAX;
+}
+
+/*
+ * Mark the segments in the SACK ranges of an acknowledgement. They
+ * have left the network.
+ */
+static void handle_sack( l4conn_t* c, unsigned ack, struct L4Header* hdr )
+{
+    segment_t* s;
+    unsigned   start, end;
+    int        i;
+
+    for( i=0; i<hdr->num_sack; i++ )
+    {
+        start = ack + hdr->sack[i][0];
+        end   = ack + hdr->sack[i][1];
+        if( seq_before( c->snd_max, end ) )
+        {
+            continue;
+        }
+        for( s=c->snd_head; s && seq_before( s->seq, end ); s=s->next )
+        {
+            if( !s->sacked && !seq_before( s->seq, start ) )
+            {
+                s->sacked = 1;
+                c->sacked++;
+                if( seq_before( s->seq, c->snd_nxt ) )
+                {
+                    c->inflight -= s->length;
+                }
+            }
+        }
+        if( seq_before( c->sack_high, end ) )
+        {
+            c->sack_high = end;
+        }
+    }
+}
+
+/*
+ * Resend the segments in the gaps below the highest sacked segment
+ * that were sent at least min_age us ago. Only these have been lost;
+ * the segments above it may still be on their way.
+ */
+static void resend_gaps( l4conn_t* c, long long now, long long min_age )
+{
+    segment_t* s;
+
+    for( s=c->snd_head; s && seq_before( s->seq, c->sack_high ); s=s->next )
+    {
+        if( !s->sacked && s->sent && now - s->sent >= min_age && seq_before( s->seq, c->snd_nxt ) )
+        {
+            send_segment( c, s, now );
+        }
+    }
+}
+
+static void handle_ack( l4conn_t* c, unsigned ack, struct L4Header* hdr )
+{
+    struct L4CCSample sample;
+    segment_t*        s;
+    segment_t*        newest = NULL;
+    long long         now    = now_us( );
+    int               acked  = 0;
+
+    c->peer_window = hdr->window;
+    if( hdr->num_sack > 0 && !seq_before( ack, c->snd_una ) )
+    {
+        handle_sack( c, ack, hdr );
+    }
+
+    if( seq_before( c->snd_una, ack ) && !seq_before( c->snd_max, ack ) )
+    {
+        while( (s = c->snd_head) != NULL && seq_before( s->seq, ack ) )
+        {
+            if( s == c->snd_next )
+            {
+                /* acked from an earlier round, before we went back */
+                c->snd_next = s->next;
+            }
+            else if( seq_before( s->seq, c->snd_nxt ) && !s->sacked )
+            {
+                c->inflight -= s->length;
+            }
+            acked += s->length;
+
+            c->snd_head = s->next;
+            c->snd_len--;
+            free( newest );
+            newest = s;
+        }
+        if( c->snd_head == NULL ) c->snd_tail = NULL;
+        if( seq_before( c->snd_nxt, ack ) ) c->snd_nxt = ack;
+        c->snd_una = ack;
+        c->dupacks = 0;
+
+        memset( &sample, 0, sizeof(sample) );
+        sample.now = now;
+        sample.rtt = -1;
+        if( !newest->retransmitted )
+        {
+            sample.rtt = now - newest->sent;
+            rtt_sample( c, sample.rtt );
+        }
+
+        c->delivered     += acked;
+        c->delivered_time = now;
+        if( now > newest->delivered_time )
+        {
+            sample.delivery_rate = (c->delivered - newest->delivered) * 1e6 / (now - newest->delivered_time);
+        }
+        if( newest->delivered >= c->round_delivered )
+        {
+            sample.round_start = 1;
+            c->round_delivered = c->delivered;
+        }
+        free( newest );
+
+        if( c->in_recovery && !seq_before( ack, c->recover ) )
+        {
+            c->in_recovery = 0;
+        }
+        else if( c->in_recovery )
+        {
+            resend_gaps( c, now, c->srtt );
+        }
+
+        sample.acked    = acked;
+        sample.srtt     = c->srtt;
+        sample.inflight = c->inflight;
+        l4_cc_on_ack( &c->cc, &sample );
+
+        timer_stop( &c->rto_timer );
+        if( c->inflight > 0 )
+        {
+            arm_rto( c );
+        }
+        output( c );
+
+        if( c->send_blocked && c->snd_len < SND_BUFFER )
+        {
+            c->send_blocked = 0;
+            l5_writable( c->remote_address, c->remote_port, c->local_port );
+        }
+        return;
+    }
+    else if( ack == c->snd_una && c->in_recovery )
+    {
+        /* more gaps may have shown up, resend them once per round trip */
+        resend_gaps( c, now, c->srtt );
+    }
+    else if( ack == c->snd_una && (c->inflight > 0 || seq_before( c->snd_una, c->sack_high )) )
+    {
+        if( ++c->dupacks == DUPACK_THRESH )
+        {
+            l4_cc_on_loss( &c->cc, c->inflight );
+            c->in_recovery = 1;
+            c->recover     = c->snd_max;
+            if( seq_before( c->snd_una, c->sack_high ) )
+            {
+                resend_gaps( c, now, 0 );
+            }
+            else
+            {
+                go_back( c );
+            }
+        }
+    }
+
+    output( c );
+}
+
+/*
+ * Give the segments from rcv_deliver up to rcv_next to the
+ * application, in order. Returns 0 if it refuses one.
  */
-struct L4Header
+static int deliver_queued( l4conn_t* c )
 {
-    int dest_port;
-    int src_port;
-};
+    int        dest_pid = this_node->l4->port_to_process_map[c->local_port];
+    segment_t* s;
+    int        slot;
+
+    while( seq_before( c->rcv_deliver, c->rcv_next ) )
+    {
+        slot = c->rcv_deliver & (RCV_WINDOW-1);
+        s    = c->rx_ring[slot];
+        if( l5_recv( dest_pid, c->remote_address, c->remote_port, s->data, s->length ) <= 0 )
+        {
+            return 0;
+        }
+        c->rx_ring[slot] = NULL;
+        c->rcv_deliver++;
+        free( s );
+    }
+    return 1;
+}
+
+static void retry_deliver( void* param )
+{
+    l4conn_t* c = (l4conn_t*)param;
+
+    c->retry_timer = -1;
+    if( !deliver_queued( c ) )
+    {
+        timer_at( &c->retry_timer, now_us( ) + RETRY_INTERVAL, &retry_deliver, c );
+    }
+    if( c->window_closed && c->rcv_next - c->rcv_deliver < RCV_WINDOW )
+    {
+        /* tell the sender that there is room again */
+        send_ack( c );
+    }
+}
+
+/*
+ * Remember that seq has arrived beyond a gap. The range that it
+ * joins moves to the front, so that the most recent ones are
+ * reported.
+ */
+static void range_add( l4conn_t* c, unsigned seq )
+{
+    unsigned r[2] = { seq, seq+1 };
+    int      i, j;
+
+    for( i=0; i<c->num_ranges; i++ )
+    {
+        if( c->ranges[i][1] == seq || c->ranges[i][0] == seq+1 )
+        {
+            if( seq_before( c->ranges[i][0], r[0] ) ) r[0] = c->ranges[i][0];
+            if( seq_before( r[1], c->ranges[i][1] ) ) r[1] = c->ranges[i][1];
+            c->ranges[i][0] = c->ranges[i][1] = 0;
+        }
+    }
+
+    /* drop the merged ones, and make room at the front */
+    for( i=j=0; i<c->num_ranges; i++ )
+    {
+        if( c->ranges[i][0] != c->ranges[i][1] && j < SACK_RANGES-1 )
+        {
+            c->ranges[j][0] = c->ranges[i][0];
+            c->ranges[j][1] = c->ranges[i][1];
+            j++;
+        }
+    }
+    memmove( &c->ranges[1], &c->ranges[0], j * sizeof(c->ranges[0]) );
+    c->ranges[0][0] = r[0];
+    c->ranges[0][1] = r[1];
+    c->num_ranges   = j + 1;
+}
+
+/*
+ * Forget the ranges that rcv_next has reached.
+ */
+static void ranges_trim( l4conn_t* c )
+{
+    int i, j;
+
+    for( i=j=0; i<c->num_ranges; i++ )
+    {
+        if( seq_before( c->rcv_next, c->ranges[i][1] ) )
+        {
+            c->ranges[j][0] = c->ranges[i][0];
+            c->ranges[j][1] = c->ranges[i][1];
+            j++;
+        }
+    }
+    c->num_ranges = j;
+}
+
+static void handle_data( l4conn_t* c, unsigned seq, const char* buf, int length )
+{
+    int dest_pid = this_node->l4->port_to_process_map[c->local_port];
+    int slot     = seq & (RCV_WINDOW-1);
+
+    if( seq_before( seq, c->rcv_next ) || !seq_before( seq, c->rcv_deliver + RCV_WINDOW )
+     || (c->rx_ring && c->rx_ring[slot]) )
+    {
+        /* a duplicate, or no room */
+        send_ack( c );
+        return;
+    }
+
+    if( seq == c->rcv_next && c->rcv_deliver == c->rcv_next
+     && l5_recv( dest_pid, c->remote_address, c->remote_port, buf, length ) > 0 )
+    {
+        /* the common case, nothing to keep */
+        c->rcv_next++;
+        c->rcv_deliver++;
+    }
+    else
+    {
+        /* Beyond a gap, or the application is too slow. Keep it. */
+        if( c->rx_ring == NULL )
+        {
+            c->rx_ring = (segment_t**)calloc( RCV_WINDOW, sizeof(segment_t*) );
+        }
+        if( c->rx_ring == NULL || (c->rx_ring[slot] = segment_alloc( seq, buf, length )) == NULL )
+        {
+            send_ack( c );
+            return;
+        }
+        if( seq != c->rcv_next )
+        {
+            c->reordered++;
+            range_add( c, seq );
+        }
+    }
+
+    /* a filled gap makes the kept segments behind it in order */
+    while( seq_before( c->rcv_next, c->rcv_deliver + RCV_WINDOW )
+        && c->rx_ring && c->rx_ring[c->rcv_next & (RCV_WINDOW-1)] )
+    {
+        c->rcv_next++;
+    }
+    ranges_trim( c );
+
+    if( !deliver_queued( c ) && c->retry_timer < 0 )
+    {
+        timer_at( &c->retry_timer, now_us( ) + RETRY_INTERVAL, &retry_deliver, c );
+    }
+
+    /* also for duplicates and gaps, so that the sender learns */
+    send_ack( c );
+}
+
+/*
+ * Make a segment for buf, compressed if the connection wants it and
+ * it is worth it.
+ */
+static segment_t* make_segment( l4conn_t* c, const char* buf, int length )
+{
+    segment_t* s;
+    char*      packed;
+    int        samples = length < 256 ? length : 256;
+    int        n;
+    long long  start;
+
+    if( !c->compress || !c->peer_decompresses || length < COMPRESS_MIN )
+    {
+        return segment_alloc( c->next_seq, buf, length );
+    }
+
+    start = now_ns( );
+    if( lz_entropy( buf, length ) > ENTROPY_LIMIT * log2( samples ) )
+    {
+        c->comp_skipped++;
+        c->comp_ns += now_ns( ) - start;
+        return segment_alloc( c->next_seq, buf, length );
+    }
+
+    packed = (char*)malloc( length );
+    if( packed == 0 )
+    {
+        return NULL;
+    }
+    n = lz_compress( buf, length, packed, length - 1 );
+    c->comp_ns += now_ns( ) - start;
+
+    if( n == 0 )
+    {
+        c->comp_failed++;
+        s = segment_alloc( c->next_seq, buf, length );
+    }
+    else
+    {
+        c->comp_segments++;
+        c->comp_in  += length;
+        c->comp_out += n;
+        s = segment_alloc( c->next_seq, packed, n );
+        if( s ) s->compressed = 1;
+    }
+    free( packed );
+    return s;
+}
+
+/*
+ * Switch compression of new connections on or off, for all nodes.
+ */
+void l4_set_default_compression( int on )
+{
+    default_compress = on;
+}
+
+/*
+ * Switch compression of one connection on or off. The connection is
+ * created if it does not exist yet.
+ */
+int l4_set_compression( int dest_address, int dest_port, int src_port, int on )
+{
+    l4conn_t* c = conn_find( dest_address, dest_port, src_port, 1 );
+
+    if( c == NULL )
+    {
+        return -1;
+    }
+    c->compress = on;
+    return 0;
+}
+
+/*
+ * Choose the congestion control of new connections, for all nodes.
+ * Returns -1 if there is no algorithm with this name.
+ */
+int l4_set_default_cc( const char* name )
+{
+    const struct L4CCOps* ops = l4_cc_find( name );
+
+    if( ops == NULL )
+    {
+        return -1;
+    }
+    default_cc = ops;
+    return 0;
+}
+
+/*
+ * Choose the congestion control of one connection. The connection is
+ * created if it does not exist yet. Returns -1 if there is no
+ * algorithm with this name.
+ */
+int l4_set_cc( int dest_address, int dest_port, int src_port, const char* name )
+{
+    const struct L4CCOps* ops = l4_cc_find( name );
+    l4conn_t*             c;
+    int                   cwnd;
+
+    if( ops == NULL )
+    {
+        return -1;
+    }
+    c = conn_find( dest_address, dest_port, src_port, 1 );
+    if( c == NULL )
+    {
+        return -1;
+    }
+
+    /* keep what the connection has learned about the path */
+    cwnd = c->cc.cwnd;
+    l4_cc_init( &c->cc, ops );
+    c->cc.cwnd = cwnd;
+    return 0;
+}
+
+/*
+ * Print the state of all connections of this node.
+ */
+void l4_print_stats( )
+{
+    struct L4State* l4 = this_node->l4;
+    l4conn_t*       c;
+    int             b;
+
+    for( b=0; b<CONN_BUCKETS; b++ )
+    {
+        for( c=l4->conns[b]; c; c=c->next )
+        {
+            fprintf( stderr, "connection %d -> %d:%d (%s):\n"
+                             "    cwnd %d bytes, %d in flight, %d queued, pacing %.0f bytes/s\n"
+                             "    srtt %.3f ms, rto %.3f ms\n"
+                             "    sent %lu segments, %lu retransmitted, %lu timeouts, %lu sacked\n"
+                             "    received %lu segments out of order, %u waiting for the application\n"
+                             "    compression %s: %lu segments, ratio %.2f, %lu skipped by the probe, %lu incompressible,\n"
+                             "    %.1f us per segment, %lu decompressed in %.1f us each\n",
+                             c->local_port, c->remote_address, c->remote_port, c->cc.ops->name,
+                             c->cc.cwnd, c->inflight, c->snd_len, c->cc.pacing_rate,
+                             c->srtt / 1000.0, c->rto / 1000.0,
+                             c->segs_sent, c->retransmits, c->timeouts, c->sacked,
+                             c->reordered, c->rcv_next - c->rcv_deliver,
+                             c->compress ? (c->peer_decompresses ? "on" : "waiting for the peer") : "off",
+                             c->comp_segments, c->comp_out ? (double)c->comp_in / c->comp_out : 1.0,
+                             c->comp_skipped, c->comp_failed,
+                             c->comp_segments + c->comp_skipped + c->comp_failed
+                                 ? c->comp_ns / 1000.0 / (c->comp_segments + c->comp_skipped + c->comp_failed) : 0.0,
+                             c->decomp_segments,
+                             c->decomp_segments ? c->decomp_ns / 1000.0 / c->decomp_segments : 0.0 );
+        }
+    }
+}
+
+/*
+ * Totals over all connections of this node, for the simulator.
+ */
+void l4_counters( unsigned long* segs_sent, unsigned long* retransmits, unsigned long* timeouts )
+{
+    struct L4State* l4 = this_node->l4;
+    l4conn_t*       c;
+    int             b;
+
+    *segs_sent = *retransmits = *timeouts = 0;
+    for( b=0; b<CONN_BUCKETS; b++ )
+    {
+        for( c=l4->conns[b]; c; c=c->next )
+        {
+            *segs_sent   += c->segs_sent;
+            *retransmits += c->retransmits;
+            *timeouts    += c->timeouts;
+        }
+    }
+}
 
 /*
- * The transport layer needs to maintain private information about
- * the ports that an application uses to communicate. In real
- * operating systems, ports do not have to be globally unique.
- * That is a simplification, and you are welcome to fix it.
+ * The counters of one connection, for PERF. Returns -1 if there is
+ * no such connection.
  */
-static int port_to_process_map[MAX_PORTS];
+int l4_conn_counters( int dest_address, int dest_port, int src_port,
+                      unsigned long* segs_sent, unsigned long* retransmits )
+{
+    l4conn_t* c = conn_find( dest_address, dest_port, src_port, 0 );
+
+    if( c == NULL )
+    {
+        return -1;
+    }
+    *segs_sent   = c->segs_sent;
+    *retransmits = c->retransmits;
+    return 0;
+}
 
 /*
  * Call at the start of the program. Initialize data structures
  * like an operating system would do at boot time. Initialize all
  * the data structures that you want to use for error correction
  * and end-to-end flow control here.
- *
- * NOTE:
- * You have to add many structures if you want a transport layer
- * that supports connection-oriented communication.
  */
 void l4_init( )
 {
+    struct L4State* l4;
     int i;
+
+    l4 = (struct L4State*)calloc( 1, sizeof(struct L4State) );
+    if( l4 == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in l4_init\n" );
+        exit( -1 );
+    }
+    this_node->l4 = l4;
+
     for( i=0; i<MAX_PORTS; i++ )
     {
-        port_to_process_map[i] = -1;
+        l4->port_to_process_map[i] = -1;
     }
 }
 
@@ -54,6 +1168,46 @@ void l4_linkup( int other_address, const char* other_hostname, int other_port )
     l5_linkup( other_address, other_hostname, other_port );
 }
 
+/*
+ * The link to a neighbour is down. Its connections stay while
+ * routing finds another path, see l4_unreachable().
+ */
+void l4_linkdown( int other_address )
+{
+    l5_linkdown( other_address );
+}
+
+/*
+ * Routing has no path to the other host any more. Its connections
+ * are gone.
+ */
+void l4_unreachable( int other_address )
+{
+    struct L4State* l4 = this_node->l4;
+    l4conn_t**      pc;
+    l4conn_t*       c;
+    int             b;
+
+    for( b=0; b<CONN_BUCKETS; b++ )
+    {
+        pc = &l4->conns[b];
+        while( (c = *pc) != NULL )
+        {
+            if( c->remote_address == other_address )
+            {
+                *pc = c->next;
+                conn_free( c );
+            }
+            else
+            {
+                pc = &c->next;
+            }
+        }
+    }
+
+    l5_unreachable( other_address );
+}
+
 /*
  * Allows the application layer to reserve one of the ports for
  * a "process". We don't actually create any processes in the
@@ -67,8 +1221,13 @@ void l4_linkup( int other_address, const char* other_hostname, int other_port )
  */
 int l4_getport( int pid, int desired_port )
 {
+    int* port_to_process_map = this_node->l4->port_to_process_map;
     int i;
-    if( desired_port >= 0 )
+    if( desired_port >= MAX_PORTS )
+    {
+        return -1;
+    }
+    else if( desired_port >= 0 )
     {
         if( port_to_process_map[desired_port] == -1 )
         {
@@ -96,7 +1255,10 @@ int l4_getport( int pid, int desired_port )
  */
 void l4_putport( int port )
 {
-    port_to_process_map[port] = -1;
+    if( port >= 0 && port < MAX_PORTS )
+    {
+        this_node->l4->port_to_process_map[port] = -1;
+    }
 }
 
 /*
@@ -104,63 +1266,143 @@ void l4_putport( int port )
  * host identified by (dest_address,dest_port). The src_port is
  * added by the calling "process" to allow the receive to figure
  * out who the sender is.
+ * The data is queued on the connection and sent when congestion
+ * control allows it.
  * A positive return value means the number of bytes that have been
- * sent.
- * A negative return value means that an error has occured.
+ * accepted.
+ * A negative return value means that an error has occured, or that
+ * the connection's queue is full. In the latter case, l5_writable()
+ * is called when there is room again.
  */
 int l4_send( int dest_address, int dest_port, int src_port, const char* buf, int length )
 {
-    char*            l3buf;
-    struct L4Header* hdr_pointer;
-    int              retval;
+    l4conn_t*  c;
+    segment_t* s;
 
-    l3buf = (char*)malloc( length+sizeof(struct L4Header) );
-    if( l3buf == 0 )
+    if( dest_port < 0 || dest_port >= MAX_PORTS || src_port < 0 || src_port >= MAX_PORTS )
     {
-        fprintf( stderr, "Not enough memory in l4_send\n" );
         return -1;
     }
 
-    memcpy( &l3buf[sizeof(struct L4Header)], buf, length );
-
-    hdr_pointer = (struct L4Header*)l3buf;
-    hdr_pointer->src_port  = htonl(src_port);
-    hdr_pointer->dest_port = htonl(dest_port);
+    c = conn_find( dest_address, dest_port, src_port, 1 );
+    if( c == NULL )
+    {
+        return -1;
+    }
+    if( c->snd_len >= SND_BUFFER )
+    {
+        c->send_blocked = 1;
+        return -1;
+    }
 
-    retval = l3_send( dest_address, l3buf, length+sizeof(struct L4Header) );
-    free(l3buf);
-    if( retval < 0 )
+    s = make_segment( c, buf, length );
+    if( s == 0 )
     {
+        logmsg_limited( LL_ERROR, "Not enough memory in l4_send\n" );
         return -1;
     }
-    else
+    c->next_seq++;
+
+    if( c->snd_tail ) c->snd_tail->next = s;
+    else              c->snd_head = s;
+    c->snd_tail = s;
+    c->snd_len++;
+    if( c->snd_next == NULL ) c->snd_next = s;
+
+    output( c );
+    return length;
+}
+
+/*
+ * Send buf to the port on all hosts of a group. The header is handed
+ * to layer 3 separately, so the data is copied only once.
+ * A positive return value means the number of bytes that have been
+ * sent.
+ * A negative return value means that an error has occured.
+ */
+int l4_send_group( int group, int port, const char* buf, int length )
+{
+    unsigned char hdr[7];
+
+    if( port < 0 || port >= MAX_PORTS )
     {
-        return retval-sizeof(struct L4Header);
+        return -1;
     }
+
+    put16( &hdr[0], port );
+    put16( &hdr[2], port );
+    hdr[4] = L4_DGRAM;
+    put16( &hdr[5], 0 );
+
+    return l3_send_group( group, (char*)hdr, sizeof(hdr), buf, length );
 }
 
 /*
  * Called by layer 3, network, when it has received data for the
  * local host and wants to deliver it.
- * A positive return value means that all data has been delivered.
- * A zero return value means that the receiver can not receive the
- * data right now.
+ * A positive return value means that the segment has been handled.
+ * Segments that the application can not take right now are kept by
+ * the connection.
  * A negative return value means that an error has occured and
  * receiving failed.
  */
 int l4_recv( int src_address, const char* buf, int length )
 {
-    const struct L4Header* hdr_pointer;
-    const char*            l5buf;
-    int                    src_port;
-    int                    dest_port;
-    int                    dest_pid;
+    static char            unpacked[MAX_SEGMENT];
+    struct L4Header        hdr;
+    l4conn_t*              c;
+    const char*            data;
+    int                    data_length;
+    int                    hlen;
+    long long              start;
 
-    hdr_pointer = (const struct L4Header*)buf;
-    src_port    = ntohl(hdr_pointer->src_port);
-    dest_port   = ntohl(hdr_pointer->dest_port);
-    dest_pid    = port_to_process_map[dest_port];
+    hlen = parse_header( (const unsigned char*)buf, length, &hdr );
+    if( hlen < 0 || hdr.dest_port >= MAX_PORTS || hdr.src_port >= MAX_PORTS )
+    {
+        return -1;
+    }
+
+    data        = buf + hlen;
+    data_length = length - hlen;
+
+    switch( hdr.type )
+    {
+    case L4_DATA :
+        c = conn_find( src_address, hdr.src_port, hdr.dest_port, 1 );
+        if( c == NULL )
+        {
+            return 0;
+        }
+        if( hdr.flags & L4_F_CAN_DECOMPRESS ) c->peer_decompresses = 1;
 
-    l5buf = buf + sizeof(struct L4Header);
-    return l5_recv( dest_pid, src_address, src_port, l5buf, length-sizeof(struct L4Header) );
+        if( hdr.flags & L4_F_COMPRESSED )
+        {
+            start       = now_ns( );
+            data_length = lz_decompress( data, data_length, unpacked, sizeof(unpacked) );
+            data        = unpacked;
+            c->decomp_ns += now_ns( ) - start;
+            c->decomp_segments++;
+            if( data_length < 0 )
+            {
+                return -1;
+            }
+        }
+        handle_data( c, expand16( hdr.seq, c->rcv_next ), data, data_length );
+        break;
+    case L4_DGRAM :
+        l5_recv( this_node->l4->port_to_process_map[hdr.dest_port],
+                 src_address, hdr.src_port, data, data_length );
+        break;
+    case L4_ACK :
+        c = conn_find( src_address, hdr.src_port, hdr.dest_port, 0 );
+        if( c != NULL )
+        {
+            if( hdr.flags & L4_F_CAN_DECOMPRESS ) c->peer_decompresses = 1;
+            handle_ack( c, expand16( hdr.seq, c->snd_una ), &hdr );
+        }
+        break;
+    default :
+        return -1;
+    }
+    return length;
 }
@@ -5,12 +5,25 @@
 
 void l4_init( );
 void l4_linkup( int other_address, const char* other_hostname, int other_port );
+void l4_linkdown( int other_address );
+void l4_unreachable( int other_address );
 
 int  l4_getport( int pid, int desired_port );
 void l4_putport( int port );
 
+int  l4_set_default_cc( const char* name );
+int  l4_set_cc( int dest_address, int dest_port, int src_port, const char* name );
+void l4_set_default_compression( int on );
+int  l4_set_compression( int dest_address, int dest_port, int src_port, int on );
+void l4_print_stats( );
+void l4_counters( unsigned long* segs_sent, unsigned long* retransmits, unsigned long* timeouts );
+int  l4_conn_counters( int dest_address, int dest_port, int src_port,
+                       unsigned long* segs_sent, unsigned long* retransmits );
+
 int  l4_send( int dest_address, int dest_port, int src_port, const char* buf, int length );
+int  l4_send_group( int group, int port, const char* buf, int length );
 int  l4_recv( int host_address, const char* buf, int length );
+int  l4_static_header_len( const char* buf, int length );
 
 #endif /* L4_TRANS_H */
 
@@ -1,16 +1,134 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "slow_receiver.h"
+#include "irq.h"
+#include "node.h"
 #include "l5_app.h"
 #include "l1_phys.h"
+#include "l2_link.h"
+#include "l3_net.h"
+#include "l4_trans.h"
+#include "l5_tools.h"
+#include "checkpoint.h"
+#include "logger.h"
+
+/*
+ * STREAM mode reads the rest of stdin in large blocks and sends it
+ * in STREAM_SEGMENT byte pieces. When the transport layer's queue is
+ * full, the keyboard is not watched until l5_writable() says that
+ * there is room again.
+ */
+#define STREAM_BUFFER  65536
+#define STREAM_SEGMENT 1024
+
+/*
+ * Received messages go to the mailbox of the process that owns the
+ * port. A scheduler, run from a timer, hands them to the processes
+ * round robin: L5_QUANTUM messages per process and turn, and at most
+ * L5_BUDGET messages per run, after which the event loop gets its
+ * turn again. A process that refuses a message (slow_receiver
+ * returns 0) is skipped until the next run, and only its own mailbox
+ * fills up. When it is full, the transport layer keeps the segments
+ * of that process and retries.
+ * Ports that no process has taken belong to process 0.
+ * The last process, TOOLS_PID, runs PING and PERF (l5_tools.c).
+ */
+#define MAX_PROCESSES  16
+#define MAILBOX_SIZE   64     /* messages */
+#define L5_QUANTUM     4
+#define L5_BUDGET      64
+#define L5_RETRY       10     /* ms until busy processes are tried again */
+
+struct L5Message
+{
+    int               src_address;
+    int               src_port;
+    int               length;
+    struct L5Message* next;
+    char              data[];
+};
+typedef struct L5Message l5msg_t;
+
+struct Mailbox
+{
+    l5msg_t*      head;
+    l5msg_t*      tail;
+    int           len;
+    unsigned long delivered;
+    unsigned long full;       /* messages refused because the box was full */
+};
+typedef struct Mailbox mailbox_t;
+
+/*
+ * The private state of the application layer of one node.
+ */
+struct L5State
+{
+    int   quiet;          /* don't report link establishment */
+    int   links_up;
+    int   msgs_received;
+    long  bytes_received;
+
+    /* STREAM mode */
+    int   streaming;
+    int   stream_address;
+    int   stream_port;
+    char* stream_buf;
+    int   stream_len;     /* bytes in stream_buf */
+    int   stream_off;     /* of which have been sent */
+    long  stream_sent;
+
+    /* receiving */
+    mailbox_t mailbox[MAX_PROCESSES];
+    int       next_pid;       /* the first process of the next run */
+    int       sched_timer;
+};
+
+static void stream_end( );
 
 /*
  * Initialize however you want.
  */
 void l5_init( )
 {
+    this_node->l5 = (struct L5State*)calloc( 1, sizeof(struct L5State) );
+    if( this_node->l5 == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in l5_init\n" );
+        exit( -1 );
+    }
+    this_node->l5->sched_timer = -1;
+    this_node->l5->links_up    = checkpoint_restored( );
+    tools_init( );
+
+    /* Commands are read without buffering, so that nothing after a
+     * STREAM command is hidden in stdio's buffer.
+     */
+    setvbuf( stdin, NULL, _IONBF, 0 );
+}
+
+/*
+ * Stop reporting every link establishment. The simulator uses this
+ * when it plugs in thousands of cables.
+ */
+void l5_set_quiet( int quiet )
+{
+    this_node->l5->quiet = quiet;
+}
 
+/*
+ * Counters of this node for the simulator's summary.
+ */
+void l5_counters( int* links_up, int* msgs_received, long* bytes_received )
+{
+    *links_up       = this_node->l5->links_up;
+    *msgs_received  = this_node->l5->msgs_received;
+    *bytes_received = this_node->l5->bytes_received;
 }
 
 /*
@@ -18,7 +136,14 @@ void l5_init( )
  */
 void l5_linkup( int other_address, const char* other_hostname, int other_port )
 {
-    fprintf( stderr, "Successfully established a physical link (plugged in a cable)\n"
+    this_node->l5->links_up++;
+
+    if( this_node->l5->quiet )
+    {
+        return;
+    }
+
+    logmsg( LL_INFO, "Successfully established a physical link (plugged in a cable)\n"
                      "with host:port %s:%d.\n"
                      "We can use the address >>%d<< for that machine.\n"
                      "\n",
@@ -27,19 +152,158 @@ void l5_linkup( int other_address, const char* other_hostname, int other_port )
                      other_address );
 }
 
+/*
+ * Report that a physical link has gone down.
+ */
+void l5_linkdown( int other_address )
+{
+    this_node->l5->links_up--;
+
+    if( this_node->l5->quiet )
+    {
+        return;
+    }
+
+    logmsg( LL_INFO, "Lost the physical link to the machine with address >>%d<<.\n"
+                     "\n",
+                     other_address );
+}
+
+/*
+ * There is no path to the other host any more, and the transport
+ * layer has dropped the connections to it.
+ */
+void l5_unreachable( int other_address )
+{
+    if( this_node->l5->streaming && this_node->l5->stream_address == other_address )
+    {
+        /* the connection is gone, and with it what it had queued */
+        irq_enable_keyboard( 0 );
+        stream_end( );
+    }
+}
+
+static void stream_end( )
+{
+    struct L5State* l5 = this_node->l5;
+
+    logmsg( LL_INFO, "Streamed %ld bytes to %d:%d\n",
+                     l5->stream_sent, l5->stream_address, l5->stream_port );
+    free( l5->stream_buf );
+    l5->stream_buf = NULL;
+    l5->streaming  = 0;
+}
+
+/*
+ * Hand the buffered input to the transport layer until it is all
+ * sent or the transport layer's queue is full.
+ */
+static void stream_push( )
+{
+    struct L5State* l5 = this_node->l5;
+    int             n;
+
+    while( l5->stream_off < l5->stream_len )
+    {
+        n = l5->stream_len - l5->stream_off;
+        if( n > STREAM_SEGMENT ) n = STREAM_SEGMENT;
+
+        if( l4_send( l5->stream_address, l5->stream_port, l5->stream_port,
+                     &l5->stream_buf[l5->stream_off], n ) < 0 )
+        {
+            /* wait for l5_writable() */
+            irq_enable_keyboard( 0 );
+            return;
+        }
+        l5->stream_off  += n;
+        l5->stream_sent += n;
+    }
+
+    l5->stream_off = l5->stream_len = 0;
+    irq_enable_keyboard( 1 );
+}
+
+static void stream_read( )
+{
+    struct L5State* l5 = this_node->l5;
+    int             n;
+
+    n = read( STDIN_FILENO, l5->stream_buf, STREAM_BUFFER );
+    if( n < 0 && (errno == EAGAIN || errno == EINTR) )
+    {
+        return;
+    }
+    if( n <= 0 )
+    {
+        if( n < 0 ) logmsg( LL_ERROR, "Error reading stdin: %s\n", strerror( errno ) );
+        irq_enable_keyboard( 0 );
+        stream_end( );
+        return;
+    }
+
+    l5->stream_len = n;
+    l5->stream_off = 0;
+    stream_push( );
+}
+
+static void stream_start( int address, int port )
+{
+    struct L5State* l5 = this_node->l5;
+
+    l5->stream_buf = (char*)malloc( STREAM_BUFFER );
+    if( l5->stream_buf == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in stream_start\n" );
+        return;
+    }
+    l5->streaming      = 1;
+    l5->stream_address = address;
+    l5->stream_port    = port;
+    l5->stream_len     = 0;
+    l5->stream_off     = 0;
+    l5->stream_sent    = 0;
+
+    fcntl( STDIN_FILENO, F_SETFL, fcntl( STDIN_FILENO, F_GETFL ) | O_NONBLOCK );
+}
+
+/*
+ * Called by the transport layer when a connection whose queue was
+ * full can take data again.
+ */
+void l5_writable( int other_address, int other_port, int own_port )
+{
+    struct L5State* l5 = this_node->l5;
+
+    if( l5->streaming && l5->stream_address == other_address
+     && l5->stream_port == other_port && l5->stream_port == own_port )
+    {
+        stream_push( );
+    }
+    tools_writable( other_address, other_port, own_port );
+}
+
 void l5_handle_keyboard( )
 {
     char  buffer[1024];
     char *retval;
 
+    if( this_node->l5->streaming )
+    {
+        stream_read( );
+        return;
+    }
 
     retval = fgets( buffer, sizeof(buffer), stdin );
+    if( retval == 0 && feof( stdin ) )
+    {
+        /* nothing more will come */
+        irq_enable_keyboard( 0 );
+    }
     if( retval != 0 )
     {
         buffer[strlen(buffer)-1] = 0;
 
-        /* debug */
-        fprintf( stderr, "The buffer contains: >>%s<<\n", buffer );
+        logmsg( LL_DEBUG, "The buffer contains: >>%s<<\n", buffer );
 
         if( strstr( buffer, "CONNECT" ) != NULL )
         {
@@ -57,10 +321,111 @@ void l5_handle_keyboard( )
                 /* two matches, we got our hostname and port */
                 device = l1_connect( hostname, port );
 
-                fprintf( stderr,
-                         "Physical connection to host:port %s:%d has device number %d\n",
-                         hostname, port, device );
+                logmsg( LL_INFO,
+                        "Physical connection to host:port %s:%d has device number %d\n",
+                        hostname, port, device );
+
+            }
+        }
 
+        if( strstr( buffer, "STATS" ) != NULL )
+        {
+            /* the reports go after what has been logged */
+            logger_flush( );
+            l1_print_stats( );
+            l2_print_stats( );
+            l3_print_stats( );
+            l4_print_stats( );
+            l5_print_stats( );
+        }
+
+        if( strncmp( buffer, "STREAM ", 7 ) == 0 )
+        {
+            int address;
+            int port;
+
+            /* STREAM <address> <port>: send the rest of stdin there */
+            if( sscanf( buffer, "STREAM %d %d", &address, &port ) == 2 && port >= 0 && port < 1024 )
+            {
+                stream_start( address, port );
+            }
+        }
+
+        if( strncmp( buffer, "COMPRESS ", 9 ) == 0 )
+        {
+            char onoff[8];
+            int  address;
+            int  port;
+
+            /* COMPRESS <address> <port> on|off */
+            if( sscanf( buffer, "COMPRESS %d %d %7s", &address, &port, onoff ) == 3 )
+            {
+                l4_set_compression( address, port, port, !strcmp( onoff, "on" ) );
+            }
+        }
+
+        if( strncmp( buffer, "JOIN ", 5 ) == 0 || strncmp( buffer, "LEAVE ", 6 ) == 0 )
+        {
+            int group;
+
+            /* JOIN <group> or LEAVE <group> */
+            if( sscanf( strchr( buffer, ' ' ), "%d", &group ) == 1 )
+            {
+                if( buffer[0] == 'J' ) l3_join( group );
+                else                   l3_leave( group );
+            }
+        }
+
+        if( strncmp( buffer, "MCAST ", 6 ) == 0 )
+        {
+            int group;
+            int port;
+            int n;
+
+            /* MCAST <group> <port> <text>: send the text to all members */
+            if( sscanf( buffer, "MCAST %d %d %n", &group, &port, &n ) == 2 )
+            {
+                l4_send_group( group, port, &buffer[n], strlen( &buffer[n] ) );
+            }
+        }
+
+        if( strncmp( buffer, "CC ", 3 ) == 0 )
+        {
+            char name[64];
+            int  address;
+            int  port;
+
+            /* CC <address> <port> <algorithm>, for the connection from the same port */
+            if( sscanf( buffer, "CC %d %d %63s", &address, &port, name ) == 3
+             && l4_set_cc( address, port, port, name ) < 0 )
+            {
+                logmsg( LL_WARN, "Unknown congestion control %s\n", name );
+            }
+        }
+
+        if( strncmp( buffer, "PING ", 5 ) == 0 )
+        {
+            int address;
+            int count = 5;
+            int size  = 64;
+
+            /* PING <address> [count] [size] */
+            if( sscanf( buffer, "PING %d %d %d", &address, &count, &size ) >= 1 )
+            {
+                tools_ping( address, count, size );
+            }
+        }
+
+        if( strncmp( buffer, "PERF ", 5 ) == 0 )
+        {
+            int address;
+            int port;
+            int seconds;
+
+            /* PERF <address> <port> <seconds> */
+            if( sscanf( buffer, "PERF %d %d %d", &address, &port, &seconds ) == 3 )
+            {
+                tools_perf( address, port, seconds );
             }
         }
 
@@ -70,7 +435,168 @@ void l5_handle_keyboard( )
     }
 }
 
+static void schedule( int ms );
+
+/*
+ * Give a message to its process. Returns 0 if the process is busy.
+ */
+static int consume( int pid, int src_address, int src_port, const char* buf, int length )
+{
+    struct L5State* l5 = this_node->l5;
+
+    if( pid == TOOLS_PID )
+    {
+        if( !tools_recv( src_address, src_port, buf, length ) )
+        {
+            return 0;
+        }
+        l5->mailbox[pid].delivered++;
+        return 1;
+    }
+    if( slow_receiver( buf, length ) <= 0 )
+    {
+        return 0;
+    }
+    l5->mailbox[pid].delivered++;
+    l5->msgs_received++;
+    l5->bytes_received += length;
+    return 1;
+}
+
+/*
+ * Timeout callback: the scheduler. Drain the mailboxes round robin
+ * within the budget.
+ */
+static void run_processes( void* param )
+{
+    struct L5State* l5     = this_node->l5;
+    int             budget = L5_BUDGET;
+    int             busy   = 0;
+    int             waiting = 0;
+    int             n, k, pid;
+    mailbox_t*      mb;
+    l5msg_t*        m;
+
+    l5->sched_timer = -1;
+
+    for( k=0; k<MAX_PROCESSES; k++ )
+    {
+        pid = (l5->next_pid + k) % MAX_PROCESSES;
+        mb  = &l5->mailbox[pid];
+        for( n=0; n<L5_QUANTUM && budget > 0 && (m = mb->head) != NULL; n++ )
+        {
+            if( !consume( pid, m->src_address, m->src_port, m->data, m->length ) )
+            {
+                busy++;
+                break;
+            }
+            mb->head = m->next;
+            if( mb->head == NULL ) mb->tail = NULL;
+            mb->len--;
+            budget--;
+            free( m );
+        }
+        if( mb->head ) waiting++;
+    }
+    l5->next_pid = (l5->next_pid + 1) % MAX_PROCESSES;
+
+    if( waiting )
+    {
+        /* at once if only the budget has stopped us */
+        schedule( busy == waiting ? L5_RETRY : 0 );
+    }
+}
+
+static void schedule( int ms )
+{
+    struct timeval now;
+    struct timeval delay;
+
+    if( this_node->l5->sched_timer >= 0 )
+    {
+        return;
+    }
+    delay.tv_sec  = ms / 1000;
+    delay.tv_usec = (ms % 1000) * 1000;
+    irq_get_time( &now );
+    timeradd( &now, &delay, &now );
+    this_node->l5->sched_timer = register_timeout_cb( now, &run_processes, NULL );
+}
+
+/*
+ * Called by the transport layer when a message for the process
+ * dest_pid has arrived.
+ * A positive return value means that the message has been taken.
+ * A zero return value means that the process's mailbox is full, and
+ * the transport layer should offer the message again later.
+ */
 int l5_recv( int dest_pid, int src_address, int src_port, const char* l5buf, int sz )
 {
-    return slow_receiver( l5buf, sz );
+    struct L5State* l5 = this_node->l5;
+    mailbox_t*      mb;
+    l5msg_t*        m;
+
+    if( dest_pid < 0 || dest_pid >= MAX_PROCESSES )
+    {
+        dest_pid = 0;
+    }
+    mb = &l5->mailbox[dest_pid];
+
+    /* nothing waits for this process: no need to queue */
+    if( mb->head == NULL && consume( dest_pid, src_address, src_port, l5buf, sz ) )
+    {
+        return 1;
+    }
+
+    if( mb->len >= MAILBOX_SIZE )
+    {
+        mb->full++;
+        return 0;
+    }
+    m = (l5msg_t*)malloc( sizeof(l5msg_t) + sz );
+    if( m == 0 )
+    {
+        return 0;
+    }
+    m->src_address = src_address;
+    m->src_port    = src_port;
+    m->length      = sz;
+    m->next        = NULL;
+    memcpy( m->data, l5buf, sz );
+
+    if( mb->tail ) mb->tail->next = m;
+    else           mb->head = m;
+    mb->tail = m;
+    mb->len++;
+
+    schedule( L5_RETRY );
+    return 1;
+}
+
+/*
+ * How often the mailbox of a process has refused a message.
+ */
+unsigned long l5_refused( int pid )
+{
+    return this_node->l5->mailbox[pid].full;
+}
+
+/*
+ * Print the mailboxes that have been used.
+ */
+void l5_print_stats( )
+{
+    struct L5State* l5 = this_node->l5;
+    int             pid;
+
+    fprintf( stderr, "application layer:\n" );
+    for( pid=0; pid<MAX_PROCESSES; pid++ )
+    {
+        mailbox_t* mb = &l5->mailbox[pid];
+        if( mb->delivered || mb->len || mb->full )
+        {
+            fprintf( stderr, "    process %d: %lu messages delivered, %d waiting, %lu refused on a full mailbox\n",
+                             pid, mb->delivered, mb->len, mb->full );
+        }
+    }
 }
@@ -4,8 +4,15 @@
 /* see comments in the c file */
 
 void l5_init( );
+void l5_set_quiet( int quiet );
+void l5_counters( int* links_up, int* msgs_received, long* bytes_received );
+void l5_print_stats( );
+unsigned long l5_refused( int pid );
 void l5_linkup( int other_address, const char* other_hostname, int other_port );
+void l5_linkdown( int other_address );
+void l5_unreachable( int other_address );
 
+void l5_writable( int other_address, int other_port, int own_port );
 void l5_handle_keyboard( );
 int l5_recv( int dest_pid, int src_address, int src_port, const char* l5buf, int sz );
 
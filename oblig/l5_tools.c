@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "irq.h"
+#include "node.h"
+#include "l4_trans.h"
+#include "l5_app.h"
+#include "l5_tools.h"
+#include "slow_receiver.h"
+#include "hdr.h"
+#include "varint.h"
+#include "logger.h"
+
+/*
+ * Measuring tools that run through the whole stack, beside the
+ * application layer. Every node has a responder for PING and a sink
+ * for PERF. They belong to the process TOOLS_PID, so their messages
+ * go through its mailbox like those of any other process.
+ *
+ *   PING <address> [count] [size] sends count requests of size bytes
+ *   to the responder at TOOLS_PORT, one every PING_INTERVAL ms. The
+ *   responder sends them back. A request carries the time it was sent
+ *   in the clock of the sender, so the clocks need not agree. The
+ *   round trip times are kept in a HDR histogram, and min, avg, p99
+ *   and max are reported at the end.
+ *
+ *   PERF <address> <port> <seconds> asks the sink to count what
+ *   arrives at port, and then keeps the transport layer's queue to
+ *   it full for that many seconds. The sink writes the data with
+ *   slow_receiver, like any other process, so a test measures the
+ *   stack up to a receiver of that speed. It reports the bytes it
+ *   received, and how often its mailbox refused a message, every
+ *   PERF_INTERVAL ms. The sender adds the retransmissions of the
+ *   connection in the interval. What is still queued when the time
+ *   is up is not counted, the sink keeps the port and throws it away
+ *   until nothing has come for PERF_INTERVAL ms.
+ *
+ * The control messages start with a type byte, followed by varints.
+ * The data of PERF is not looked at.
+ *
+ * The reports are written to stderr at once, like STATS, after
+ * flushing what the logger still has queued, so that they keep their
+ * place among the log messages.
+ */
+#define PING_INTERVAL 1000    /* ms */
+#define PING_WAIT     10000   /* ms after the last request */
+#define PING_MIN_SIZE (1 + VARINT_MAX + 8)
+#define PING_MAX_SIZE 1024
+#define PERF_INTERVAL 1000    /* ms */
+#define PERF_WAIT     5000    /* ms for an answer of the sink */
+#define PERF_SEGMENT  1024
+
+enum
+{
+    PING_REQUEST = 1,    /* seq, 8 bytes time, padding */
+    PING_REPLY,          /* the same */
+    PERF_START,          /* port */
+    PERF_REPORT,         /* interval, bytes, refused, last */
+    PERF_END             /* port */
+};
+
+/*
+ * The private state of the tools of one node.
+ */
+struct ToolsState
+{
+    /* PING */
+    int           ping_running;
+    int           ping_address;
+    int           ping_count;
+    int           ping_size;
+    int           ping_sent;
+    int           ping_received;
+    int           ping_timer;
+    hdr_t*        rtt;            /* us */
+
+    /* PERF, sending */
+    int           perf_address;   /* -1 when no PERF runs */
+    int           perf_port;
+    int           perf_seconds;
+    enum { PERF_STARTING, PERF_SENDING, PERF_ENDING } perf_state;
+    int           perf_timer;
+    unsigned long perf_sent;      /* bytes */
+    unsigned long perf_received;  /* bytes, as reported by the sink */
+    unsigned long perf_refused;
+    unsigned long perf_rexmits;   /* of the connection, at the last report */
+    unsigned long perf_rexmits0;  /* of the connection, at the start */
+    char          perf_buf[PERF_SEGMENT];
+
+    /* PERF, receiving */
+    int           sink_address;   /* -1 when no PERF comes in */
+    int           sink_port;      /* -1 when the sink has no port */
+    int           sink_timer;
+    int           sink_interval;
+    unsigned long sink_bytes;     /* in this interval */
+    unsigned long sink_refused;   /* of the mailbox, at the start of the interval */
+};
+
+static void timer_in( int* timer, int ms, void (*cb)(void*), void* param )
+{
+    struct timeval now;
+    struct timeval delay;
+
+    delay.tv_sec  = ms / 1000;
+    delay.tv_usec = (ms % 1000) * 1000;
+    irq_get_time( &now );
+    timeradd( &now, &delay, &now );
+    *timer = register_timeout_cb( now, cb, param );
+}
+
+static long long now_us( )
+{
+    struct timeval now;
+    irq_get_time( &now );
+    return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+static void send_control( int address, const unsigned char* buf, int length )
+{
+    if( l4_send( address, TOOLS_PORT, TOOLS_PORT, (const char*)buf, length ) < 0 )
+    {
+        logmsg_limited( LL_WARN, "Could not send a tool message to %d\n", address );
+    }
+}
+
+/*
+ * Call at the start of the program, from l5_init.
+ */
+void tools_init( )
+{
+    struct ToolsState* t;
+
+    t = (struct ToolsState*)calloc( 1, sizeof(struct ToolsState) );
+    if( t == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in tools_init\n" );
+        exit( -1 );
+    }
+    this_node->tools = t;
+
+    t->ping_timer   = -1;
+    t->perf_address = -1;
+    t->perf_timer   = -1;
+    t->sink_address = -1;
+    t->sink_port    = -1;
+    t->sink_timer   = -1;
+
+    l4_getport( TOOLS_PID, TOOLS_PORT );
+}
+
+/*
+ * PING
+ */
+static void ping_done( )
+{
+    struct ToolsState* t = this_node->tools;
+
+    if( t->ping_timer >= 0 )
+    {
+        remove_timeout( t->ping_timer );
+        t->ping_timer = -1;
+    }
+    logger_flush( );
+    fprintf( stderr, "PING %d: %d sent, %d received",
+                     t->ping_address, t->ping_sent, t->ping_received );
+    if( t->rtt->total > 0 )
+    {
+        fprintf( stderr, ", rtt min/avg/p99/max %.3f/%.3f/%.3f/%.3f ms",
+                         t->rtt->min / 1000.0, hdr_mean( t->rtt ) / 1000.0,
+                         hdr_percentile( t->rtt, 99.0 ) / 1000.0, t->rtt->max / 1000.0 );
+    }
+    fprintf( stderr, "\n" );
+    t->ping_running = 0;
+}
+
+static void ping_tick( void* param )
+{
+    struct ToolsState* t = this_node->tools;
+    unsigned char      buf[PING_MAX_SIZE];
+    long long          sent;
+    int                n;
+
+    t->ping_timer = -1;
+    if( t->ping_sent == t->ping_count )
+    {
+        /* the rest are lost */
+        ping_done( );
+        return;
+    }
+
+    memset( buf, 0, t->ping_size );
+    buf[0] = PING_REQUEST;
+    n      = 1 + varint_put( &buf[1], t->ping_sent );
+    sent   = now_us( );
+    memcpy( &buf[n], &sent, sizeof(sent) );
+    send_control( t->ping_address, buf, t->ping_size );
+    t->ping_sent++;
+
+    timer_in( &t->ping_timer, t->ping_sent == t->ping_count ? PING_WAIT : PING_INTERVAL,
+              &ping_tick, NULL );
+}
+
+/*
+ * Start PING to address. Only one runs at a time.
+ */
+void tools_ping( int address, int count, int size )
+{
+    struct ToolsState* t = this_node->tools;
+
+    if( t->ping_running )
+    {
+        logmsg( LL_WARN, "PING to %d is still running\n", t->ping_address );
+        return;
+    }
+    if( t->rtt == NULL )
+    {
+        t->rtt = (hdr_t*)malloc( sizeof(hdr_t) );
+        if( t->rtt == NULL )
+        {
+            logmsg( LL_ERROR, "Not enough memory in tools_ping\n" );
+            return;
+        }
+    }
+    if( size < PING_MIN_SIZE ) size = PING_MIN_SIZE;
+    if( size > PING_MAX_SIZE ) size = PING_MAX_SIZE;
+
+    hdr_reset( t->rtt );
+    t->ping_running  = 1;
+    t->ping_address  = address;
+    t->ping_count    = count > 0 ? count : 1;
+    t->ping_size     = size;
+    t->ping_sent     = 0;
+    t->ping_received = 0;
+    ping_tick( NULL );
+}
+
+static void ping_reply( int src_address, const unsigned char* buf, int length )
+{
+    struct ToolsState* t = this_node->tools;
+    unsigned int       seq;
+    long long          sent;
+    long long          rtt;
+    int                n;
+
+    n = varint_get( &buf[1], length-1, &seq );
+    if( t->rtt == NULL || t->ping_address != src_address || n <= 0 || 1+n+(int)sizeof(sent) > length )
+    {
+        return;
+    }
+    memcpy( &sent, &buf[1+n], sizeof(sent) );
+    rtt = now_us( ) - sent;
+    if( rtt < 0 ) rtt = 0;
+
+    if( !t->ping_running )
+    {
+        /* the transport layer has no losses, only delays */
+        logmsg( LL_INFO, "late reply from %d: seq %u, %.3f ms\n", src_address, seq, rtt / 1000.0 );
+        return;
+    }
+
+    hdr_record( t->rtt, rtt );
+    t->ping_received++;
+    logger_flush( );
+    fprintf( stderr, "%d bytes from %d: seq %u, %.3f ms\n", length, src_address, seq, rtt / 1000.0 );
+
+    if( t->ping_received == t->ping_count )
+    {
+        ping_done( );
+    }
+}
+
+/*
+ * PERF, sending
+ */
+static void perf_push( )
+{
+    struct ToolsState* t = this_node->tools;
+
+    while( t->perf_state == PERF_SENDING
+        && l4_send( t->perf_address, t->perf_port, t->perf_port, t->perf_buf, PERF_SEGMENT ) >= 0 )
+    {
+        t->perf_sent += PERF_SEGMENT;
+    }
+}
+
+static void perf_summary( )
+{
+    struct ToolsState* t = this_node->tools;
+
+    logger_flush( );
+    fprintf( stderr, "PERF %d:%d: %lu bytes sent, %lu received in %d s, %.1f kB/s, "
+                     "%lu retransmitted, %lu refused\n",
+                     t->perf_address, t->perf_port, t->perf_sent, t->perf_received,
+                     t->perf_seconds, t->perf_received / 1000.0 / t->perf_seconds,
+                     t->perf_rexmits - t->perf_rexmits0, t->perf_refused );
+    t->perf_address = -1;
+}
+
+static void perf_timeout( void* param )
+{
+    struct ToolsState* t = this_node->tools;
+    unsigned char      buf[1 + VARINT_MAX];
+
+    t->perf_timer = -1;
+    switch( t->perf_state )
+    {
+    case PERF_STARTING :
+        logger_flush( );
+        fprintf( stderr, "PERF %d:%d: no answer\n", t->perf_address, t->perf_port );
+        t->perf_address = -1;
+        break;
+    case PERF_SENDING :
+        /* the time is up, the sink sends its last report when it gets this */
+        t->perf_state = PERF_ENDING;
+        buf[0] = PERF_END;
+        send_control( t->perf_address, buf, 1 + varint_put( &buf[1], t->perf_port ) );
+        timer_in( &t->perf_timer, PERF_WAIT, &perf_timeout, NULL );
+        break;
+    case PERF_ENDING :
+        perf_summary( );
+        break;
+    }
+}
+
+/*
+ * Start PERF to port on address. Only one runs at a time.
+ */
+void tools_perf( int address, int port, int seconds )
+{
+    struct ToolsState* t = this_node->tools;
+    unsigned char      buf[1 + VARINT_MAX];
+    unsigned long      segs;
+
+    if( t->perf_address >= 0 )
+    {
+        logmsg( LL_WARN, "PERF to %d is still running\n", t->perf_address );
+        return;
+    }
+    if( port == TOOLS_PORT || seconds <= 0 )
+    {
+        logmsg( LL_WARN, "PERF needs a port other than %d and a time\n", TOOLS_PORT );
+        return;
+    }
+
+    t->perf_address  = address;
+    t->perf_port     = port;
+    t->perf_seconds  = seconds;
+    t->perf_state    = PERF_STARTING;
+    t->perf_sent     = 0;
+    t->perf_received = 0;
+    t->perf_refused  = 0;
+    t->perf_rexmits0 = 0;
+    l4_conn_counters( address, port, port, &segs, &t->perf_rexmits0 );
+    t->perf_rexmits  = t->perf_rexmits0;
+
+    /* the data starts when the sink has answered */
+    buf[0] = PERF_START;
+    send_control( address, buf, 1 + varint_put( &buf[1], port ) );
+    timer_in( &t->perf_timer, PERF_WAIT, &perf_timeout, NULL );
+}
+
+static void perf_report( int src_address, const unsigned char* buf, int length )
+{
+    struct ToolsState* t = this_node->tools;
+    unsigned int       v[4];     /* interval, bytes, refused, last */
+    unsigned long      segs;
+    unsigned long      rexmits = t->perf_rexmits;
+    int                off = 1;
+    int                i, n;
+
+    for( i=0; i<4; i++ )
+    {
+        n = varint_get( &buf[off], length-off, &v[i] );
+        if( n <= 0 )
+        {
+            return;
+        }
+        off += n;
+    }
+    if( t->perf_address != src_address )
+    {
+        return;
+    }
+
+    if( t->perf_state == PERF_STARTING )
+    {
+        /* the sink is ready */
+        remove_timeout( t->perf_timer );
+        t->perf_state = PERF_SENDING;
+        timer_in( &t->perf_timer, t->perf_seconds * 1000, &perf_timeout, NULL );
+        perf_push( );
+        return;
+    }
+
+    l4_conn_counters( t->perf_address, t->perf_port, t->perf_port, &segs, &rexmits );
+    t->perf_received += v[1];
+    t->perf_refused  += v[2];
+    logger_flush( );
+    fprintf( stderr, "PERF %d:%d %3u s: %8.1f kB/s, %lu retransmitted, %u refused\n",
+                     t->perf_address, t->perf_port, v[0],
+                     v[1] / 1000.0 * 1000 / PERF_INTERVAL, rexmits - t->perf_rexmits, v[2] );
+    t->perf_rexmits = rexmits;
+
+    if( v[3] && t->perf_state == PERF_ENDING )
+    {
+        remove_timeout( t->perf_timer );
+        t->perf_timer = -1;
+        perf_summary( );
+    }
+}
+
+/*
+ * Called by the application layer when a connection whose queue was
+ * full can take data again.
+ */
+void tools_writable( int other_address, int other_port, int own_port )
+{
+    struct ToolsState* t = this_node->tools;
+
+    if( t->perf_state == PERF_SENDING && t->perf_address == other_address
+     && t->perf_port == other_port && t->perf_port == own_port )
+    {
+        perf_push( );
+    }
+}
+
+/*
+ * PERF, receiving
+ */
+static void sink_send_report( int last )
+{
+    struct ToolsState* t = this_node->tools;
+    unsigned char      buf[1 + 4*VARINT_MAX];
+    unsigned long      refused = l5_refused( TOOLS_PID );
+    int                n = 1;
+
+    buf[0] = PERF_REPORT;
+    n += varint_put( &buf[n], t->sink_interval );
+    n += varint_put( &buf[n], t->sink_bytes );
+    n += varint_put( &buf[n], refused - t->sink_refused );
+    n += varint_put( &buf[n], last );
+    send_control( t->sink_address, buf, n );
+
+    t->sink_bytes   = 0;
+    t->sink_refused = refused;
+}
+
+static void sink_tick( void* param )
+{
+    struct ToolsState* t = this_node->tools;
+
+    t->sink_timer = -1;
+    t->sink_interval++;
+    sink_send_report( 0 );
+    timer_in( &t->sink_timer, PERF_INTERVAL, &sink_tick, NULL );
+}
+
+/*
+ * Timeout callback after the end of a test: give the port back when
+ * nothing has come in the last interval.
+ */
+static void sink_linger( void* param )
+{
+    struct ToolsState* t = this_node->tools;
+
+    t->sink_timer = -1;
+    if( t->sink_bytes > 0 )
+    {
+        t->sink_bytes = 0;
+        timer_in( &t->sink_timer, PERF_INTERVAL, &sink_linger, NULL );
+        return;
+    }
+    l4_putport( t->sink_port );
+    t->sink_port = -1;
+}
+
+static void sink_start( int src_address, int port )
+{
+    struct ToolsState* t = this_node->tools;
+
+    if( t->sink_address >= 0 && t->sink_address != src_address )
+    {
+        /* the sender gives up when it gets no answer */
+        logmsg( LL_WARN, "PERF from %d refused, PERF from %d is running\n", src_address, t->sink_address );
+        return;
+    }
+    if( t->sink_timer >= 0 )
+    {
+        remove_timeout( t->sink_timer );
+        t->sink_timer = -1;
+    }
+    if( t->sink_port >= 0 && t->sink_port != port )
+    {
+        l4_putport( t->sink_port );
+        t->sink_port = -1;
+    }
+    if( t->sink_port < 0 && l4_getport( TOOLS_PID, port ) < 0 )
+    {
+        logmsg( LL_WARN, "PERF from %d refused, port %d is in use\n", src_address, port );
+        t->sink_address = -1;
+        return;
+    }
+
+    t->sink_address  = src_address;
+    t->sink_port     = port;
+    t->sink_interval = 0;
+    t->sink_bytes    = 0;
+    t->sink_refused  = l5_refused( TOOLS_PID );
+    sink_send_report( 0 );
+    timer_in( &t->sink_timer, PERF_INTERVAL, &sink_tick, NULL );
+}
+
+static void sink_end( int src_address )
+{
+    struct ToolsState* t = this_node->tools;
+
+    if( t->sink_address != src_address )
+    {
+        return;
+    }
+    if( t->sink_timer >= 0 )
+    {
+        remove_timeout( t->sink_timer );
+    }
+    t->sink_interval++;
+    sink_send_report( 1 );
+    t->sink_address = -1;
+    timer_in( &t->sink_timer, PERF_INTERVAL, &sink_linger, NULL );
+}
+
+/*
+ * Called by the application layer with the messages for the process
+ * TOOLS_PID. Returns 0 if the sink is busy with PERF data, which then
+ * waits in the mailbox, and 1 if the message has been taken.
+ */
+int tools_recv( int src_address, int src_port, const char* buf, int length )
+{
+    struct ToolsState*   t = this_node->tools;
+    const unsigned char* p = (const unsigned char*)buf;
+    unsigned char        reply[PING_MAX_SIZE];
+    unsigned int         port;
+
+    if( src_port != TOOLS_PORT )
+    {
+        /* PERF data, or what is left of it after the test */
+        if( src_port == t->sink_port && t->sink_address == src_address )
+        {
+            if( slow_receiver( buf, length ) <= 0 )
+            {
+                return 0;
+            }
+            t->sink_bytes += length;
+        }
+        else if( src_port == t->sink_port && t->sink_address < 0 )
+        {
+            t->sink_bytes += length;
+        }
+        return 1;
+    }
+    if( length < 1 )
+    {
+        return 1;
+    }
+
+    switch( p[0] )
+    {
+    case PING_REQUEST :
+        if( length <= PING_MAX_SIZE )
+        {
+            memcpy( reply, p, length );
+            reply[0] = PING_REPLY;
+            send_control( src_address, reply, length );
+        }
+        break;
+    case PING_REPLY :
+        ping_reply( src_address, p, length );
+        break;
+    case PERF_START :
+        if( varint_get( &p[1], length-1, &port ) > 0 && port != TOOLS_PORT )
+        {
+            sink_start( src_address, port );
+        }
+        break;
+    case PERF_REPORT :
+        perf_report( src_address, p, length );
+        break;
+    case PERF_END :
+        sink_end( src_address );
+        break;
+    default :
+        break;
+    }
+    return 1;
+}
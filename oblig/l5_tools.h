@@ -0,0 +1,15 @@
+#ifndef L5_TOOLS_H
+#define L5_TOOLS_H
+
+/* see comments in the c file */
+
+#define TOOLS_PORT 7      /* the port of the responder and the sink */
+#define TOOLS_PID  15     /* the last process of the application layer */
+
+void tools_init( );
+void tools_ping( int address, int count, int size );
+void tools_perf( int address, int port, int seconds );
+int  tools_recv( int src_address, int src_port, const char* buf, int length );
+void tools_writable( int other_address, int other_port, int own_port );
+
+#endif /* L5_TOOLS_H */
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+
+/*
+ * Diagnostics. A message is formatted by the thread that logs it into
+ * a slot of a ring buffer, and a background thread writes the slots
+ * to stderr. So logging costs a vsnprintf and no system call on the
+ * event loop.
+ *
+ * The ring is a bounded queue with a sequence number per slot
+ * (Vyukov): a writer claims a slot with one compare-and-swap on head,
+ * fills it and publishes it by setting its sequence number. Any
+ * thread can log. When the ring is full, messages are dropped and
+ * counted, and the next message that fits says how many.
+ *
+ * The background thread sleeps when the ring is empty. A writer wakes
+ * it only if it is asleep, so a burst of messages costs one wakeup.
+ */
+#define LOG_SLOTS     1024        /* a power of 2 */
+#define LOG_SLOT_SIZE 248         /* bytes of text, longer messages are cut */
+#define LOG_BURST     5           /* messages per second from one place */
+#define LOG_IDLE_MS   100         /* the background thread checks this often anyway */
+
+struct LogSlot
+{
+    unsigned long seq;
+    int           length;
+    char          text[LOG_SLOT_SIZE];
+};
+
+int logger_level = LL_INFO;
+
+static struct LogSlot  ring[LOG_SLOTS];
+static unsigned long   head      = 0;    /* the next slot to claim */
+static unsigned long   tail      = 0;    /* the next slot to write out, background thread only */
+static unsigned long   dropped   = 0;
+static int             sleeping  = 0;
+static int             stopping  = 0;
+static int             started   = 0;
+
+static pthread_once_t  once      = PTHREAD_ONCE_INIT;
+static pthread_t       thread;
+static pthread_mutex_t lock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake      = PTHREAD_COND_INITIALIZER;
+
+static long long now_ms( )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Write out all published slots. Returns the number written.
+ */
+static int drain( )
+{
+    struct LogSlot* s;
+    int             n = 0;
+
+    for( ;; )
+    {
+        s = &ring[tail & (LOG_SLOTS-1)];
+        if( __atomic_load_n( &s->seq, __ATOMIC_ACQUIRE ) != tail + 1 )
+        {
+            return n;
+        }
+        fwrite( s->text, 1, s->length, stderr );
+        __atomic_store_n( &s->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE );
+        __atomic_store_n( &tail, tail + 1, __ATOMIC_RELEASE );
+        n++;
+    }
+}
+
+static void* logger_thread( void* arg )
+{
+    struct timespec until;
+
+    for( ;; )
+    {
+        if( drain( ) > 0 )
+        {
+            continue;
+        }
+
+        pthread_mutex_lock( &lock );
+        __atomic_store_n( &sleeping, 1, __ATOMIC_SEQ_CST );
+        if( drain( ) == 0 )
+        {
+            if( __atomic_load_n( &stopping, __ATOMIC_ACQUIRE ) )
+            {
+                pthread_mutex_unlock( &lock );
+                return NULL;
+            }
+            clock_gettime( CLOCK_REALTIME, &until );
+            until.tv_nsec += LOG_IDLE_MS * 1000000L;
+            if( until.tv_nsec >= 1000000000L )
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait( &wake, &lock, &until );
+        }
+        __atomic_store_n( &sleeping, 0, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &lock );
+    }
+    return NULL;
+}
+
+/*
+ * Write out what is left when the program ends.
+ */
+static void logger_stop( )
+{
+    __atomic_store_n( &stopping, 1, __ATOMIC_RELEASE );
+    pthread_mutex_lock( &lock );
+    pthread_cond_signal( &wake );
+    pthread_mutex_unlock( &lock );
+    pthread_join( thread, NULL );
+}
+
+static void start( )
+{
+    unsigned long i;
+
+    for( i=0; i<LOG_SLOTS; i++ )
+    {
+        ring[i].seq = i;
+    }
+    if( pthread_create( &thread, NULL, &logger_thread, NULL ) != 0 )
+    {
+        return;
+    }
+    started = 1;
+    atexit( &logger_stop );
+}
+
+/*
+ * Claim a slot, or return NULL if the ring is full.
+ */
+static struct LogSlot* claim( )
+{
+    unsigned long   pos = __atomic_load_n( &head, __ATOMIC_RELAXED );
+    struct LogSlot* s;
+    long            diff;
+
+    for( ;; )
+    {
+        s    = &ring[pos & (LOG_SLOTS-1)];
+        diff = (long)(__atomic_load_n( &s->seq, __ATOMIC_ACQUIRE ) - pos);
+        if( diff == 0 )
+        {
+            if( __atomic_compare_exchange_n( &head, &pos, pos + 1, 0,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                return s;
+            }
+        }
+        else if( diff < 0 )
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n( &head, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static void publish( struct LogSlot* s )
+{
+    __atomic_store_n( &s->seq, (s->seq) + 1, __ATOMIC_RELEASE );
+    if( __atomic_load_n( &sleeping, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &lock );
+        pthread_cond_signal( &wake );
+        pthread_mutex_unlock( &lock );
+    }
+}
+
+static void vwrite( int level, unsigned long suppressed, const char* fmt, va_list ap )
+{
+    struct LogSlot* s;
+    unsigned long   lost;
+    int             n = 0;
+
+    pthread_once( &once, &start );
+    if( !started )
+    {
+        vfprintf( stderr, fmt, ap );
+        return;
+    }
+
+    s = claim( );
+    if( s == NULL )
+    {
+        __atomic_fetch_add( &dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    lost = __atomic_exchange_n( &dropped, 0, __ATOMIC_RELAXED );
+    if( lost > 0 )
+    {
+        n = snprintf( s->text, LOG_SLOT_SIZE, "(%lu log messages lost)\n", lost );
+    }
+    n += vsnprintf( s->text + n, LOG_SLOT_SIZE - n, fmt, ap );
+    if( n >= LOG_SLOT_SIZE ) n = LOG_SLOT_SIZE - 1;
+    if( suppressed > 0 && n < LOG_SLOT_SIZE - 1 )
+    {
+        n += snprintf( s->text + n, LOG_SLOT_SIZE - n, "(and %lu like it before)\n", suppressed );
+        if( n >= LOG_SLOT_SIZE ) n = LOG_SLOT_SIZE - 1;
+    }
+    s->length = n;
+    publish( s );
+}
+
+/*
+ * Only messages up to this level are written.
+ */
+void logger_set_level( int level )
+{
+    logger_level = level;
+}
+
+/*
+ * The same by name, error, warn, info or debug. Returns -1 if there
+ * is no level by that name.
+ */
+int logger_set_level_name( const char* name )
+{
+    static const char* names[] = { "error", "warn", "info", "debug" };
+    int                i;
+
+    for( i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++ )
+    {
+        if( strcmp( name, names[i] ) == 0 )
+        {
+            logger_set_level( i );
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void logger_write( int level, const char* fmt, ... )
+{
+    va_list ap;
+
+    va_start( ap, fmt );
+    vwrite( level, 0, fmt, ap );
+    va_end( ap );
+}
+
+/*
+ * Like logger_write, but at most LOG_BURST messages per second from
+ * the place in the code that limit belongs to. The next message
+ * that is written says how many have been left out.
+ */
+void logger_write_limited( logger_limit_t* limit, int level, const char* fmt, ... )
+{
+    va_list   ap;
+    long long now = now_ms( );
+
+    if( now - limit->window >= 1000 )
+    {
+        limit->window = now;
+        limit->count  = 0;
+    }
+    if( ++limit->count > LOG_BURST )
+    {
+        limit->suppressed++;
+        return;
+    }
+
+    va_start( ap, fmt );
+    vwrite( level, limit->suppressed, fmt, ap );
+    va_end( ap );
+    limit->suppressed = 0;
+}
+
+/*
+ * Wait until everything that has been logged is written, so that
+ * what is printed directly afterwards comes after it.
+ */
+void logger_flush( )
+{
+    struct timespec pause = { 0, 1000000 };
+
+    if( !started )
+    {
+        return;
+    }
+    while( __atomic_load_n( &tail, __ATOMIC_ACQUIRE ) != __atomic_load_n( &head, __ATOMIC_ACQUIRE ) )
+    {
+        pthread_mutex_lock( &lock );
+        pthread_cond_signal( &wake );
+        pthread_mutex_unlock( &lock );
+        nanosleep( &pause, NULL );
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/* see comments in the c file */
+
+enum
+{
+    LL_ERROR = 0,
+    LL_WARN,
+    LL_INFO,
+    LL_DEBUG
+};
+
+/*
+ * Messages above this level are not even compiled in, for example
+ * with make LOG_COMPILED=LL_WARN.
+ */
+#ifndef LOG_COMPILED
+#define LOG_COMPILED LL_DEBUG
+#endif
+
+/*
+ * The state of the rate limit of one place in the code.
+ */
+struct LoggerLimit
+{
+    long long     window;       /* ms, the start of the current second */
+    int           count;        /* messages in it */
+    unsigned long suppressed;
+};
+typedef struct LoggerLimit logger_limit_t;
+
+extern int logger_level;
+
+#define logmsg( level, ... ) \
+    do { \
+        if( (level) <= LOG_COMPILED && (level) <= logger_level ) \
+            logger_write( (level), __VA_ARGS__ ); \
+    } while( 0 )
+
+/* for errors that can repeat on every packet */
+#define logmsg_limited( level, ... ) \
+    do { \
+        static logger_limit_t limit_; \
+        if( (level) <= LOG_COMPILED && (level) <= logger_level ) \
+            logger_write_limited( &limit_, (level), __VA_ARGS__ ); \
+    } while( 0 )
+
+void logger_set_level( int level );
+int  logger_set_level_name( const char* name );
+void logger_write( int level, const char* fmt, ... ) __attribute__((format(printf, 2, 3)));
+void logger_write_limited( logger_limit_t* limit, int level, const char* fmt, ... )
+                           __attribute__((format(printf, 3, 4)));
+void logger_flush( );
+
+#endif /* LOGGER_H */
@@ -0,0 +1,236 @@
+#include <string.h>
+#include <math.h>
+
+#include "lz.h"
+
+/*
+ * A fast LZ77 compressor in the style of LZ4. The output is a
+ * sequence of
+ *   token     literal length (high nibble) and match length - 4
+ *             (low nibble), 15 means that more length bytes follow
+ *   literals
+ *   offset    2 bytes, little endian, back to the start of the match
+ *   lengths   the extra length bytes of the match, 255 means more
+ * and ends with a token and literals only. Matches are found with
+ * one hash table lookup of the next 4 bytes, there is no search.
+ */
+#define MIN_MATCH     4
+#define LAST_LITERALS 5      /* the end is never part of a match */
+#define MAX_OFFSET    65535
+#define HASH_BITS     12
+
+/* how many bytes lz_entropy looks at */
+#define PROBE_SAMPLES 256
+
+static unsigned read32( const unsigned char* p )
+{
+    unsigned v;
+    memcpy( &v, p, sizeof(v) );
+    return v;
+}
+
+static unsigned hash4( unsigned v )
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * Write a length that doesn't fit into a nibble. Returns the new
+ * output position, or NULL if the output is full.
+ */
+static unsigned char* put_length( unsigned char* op, unsigned char* end, int length )
+{
+    while( length >= 255 )
+    {
+        if( op >= end ) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if( op >= end ) return NULL;
+    *op++ = length;
+    return op;
+}
+
+static unsigned char* put_sequence( unsigned char* op, unsigned char* end,
+                                    const unsigned char* literals, int num_literals,
+                                    int offset, int match_length )
+{
+    unsigned char* token = op++;
+    int            ml    = match_length - MIN_MATCH;
+
+    if( op > end ) return NULL;
+
+    *token = (num_literals < 15 ? num_literals : 15) << 4;
+    if( num_literals >= 15 && (op = put_length( op, end, num_literals - 15 )) == NULL )
+        return NULL;
+
+    if( op + num_literals > end ) return NULL;
+    memcpy( op, literals, num_literals );
+    op += num_literals;
+
+    if( match_length == 0 )
+    {
+        return op;
+    }
+
+    if( op + 2 > end ) return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    *token |= ml < 15 ? ml : 15;
+    if( ml >= 15 && (op = put_length( op, end, ml - 15 )) == NULL )
+        return NULL;
+    return op;
+}
+
+/*
+ * Compress length bytes of src into dst. Returns the compressed size,
+ * or 0 if it would not be smaller than capacity.
+ */
+int lz_compress( const char* src, int length, char* dst, int capacity )
+{
+    const unsigned char* in     = (const unsigned char*)src;
+    unsigned char*       op     = (unsigned char*)dst;
+    unsigned char*       end    = op + capacity;
+    int                  table[1 << HASH_BITS];
+    int                  ip     = 0;
+    int                  anchor = 0;
+    int                  limit  = length - LAST_LITERALS - MIN_MATCH;
+    int                  ref;
+    int                  ml;
+    unsigned             h;
+
+    memset( table, -1, sizeof(table) );
+
+    while( ip < limit )
+    {
+        h        = hash4( read32( in + ip ) );
+        ref      = table[h];
+        table[h] = ip;
+
+        if( ref < 0 || ip - ref > MAX_OFFSET || read32( in + ref ) != read32( in + ip ) )
+        {
+            ip++;
+            continue;
+        }
+
+        ml = MIN_MATCH;
+        while( ip + ml < length - LAST_LITERALS && in[ref + ml] == in[ip + ml] )
+        {
+            ml++;
+        }
+
+        op = put_sequence( op, end, in + anchor, ip - anchor, ip - ref, ml );
+        if( op == NULL ) return 0;
+
+        ip    += ml;
+        anchor = ip;
+    }
+
+    op = put_sequence( op, end, in + anchor, length - anchor, 0, 0 );
+    if( op == NULL ) return 0;
+    return op - (unsigned char*)dst;
+}
+
+/*
+ * Decompress length bytes of src into dst. Returns the decompressed
+ * size, or -1 if the input is broken or doesn't fit into capacity.
+ */
+int lz_decompress( const char* src, int length, char* dst, int capacity )
+{
+    const unsigned char* ip     = (const unsigned char*)src;
+    const unsigned char* in_end = ip + length;
+    unsigned char*       op     = (unsigned char*)dst;
+    unsigned char*       end    = op + capacity;
+    int                  token;
+    int                  n;
+    int                  offset;
+    int                  b;
+
+    while( ip < in_end )
+    {
+        token = *ip++;
+
+        n = token >> 4;
+        if( n == 15 )
+        {
+            do
+            {
+                if( ip >= in_end ) return -1;
+                b  = *ip++;
+                n += b;
+            } while( b == 255 );
+        }
+        if( ip + n > in_end || op + n > end ) return -1;
+        memcpy( op, ip, n );
+        ip += n;
+        op += n;
+
+        if( ip == in_end )
+        {
+            break;    /* the last sequence has no match */
+        }
+
+        if( ip + 2 > in_end ) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip    += 2;
+        if( offset == 0 || offset > op - (unsigned char*)dst ) return -1;
+
+        n = token & 15;
+        if( n == 15 )
+        {
+            do
+            {
+                if( ip >= in_end ) return -1;
+                b  = *ip++;
+                n += b;
+            } while( b == 255 );
+        }
+        n += MIN_MATCH;
+        if( op + n > end ) return -1;
+
+        /* byte by byte, the match may overlap the output */
+        while( n-- > 0 )
+        {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+    return op - (unsigned char*)dst;
+}
+
+/*
+ * A cheap guess whether a buffer compresses: the entropy in bits per
+ * byte of up to PROBE_SAMPLES bytes spread over the buffer. Random or
+ * already compressed data is close to 8, text is around 4 to 5.
+ */
+double lz_entropy( const char* buf, int length )
+{
+    int    count[256];
+    int    step = length > PROBE_SAMPLES ? length / PROBE_SAMPLES : 1;
+    int    samples = 0;
+    double bits = 0;
+    double p;
+    int    i;
+
+    if( length <= 0 )
+    {
+        return 0;
+    }
+
+    memset( count, 0, sizeof(count) );
+    for( i=0; i<length; i+=step )
+    {
+        count[(unsigned char)buf[i]]++;
+        samples++;
+    }
+    for( i=0; i<256; i++ )
+    {
+        if( count[i] )
+        {
+            p     = (double)count[i] / samples;
+            bits -= p * log2( p );
+        }
+    }
+    return bits;
+}
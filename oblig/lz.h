@@ -0,0 +1,10 @@
+#ifndef LZ_H
+#define LZ_H
+
+/* see comments in the c file */
+
+int    lz_compress( const char* src, int length, char* dst, int capacity );
+int    lz_decompress( const char* src, int length, char* dst, int capacity );
+double lz_entropy( const char* buf, int length );
+
+#endif /* LZ_H */
@@ -1,13 +1,61 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "irq.h"
+#include "node.h"
 #include "l1_phys.h"
 #include "l2_link.h"
 #include "l3_net.h"
 #include "l4_trans.h"
 #include "l5_app.h"
+#include "logger.h"
+#include "checkpoint.h"
+
+/*
+ * Plug in all the cables that are listed in a topology file. Every
+ * line contains the host name and the port of one neighbour:
+ *
+ *     # comment
+ *     somehost.ifi.uio.no 4711
+ *     127.0.0.1           4712
+ *
+ * All connections are set up at the same time, the host names are
+ * resolved in the background.
+ */
+static void connect_topology( const char* filename )
+{
+    FILE* f;
+    char  line[1024];
+    char  hostname[1024];
+    int   port;
+    int   lineno = 0;
+
+    f = fopen( filename, "r" );
+    if( f == 0 )
+    {
+        perror( "Error opening topology file" );
+        exit( -1 );
+    }
+
+    while( fgets( line, sizeof(line), f ) )
+    {
+        lineno++;
+        if( sscanf( line, " %1023s", hostname ) != 1 || hostname[0] == '#' )
+        {
+            continue;
+        }
+        if( sscanf( line, " %1023s %d", hostname, &port ) != 2 )
+        {
+            fprintf( stderr, "%s:%d: expected <host> <port>\n", filename, lineno );
+            continue;
+        }
+        l1_connect( hostname, port );
+    }
+
+    fclose( f );
+}
 
 int main( int argc, char* argv[] )
 {
@@ -17,12 +65,129 @@ int main( int argc, char* argv[] )
     int          local_mac_address;
     int          local_host_address;
     int          phys_device;
+    int          opt;
+    const char*  topology = NULL;
+
+    int          liveness_ms = 250;
+    int          detect_mult = 3;
 
-    if( argc != 3 )
+    int          codel_target = 5;
+    int          codel_interval = 100;
+
+    int          shaper_rate = 0;
+    int          shaper_burst = 0;
+
+    int          fec_block = 0;
+    int          fec_parity = 4;
+
+    int          busy_poll_us = 0;
+    int          busy_poll_cpu = -1;
+
+    while( (opt = getopt( argc, argv, "VdDzTIHf:B:M:q:c:r:F:E:L:b:C:P:" )) != -1 )
+    {
+        switch( opt )
+        {
+        case 'c' :
+            if( l4_set_default_cc( optarg ) < 0 )
+                argc = 0;
+            break;
+        case 'z' :
+            l4_set_default_compression( 1 );
+            break;
+        case 'T' :
+            l1_set_timestamping( 1 );
+            break;
+        case 'I' :
+            l1_set_io_thread( 1 );
+            break;
+        case 'F' :
+            if( sscanf( optarg, "%d,%d", &fec_block, &fec_parity ) < 1 )
+                argc = 0;
+            break;
+        case 'H' :
+            l2_set_header_compression( 1 );
+            break;
+        case 'E' :
+            if( strcmp( optarg, "hash" ) == 0 )
+                l3_set_multipath( L3_MP_HASH );
+            else if( strcmp( optarg, "stripe" ) == 0 )
+                l3_set_multipath( L3_MP_STRIPE );
+            else
+                argc = 0;
+            break;
+        case 'L' :
+            if( logger_set_level_name( optarg ) < 0 )
+                argc = 0;
+            break;
+        case 'r' :
+            if( sscanf( optarg, "%d,%d", &shaper_rate, &shaper_burst ) < 1 )
+                argc = 0;
+            break;
+        case 'q' :
+            if( sscanf( optarg, "%d,%d", &codel_target, &codel_interval ) < 1 )
+                argc = 0;
+            break;
+        case 'b' :
+            irq_set_budget( atoi(optarg) );
+            break;
+        case 'C' :
+            checkpoint_set_file( optarg );
+            break;
+        case 'P' :
+            if( sscanf( optarg, "%d,%d", &busy_poll_us, &busy_poll_cpu ) < 1 )
+                argc = 0;
+            break;
+        case 'B' :
+            liveness_ms = atoi(optarg);
+            break;
+        case 'M' :
+            detect_mult = atoi(optarg);
+            break;
+        case 'f' :
+            topology = optarg;
+            break;
+        case 'V' :
+            irq_set_virtual_time( 1 );
+            break;
+        case 'd' :
+            l1_set_wire( WIRE_DELAYED );
+            break;
+        case 'D' :
+            l1_set_wire( WIRE_DELAYED_DROPPING );
+            break;
+        default :
+            argc = 0; /* print usage below */
+            break;
+        }
+    }
+
+    if( argc - optind != 2 )
     {
-        fprintf( stderr, "Usage: %s <port> <id>\n"
+        fprintf( stderr, "Usage: %s [-V] [-d|-D] [-z] [-T] [-I] [-H] [-f <topology>] [-B <ms>] [-M <mult>]\n"
+                         "          [-q <target ms>[,<interval ms>]] [-c reno|cubic|bbr]\n"
+                         "          [-r <bytes/s>[,<burst bytes>]] [-F <block>[,<max parity>]] [-E hash|stripe]\n"
+                         "          [-L error|warn|info|debug] [-b <frames>] [-C <file>] [-P <us>[,<cpu>]] <port> <id>\n"
                          "       <port> is the UDP port used on this machine\n"
-                         "       <id> is the fake MAC address of this machine\n",
+                         "       <id> is the fake MAC address of this machine\n"
+                         "       -V   run on virtual time: skip idle waiting for timeouts\n"
+                         "       -d   send through delayed_sendto\n"
+                         "       -D   send through delayed_dropping_sendto\n"
+                         "       -z   compress the payload of connections\n"
+                         "       -T   measure latencies with kernel timestamps, see STATS\n"
+                         "       -I   receive and send frames in batches in an I/O thread\n"
+                         "       -H   compress the headers of frames, on all nodes\n"
+                         "       -F   FEC with blocks of this many frames and up to max parity frames (default off, 4)\n"
+                         "       -E   spread packets over equal-cost paths by flow hash or striping (default hash)\n"
+                         "       -L   log messages up to this level (default info)\n"
+                         "       -b   frames taken from the socket before timers and keyboard are checked (default 64)\n"
+                         "       -C   keep links and routes in this file and restore them at the start\n"
+                         "       -P   busy poll for this long after a frame instead of sleeping, and pin to cpu (default off)\n"
+                         "       -f   connect to all <host> <port> lines of a topology file\n"
+                         "       -B   link liveness interval in ms, 0 is off (default 250)\n"
+                         "       -M   declare a link down after this many silent intervals (default 3)\n"
+                         "       -q   CoDel target and interval of the link queues, 0 is off (default 5,100)\n"
+                         "       -c   congestion control of new connections (default reno)\n"
+                         "       -r   shape every link to this rate, 0 is off (default 0)\n",
                          argv[0] );
         exit( -1 );
     }
@@ -31,8 +196,8 @@ int main( int argc, char* argv[] )
      * Read information from the command line. This is very primitive.
      * Refine as you see fit.
      */
-    local_port       = atoi(argv[1]);
-    local_unique_id  = atoi(argv[2]);  /* use for MAC and network address */
+    local_port       = atoi(argv[optind]);
+    local_unique_id  = atoi(argv[optind+1]);  /* use for MAC and network address */
 
     /*
      * Fill the structs necessary for initializing all the
@@ -44,18 +209,31 @@ int main( int argc, char* argv[] )
     local_mac_address  = local_unique_id;
     local_host_address = local_unique_id;
 
+    l1_set_liveness( liveness_ms, detect_mult );
+    l1_set_shaper( shaper_rate, shaper_burst );
+    l2_set_codel( codel_target, codel_interval );
+    l2_set_fec( fec_block, fec_parity );
+    irq_set_busy_poll( busy_poll_us, busy_poll_cpu );
+
+    node_create( local_unique_id );
+
     /*
      * Initialize all layers. This can include setting up all the
      * network connections, but it doesn't have to. It is also OK
      * to send connect-requests and handle the responses later, in
      * the handle_events loop. Your choice.
      */
-    l1_init( udp_socket_port );
+    l1_init( udp_socket_port, local_mac_address );
     l2_init( local_mac_address, phys_device );
     l3_init( local_host_address );
     l4_init( );
     l5_init( /* whatever you need */ );
 
+    if( topology )
+    {
+        connect_topology( topology );
+    }
+
     /*
      * An endless loop for processing everything that happens on this
      * machine.
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "node.h"
+#include "logger.h"
+
+node_t* this_node = NULL;
+
+/*
+ * Create a new node and make it the current node. The state of the
+ * layers is allocated by their init functions, which must be called
+ * afterwards, in order from l1_init to l5_init.
+ */
+node_t* node_create( int id )
+{
+    node_t* node = (node_t*)calloc( 1, sizeof(node_t) );
+    if( node == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in node_create\n" );
+        exit( -1 );
+    }
+
+    node->id         = id;
+    node->udp_socket = -1;
+
+    this_node = node;
+    return node;
+}
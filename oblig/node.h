@@ -0,0 +1,53 @@
+#ifndef NODE_H
+#define NODE_H
+
+/*
+ * A node is one complete protocol stack: one UDP socket and the
+ * private state of every layer. The normal program has exactly one
+ * node. The simulator creates many nodes in the same process and
+ * switches between them.
+ *
+ * Every layer keeps its state in its own struct, which is only
+ * defined in the layer's c file. It is inappropriate for other
+ * layers to see or change it.
+ */
+struct L1State;
+struct L2State;
+struct L3State;
+struct L4State;
+struct L5State;
+struct RoutingState;
+struct ToolsState;
+struct CheckpointState;
+struct SlowReceiverState;
+
+struct Node
+{
+    int id;
+    int udp_socket;   /* the one socket used for all sending and receiving */
+
+    struct L1State* l1;
+    struct L2State* l2;
+    struct L3State* l3;
+    struct L4State* l4;
+    struct L5State* l5;
+
+    struct RoutingState* routing;   /* beside l3 */
+    struct ToolsState*   tools;     /* beside l5 */
+
+    struct CheckpointState* checkpoint;   /* NULL without a checkpoint file */
+    struct SlowReceiverState* receiver;   /* NULL until the first message */
+};
+typedef struct Node node_t;
+
+/*
+ * The node whose code is currently running. All layer functions work
+ * on this node. The event loop and the timers set it before they call
+ * into the layers, like an operating system switching between
+ * processes.
+ */
+extern node_t* this_node;
+
+node_t* node_create( int id );
+
+#endif /* NODE_H */
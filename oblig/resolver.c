@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "irq.h"
+#include "node.h"
+#include "resolver.h"
+#include "logger.h"
+
+#define NUM_THREADS  8
+#define CACHE_SIZE   256        /* hash buckets */
+#define CACHE_TTL    300        /* seconds a resolved address is valid */
+#define NEGATIVE_TTL 10         /* seconds a failed lookup is remembered */
+
+/*
+ * Someone who waits for a name to be resolved.
+ */
+struct Waiter
+{
+    ResolvedFunc   callback;
+    void*          parameter;
+    node_t*        node;
+    struct Waiter* next;
+};
+typedef struct Waiter waiter_t;
+
+/*
+ * A cache entry for one host name. While the lookup is in progress,
+ * further requests for the same name are added to the waiters and
+ * don't start another lookup.
+ */
+struct CacheEntry
+{
+    char*              hostname;
+    struct in_addr     addr;
+    int                ok;
+    int                pending;
+    struct timeval     expires;
+    waiter_t*          waiters;
+    struct CacheEntry* next;        /* hash chain */
+    struct CacheEntry* next_job;    /* job or completion queue */
+};
+typedef struct CacheEntry entry_t;
+
+static entry_t* cache[CACHE_SIZE];
+
+/*
+ * Jobs go from the select loop to the threads, completions come back.
+ * Both queues are protected by the mutex. Only the hostname, addr and
+ * ok fields of an entry are touched by the threads, and only while it
+ * is pending.
+ */
+static pthread_mutex_t lock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  job_ready  = PTHREAD_COND_INITIALIZER;
+static entry_t*        jobs       = NULL;
+static entry_t*        jobs_tail  = NULL;
+static entry_t*        completed  = NULL;
+
+static int             started    = 0;
+static int             wakeup[2]  = { -1, -1 };
+
+static unsigned int hash( const char* s )
+{
+    unsigned int h = 5381;
+    while( *s ) h = h*33 + (unsigned char)*s++;
+    return h % CACHE_SIZE;
+}
+
+/*
+ * The resolver threads. They take a job, look it up with the
+ * blocking getaddrinfo() and report the completion through the pipe.
+ */
+static void* resolver_thread( void* arg )
+{
+    struct addrinfo  hints;
+    struct addrinfo* res;
+    entry_t*         e;
+    char             c = 0;
+
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    for( ;; )
+    {
+        pthread_mutex_lock( &lock );
+        while( jobs == NULL ) pthread_cond_wait( &job_ready, &lock );
+        e = jobs;
+        jobs = e->next_job;
+        if( jobs == NULL ) jobs_tail = NULL;
+        pthread_mutex_unlock( &lock );
+
+        e->ok = 0;
+        if( getaddrinfo( e->hostname, NULL, &hints, &res ) == 0 )
+        {
+            e->addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+            e->ok   = 1;
+            freeaddrinfo( res );
+        }
+
+        pthread_mutex_lock( &lock );
+        e->next_job = completed;
+        completed = e;
+        pthread_mutex_unlock( &lock );
+
+        if( write( wakeup[1], &c, 1 ) < 0 )
+        {
+            /* the pipe is full, so the select loop will wake up anyway */
+        }
+    }
+    return NULL;
+}
+
+static void start_threads( )
+{
+    pthread_t tid;
+    int       i;
+
+    if( pipe( wakeup ) < 0 )
+    {
+        logmsg( LL_ERROR, "Failed to create resolver pipe: %s\n", strerror( errno ) );
+        exit( -1 );
+    }
+    fcntl( wakeup[0], F_SETFL, O_NONBLOCK );
+    fcntl( wakeup[1], F_SETFL, O_NONBLOCK );
+
+    for( i=0; i<NUM_THREADS; i++ )
+    {
+        if( pthread_create( &tid, NULL, &resolver_thread, NULL ) != 0 )
+        {
+            logmsg( LL_ERROR, "Failed to start resolver thread\n" );
+            exit( -1 );
+        }
+        pthread_detach( tid );
+    }
+    started = 1;
+}
+
+/*
+ * Call all waiters of a resolved entry, each with its own node.
+ */
+static void notify_waiters( entry_t* e )
+{
+    node_t*   current = this_node;
+    waiter_t* w;
+
+    while( (w = e->waiters) != NULL )
+    {
+        e->waiters = w->next;
+        this_node = w->node;
+        (*w->callback)( w->parameter, e->ok ? &e->addr : NULL );
+        free( w );
+    }
+    this_node = current;
+}
+
+void resolver_lookup( const char* hostname, ResolvedFunc cb, void* param )
+{
+    struct in_addr in;
+    struct timeval now;
+    entry_t*       e;
+    waiter_t*      w;
+    unsigned int   h;
+
+    if( inet_aton( hostname, &in ) )
+    {
+        (*cb)( param, &in );
+        return;
+    }
+
+    irq_get_time( &now );
+
+    h = hash( hostname );
+    for( e = cache[h]; e; e = e->next )
+    {
+        if( strcmp( e->hostname, hostname ) == 0 ) break;
+    }
+
+    if( e && !e->pending && timercmp( &now, &e->expires, < ) )
+    {
+        (*cb)( param, e->ok ? &e->addr : NULL );
+        return;
+    }
+
+    w = (waiter_t*)malloc( sizeof(waiter_t) );
+    if( w == 0 )
+    {
+        logmsg( LL_ERROR, "Not enough memory in resolver_lookup\n" );
+        (*cb)( param, NULL );
+        return;
+    }
+    w->callback  = cb;
+    w->parameter = param;
+    w->node      = this_node;
+
+    if( e == NULL )
+    {
+        e = (entry_t*)calloc( 1, sizeof(entry_t) );
+        if( e == 0 )
+        {
+            logmsg( LL_ERROR, "Not enough memory in resolver_lookup\n" );
+            free( w );
+            (*cb)( param, NULL );
+            return;
+        }
+        e->hostname = strdup( hostname );
+        e->next = cache[h];
+        cache[h] = e;
+    }
+
+    w->next = e->waiters;
+    e->waiters = w;
+
+    if( e->pending )
+    {
+        /* somebody else has asked already */
+        return;
+    }
+
+    if( !started ) start_threads( );
+
+    e->pending  = 1;
+    e->next_job = NULL;
+    pthread_mutex_lock( &lock );
+    if( jobs_tail ) jobs_tail->next_job = e;
+    else            jobs = e;
+    jobs_tail = e;
+    pthread_cond_signal( &job_ready );
+    pthread_mutex_unlock( &lock );
+}
+
+int resolver_fd( )
+{
+    return wakeup[0];
+}
+
+/*
+ * Called by the select loop when lookups have completed. Caches the
+ * results and calls everybody who has been waiting for them.
+ */
+void resolver_handle_event( )
+{
+    struct timeval now;
+    struct timeval ttl;
+    entry_t*       list;
+    entry_t*       e;
+    char           buf[64];
+
+    while( read( wakeup[0], buf, sizeof(buf) ) > 0 )
+    {
+        /* just empty the pipe */
+    }
+
+    pthread_mutex_lock( &lock );
+    list = completed;
+    completed = NULL;
+    pthread_mutex_unlock( &lock );
+
+    irq_get_time( &now );
+
+    while( (e = list) != NULL )
+    {
+        list = e->next_job;
+
+        ttl.tv_sec  = e->ok ? CACHE_TTL : NEGATIVE_TTL;
+        ttl.tv_usec = 0;
+        timeradd( &now, &ttl, &e->expires );
+        e->pending = 0;
+
+        notify_waiters( e );
+    }
+}
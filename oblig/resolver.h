@@ -0,0 +1,27 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netinet/in.h>
+
+/*
+ * Asynchronous host name resolution for the select loop.
+ *
+ * resolver_lookup() never blocks. Numeric addresses and names that
+ * are in the cache are resolved at once, other names are looked up by
+ * a pool of resolver threads. The callback is always called from the
+ * select loop, with the node that asked being the current node. addr
+ * is NULL if the name could not be resolved.
+ */
+typedef void (*ResolvedFunc)( void* param, const struct in_addr* addr );
+
+void resolver_lookup( const char* hostname, ResolvedFunc cb, void* param );
+
+/*
+ * The file descriptor that becomes readable when lookups have
+ * completed, or -1 if no thread has been started yet. The select
+ * loop calls resolver_handle_event() when it is readable.
+ */
+int  resolver_fd( );
+void resolver_handle_event( );
+
+#endif /* RESOLVER_H */
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "irq.h"
+#include "node.h"
+#include "fabric.h"
+#include "l1_phys.h"
+#include "l2_link.h"
+#include "l3_net.h"
+#include "l4_trans.h"
+#include "l5_app.h"
+#include "l5_tools.h"
+
+/*
+ * The network simulator. It creates many nodes in one process and
+ * connects them through the in-memory link fabric instead of UDP
+ * sockets. Everything runs on virtual time, so the delays of the
+ * delayed senders cost no real time.
+ *
+ * Node i has the address i and listens on port BASE_PORT+i.
+ */
+
+#define BASE_PORT 20000
+#define MAX_NODES 1000
+#define SIM_PORT  100      /* transport port used for the test traffic */
+
+/* Interval between two test messages of a node */
+static struct timeval send_interval = { 0, 10000 };
+
+static node_t** nodes;
+static node_t** node_by_socket;
+static int      num_nodes;
+
+static enum { LINE, RING, STAR, FULL } topology = RING;
+
+static int      stop_run      = 0;
+static int      expected_links;
+
+static int      msgs_per_link = 10;
+static int      msg_size      = 100;
+static int      all_nodes     = 0;   /* test traffic to every node, not only neighbours */
+static int      multicast     = 0;   /* node 1 sends the test traffic to the group of all */
+static int      ping_count    = 0;   /* node 1 pings the last node */
+static int      perf_seconds  = 0;   /* node 1 runs PERF to the last node */
+static int      msgs_sent     = 0;
+static int      msgs_refused  = 0;
+
+/*
+ * The neighbours of node i (1..num_nodes) in the topology.
+ * Returns the number of neighbours written to nb.
+ */
+static int neighbours( int i, int* nb )
+{
+    int n = 0;
+    int j;
+
+    switch( topology )
+    {
+    case LINE :
+        if( i > 1 )         nb[n++] = i-1;
+        if( i < num_nodes ) nb[n++] = i+1;
+        break;
+    case RING :
+        if( num_nodes > 1 ) nb[n++] = i > 1 ? i-1 : num_nodes;
+        if( num_nodes > 2 ) nb[n++] = i < num_nodes ? i+1 : 1;
+        break;
+    case STAR :
+        if( i == 1 ) for( j=2; j<=num_nodes; j++ ) nb[n++] = j;
+        else         nb[n++] = 1;
+        break;
+    case FULL :
+        for( j=1; j<=num_nodes; j++ ) if( j != i ) nb[n++] = j;
+        break;
+    }
+    return n;
+}
+
+/*
+ * Timeout callback: stop the run when all cables are plugged in.
+ * Links keep their timers running, so the event loop never becomes
+ * idle by itself.
+ */
+static void check_links_up( void* param )
+{
+    struct timeval now;
+    struct timeval interval = { 0, 100000 };
+    int            i, l, m, up = 0;
+    long           b;
+
+    for( i=1; i<=num_nodes; i++ )
+    {
+        this_node = nodes[i];
+        l5_counters( &l, &m, &b );
+        up += l;
+    }
+
+    if( up >= 2*expected_links )
+    {
+        stop_run = 1;
+        return;
+    }
+
+    irq_get_time( &now );
+    timeradd( &now, &interval, &now );
+    register_timeout_cb( now, &check_links_up, NULL );
+}
+
+/*
+ * Process events until nothing is left to do, the run is stopped or
+ * the virtual time limit is reached. Frames are handed to the nodes whose sockets
+ * have received something, and timeouts are called in between.
+ */
+static void run( const struct timeval* until )
+{
+    struct timeval now;
+    int            s;
+
+    stop_run = 0;
+    while( !stop_run )
+    {
+        while( (s = fabric_next_ready( )) >= 0 )
+        {
+            this_node = node_by_socket[s];
+            while( fabric_pending( s ) ) l1_handle_event( );
+        }
+
+        irq_get_time( &now );
+        if( timercmp( &now, until, > ) ) break;
+
+        if( !irq_run_next_timeout( ) ) break;
+    }
+}
+
+/*
+ * Timeout callback of every node: send one test message to every
+ * neighbour, or to every other node with -x, until msgs_per_link
+ * messages have been sent. With -g, node 1 sends to all nodes at
+ * once.
+ */
+static void send_test_messages( void* param )
+{
+    int*           left = (int*)param;
+    int            nb[MAX_NODES];
+    int            n, k;
+    char*          msg;
+    struct timeval now;
+
+    msg = (char*)calloc( 1, msg_size );
+    if( multicast )
+    {
+        snprintf( msg, msg_size, "%d->all", this_node->id );
+        if( l4_send_group( L3_GROUP_ALL, SIM_PORT, msg, msg_size ) < 0 ) msgs_refused++;
+        msgs_sent += num_nodes - 1;
+        n = 0;
+    }
+    else if( all_nodes )
+    {
+        for( n=0, k=1; k<=num_nodes; k++ )
+        {
+            if( k != this_node->id ) nb[n++] = k;
+        }
+    }
+    else
+    {
+        n = neighbours( this_node->id, nb );
+    }
+    for( k=0; k<n; k++ )
+    {
+        snprintf( msg, msg_size, "%d->%d", this_node->id, nb[k] );
+        if( l4_send( nb[k], SIM_PORT, SIM_PORT, msg, msg_size ) < 0 ) msgs_refused++;
+        msgs_sent++;
+    }
+    free( msg );
+
+    if( --(*left) > 0 )
+    {
+        irq_get_time( &now );
+        timeradd( &now, &send_interval, &now );
+        register_timeout_cb( now, &send_test_messages, left );
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    struct timeval start_real, end_real, start_virt, now, limit, until;
+    int            nb[MAX_NODES];
+    int*           left;
+    int            limit_sec = 60;
+    int            opt;
+    int            i, k, n;
+    int            links = 0, links_up = 0, msgs = 0;
+    long           bytes = 0;
+    unsigned long  segs_sent = 0, retransmits = 0, timeouts = 0;
+
+    num_nodes = 10;
+
+    while( (opt = getopt( argc, argv, "n:t:m:s:l:B:c:r:F:E:p:P:zHxgdD" )) != -1 )
+    {
+        switch( opt )
+        {
+        case 'n' : num_nodes     = atoi(optarg); break;
+        case 'm' : msgs_per_link = atoi(optarg); break;
+        case 's' : msg_size      = atoi(optarg); break;
+        case 'l' : limit_sec     = atoi(optarg); break;
+        case 'B' : l1_set_liveness( atoi(optarg), 3 ); break;
+        case 'c' : if( l4_set_default_cc( optarg ) < 0 ) num_nodes = 0; break;
+        case 'z' : l4_set_default_compression( 1 ); break;
+        case 'H' : l2_set_header_compression( 1 ); break;
+        case 'F' :
+            l2_set_fec( atoi(optarg), strchr( optarg, ',' ) ? atoi( strchr( optarg, ',' )+1 ) : 4 );
+            break;
+        case 'r' : l1_set_shaper( atoi(optarg), 0 ); break;
+        case 'E' : l3_set_multipath( strcmp( optarg, "stripe" ) == 0 ? L3_MP_STRIPE : L3_MP_HASH ); break;
+        case 'x' : all_nodes = 1; break;
+        case 'g' : multicast = 1; break;
+        case 'p' : ping_count   = atoi(optarg); break;
+        case 'P' : perf_seconds = atoi(optarg); break;
+        case 'd' : l1_set_wire( WIRE_DELAYED ); break;
+        case 'D' : l1_set_wire( WIRE_DELAYED_DROPPING ); break;
+        case 't' :
+            if(      !strcmp( optarg, "line" ) ) topology = LINE;
+            else if( !strcmp( optarg, "ring" ) ) topology = RING;
+            else if( !strcmp( optarg, "star" ) ) topology = STAR;
+            else if( !strcmp( optarg, "full" ) ) topology = FULL;
+            else num_nodes = 0;
+            break;
+        default :
+            num_nodes = 0;
+            break;
+        }
+    }
+
+    if( num_nodes < 1 || num_nodes > MAX_NODES || msg_size < 16 || optind != argc )
+    {
+        fprintf( stderr, "Usage: %s [-n nodes] [-t line|ring|star|full] [-m msgs] [-s size]\n"
+                         "          [-l seconds] [-B ms] [-c reno|cubic|bbr] [-r bytes/s]\n"
+                         "          [-F block[,parity]] [-E hash|stripe] [-x] [-g] [-z] [-H] [-d|-D]\n"
+                         "          [-p count] [-P seconds]\n"
+                         "       -n   number of nodes, 1..%d (default 10)\n"
+                         "       -t   topology (default ring)\n"
+                         "       -m   test messages per link and direction (default 10)\n"
+                         "       -s   size of a test message (default 100)\n"
+                         "       -l   limit of the virtual run time in seconds (default 60)\n"
+                         "       -B   link liveness interval in ms, 0 is off (default 250)\n"
+                         "       -c   congestion control of the transport layer (default reno)\n"
+                         "       -r   shape every link to this rate (default 0, off)\n"
+                         "       -F   FEC on the links, frames per block and max parity frames\n"
+                         "       -E   spread packets over equal-cost paths by flow hash or striping\n"
+                         "       -x   send test traffic to every node, through the routes\n"
+                         "       -g   node 1 multicasts the test traffic to all nodes\n"
+                         "       -p   node 1 pings the last node this many times\n"
+                         "       -P   node 1 runs PERF to the last node for this many seconds\n"
+                         "       -z   compress the payload of the transport layer\n"
+                         "       -H   compress the headers of frames\n"
+                         "       -d   send through delayed_sendto\n"
+                         "       -D   send through delayed_dropping_sendto\n",
+                         argv[0], MAX_NODES );
+        exit( -1 );
+    }
+
+    gettimeofday( &start_real, 0 );
+    irq_set_virtual_time( 1 );
+    fabric_enable( );
+
+    nodes          = (node_t**)calloc( num_nodes+1, sizeof(node_t*) );
+    node_by_socket = (node_t**)calloc( num_nodes, sizeof(node_t*) );
+
+    /*
+     * Boot all nodes.
+     */
+    for( i=1; i<=num_nodes; i++ )
+    {
+        nodes[i] = node_create( i );
+        l1_init( BASE_PORT+i, i );
+        l2_init( i, 0 );
+        l3_init( i );
+        l4_init( );
+        l5_init( );
+        l5_set_quiet( 1 );
+        l4_getport( 0, SIM_PORT );
+        node_by_socket[nodes[i]->udp_socket] = nodes[i];
+    }
+
+    /*
+     * Plug in the cables. The node with the smaller address connects.
+     */
+    for( i=1; i<=num_nodes; i++ )
+    {
+        this_node = nodes[i];
+        n = neighbours( i, nb );
+        for( k=0; k<n; k++ )
+        {
+            if( nb[k] > i )
+            {
+                l1_connect( "127.0.0.1", BASE_PORT+nb[k] );
+                links++;
+            }
+        }
+    }
+
+    irq_get_time( &start_virt );
+    limit.tv_sec  = limit_sec;
+    limit.tv_usec = 0;
+    timeradd( &start_virt, &limit, &until );
+
+    expected_links = links;
+    check_links_up( NULL );
+    run( &until );
+
+    /*
+     * Send test traffic to all neighbours, or to all nodes once the
+     * routes have settled.
+     */
+    if( all_nodes || multicast || ping_count > 0 || perf_seconds > 0 )
+    {
+        irq_get_time( &now );
+        now.tv_sec += 1;
+        run( &now );
+    }
+
+    left = (int*)calloc( num_nodes+1, sizeof(int) );
+    for( i=1; i<=(multicast ? 1 : num_nodes) && msgs_per_link > 0; i++ )
+    {
+        this_node = nodes[i];
+        left[i] = msgs_per_link;
+        irq_get_time( &now );
+        register_timeout_cb( now, &send_test_messages, &left[i] );
+    }
+
+    this_node = nodes[1];
+    if( ping_count > 0 )   tools_ping( num_nodes, ping_count, 64 );
+    if( perf_seconds > 0 ) tools_perf( num_nodes, SIM_PORT+1, perf_seconds );
+
+    run( &until );
+
+    for( i=1; i<=num_nodes; i++ )
+    {
+        int           l, m;
+        long          b;
+        unsigned long segs, rexmits, tos;
+        this_node = nodes[i];
+        l5_counters( &l, &m, &b );
+        l4_counters( &segs, &rexmits, &tos );
+        links_up    += l;
+        msgs        += m;
+        bytes       += b;
+        segs_sent   += segs;
+        retransmits += rexmits;
+        timeouts    += tos;
+    }
+
+    gettimeofday( &end_real, 0 );
+    timersub( &end_real, &start_real, &end_real );
+    irq_get_time( &now );
+    timersub( &now, &start_virt, &now );
+
+    printf( "nodes:              %d\n"
+            "links:              %d (%d up)\n"
+            "messages sent:      %d (%d refused)\n"
+            "messages delivered: %d (%ld bytes)\n"
+            "segments sent:      %lu (%lu retransmitted, %lu timeouts)\n"
+            "virtual time:       %ld.%06ld s\n"
+            "real time:          %ld.%06ld s\n",
+            num_nodes,
+            links, links_up/2,
+            msgs_sent, msgs_refused,
+            msgs, bytes,
+            segs_sent, retransmits, timeouts,
+            (long)now.tv_sec, (long)now.tv_usec,
+            (long)end_real.tv_sec, (long)end_real.tv_usec );
+
+    return 0;
+}
@@ -7,6 +7,8 @@
 #include <string.h>
 
 #include "slow_receiver.h"
+#include "irq.h"
+#include "node.h"
 
 /* Change the following line to a higher number if you get bored
  * watching your file transfer. But your code must work with this
@@ -14,18 +16,29 @@
  */
 #define SPEED 1000 /* kbyte/second */
 
-static int  testfile = 0;
+/*
+ * The rate budget belongs to the node, so that every node of the
+ * simulator is a receiver of its own. The output file is shared by
+ * all nodes of the process: a simulator with many nodes would
+ * otherwise leave as many files behind and run out of descriptors.
+ */
+struct SlowReceiverState
+{
+    int            writtenbytes;
+    struct timeval starttime;
+};
+
+static int  testfile = -1;
 static char filename[25];
 
 int slow_receiver( const char* buf, int length )
 {
-    static int            writtenbytes = 0;
-    static struct timeval starttime;
-    struct timeval        now;
-    double                sec;
-    int                   err;
+    struct SlowReceiverState* r = this_node->receiver;
+    struct timeval            now;
+    double                    sec;
+    int                       err;
 
-    if( !testfile )
+    if( testfile < 0 )
     {
         strcpy( filename, "./inf3190-test-XXXXXX" );
         testfile = mkstemp( filename );
@@ -34,14 +47,24 @@ int slow_receiver( const char* buf, int length )
             perror("Error opening output file");
             exit(-1);
         }
+    }
 
-        gettimeofday( &starttime, NULL );
+    if( r == NULL )
+    {
+        r = (struct SlowReceiverState*)calloc( 1, sizeof(struct SlowReceiverState) );
+        if( r == NULL )
+        {
+            perror("Not enough memory in slow_receiver");
+            exit(-1);
+        }
+        irq_get_time( &r->starttime );
+        this_node->receiver = r;
     }
-    gettimeofday( &now, NULL );
-    timersub( &now, &starttime, &now );
+    irq_get_time( &now );
+    timersub( &now, &r->starttime, &now );
     sec = now.tv_sec + (double)now.tv_usec/1000000.0;
 
-    if( writtenbytes < sec * SPEED )
+    if( r->writtenbytes < sec * SPEED )
     {
         err = write( testfile, buf, length );
         if( err < 0 )
@@ -63,7 +86,7 @@ int slow_receiver( const char* buf, int length )
                 return 0;
             }
         }
-        writtenbytes += length;
+        r->writtenbytes += length;
         return 1;
     }
     else
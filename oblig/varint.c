@@ -0,0 +1,69 @@
+#include "varint.h"
+
+/*
+ * Helpers for the compact headers of the layers. Small numbers such
+ * as addresses and windows are written as varints: 7 bits per byte,
+ * the lowest bits first, and the high bit set in all bytes but the
+ * last. Sequence numbers are written as their lowest 16 bits and
+ * expanded by the receiver, which knows roughly where they are.
+ */
+
+/*
+ * Write value at p. Returns the number of bytes written.
+ */
+int varint_put( unsigned char* p, unsigned int value )
+{
+    int n = 0;
+
+    while( value >= 0x80 )
+    {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+/*
+ * Read a varint from the length bytes at p. Returns the number of
+ * bytes read, or -1 if the varint is longer than the buffer.
+ */
+int varint_get( const unsigned char* p, int length, unsigned int* value )
+{
+    unsigned int v     = 0;
+    int          shift = 0;
+    int          n     = 0;
+
+    while( n < length && n < VARINT_MAX )
+    {
+        v |= (unsigned int)(p[n] & 0x7f) << shift;
+        if( !(p[n++] & 0x80) )
+        {
+            *value = v;
+            return n;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+void put16( unsigned char* p, unsigned int value )
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+unsigned int get16( const unsigned char* p )
+{
+    return (p[0] << 8) | p[1];
+}
+
+/*
+ * The 32-bit number whose lowest 16 bits are wire and which is
+ * closest to near. Works as long as the sender is less than 32768
+ * away from what the receiver expects.
+ */
+unsigned int expand16( unsigned int wire, unsigned int near )
+{
+    return near + (short)(wire - (near & 0xffff));
+}
@@ -0,0 +1,16 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+/* see comments in the c file */
+
+#define VARINT_MAX 5    /* bytes of the longest varint */
+
+int varint_put( unsigned char* p, unsigned int value );
+int varint_get( const unsigned char* p, int length, unsigned int* value );
+
+void         put16( unsigned char* p, unsigned int value );
+unsigned int get16( const unsigned char* p );
+
+unsigned int expand16( unsigned int wire, unsigned int near );
+
+#endif /* VARINT_H */